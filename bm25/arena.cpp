@@ -0,0 +1,172 @@
+#include <string.h>
+#include <sys/mman.h>
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+
+#include "arena.h"
+#include "numa.h"
+
+
+static inline uint64_t round_up(uint64_t size, uint64_t alignment) {
+	return (size + alignment - 1) & ~(alignment - 1);
+}
+
+static std::atomic<HugePageMode> huge_page_mode(HUGE_PAGES_TRANSPARENT);
+static std::atomic<bool> warned_no_huge_pages(false);
+
+void set_huge_page_mode(HugePageMode mode) {
+	huge_page_mode.store(mode, std::memory_order_relaxed);
+}
+
+HugePageMode get_huge_page_mode() {
+	return huge_page_mode.load(std::memory_order_relaxed);
+}
+
+char* map_huge_page_aligned(uint64_t size, int prot, int flags, int fd) {
+	// Reserve a huge page extra, then place the mapping at the first boundary.
+	uint64_t padded_size = size + ARENA_HUGE_PAGE_SIZE;
+	char* reserved = (char*)mmap(
+			NULL,
+			padded_size,
+			(fd == -1) ? prot : PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS,
+			-1,
+			0
+			);
+	if (reserved == MAP_FAILED) return NULL;
+
+	char* aligned = (char*)round_up((uint64_t)reserved, ARENA_HUGE_PAGE_SIZE);
+	if (fd != -1) {
+		char* data = (char*)mmap(aligned, size, prot, flags | MAP_FIXED, fd, 0);
+		if (data == MAP_FAILED) {
+			munmap(reserved, padded_size);
+			return NULL;
+		}
+	}
+
+	if (aligned > reserved) {
+		munmap(reserved, aligned - reserved);
+	}
+	uint64_t tail = round_up(size, ARENA_PAGE_SIZE);
+	if (aligned + tail < reserved + padded_size) {
+		munmap(aligned + tail, (reserved + padded_size) - (aligned + tail));
+	}
+	return aligned;
+}
+
+Arena::Arena(int32_t numa_node) :
+	numa_node(numa_node),
+	mapped_bytes(0),
+	used_bytes(0),
+	cursor(NULL),
+	end(NULL) {}
+
+Arena::~Arena() {
+	for (const ArenaBlock& block : blocks) {
+		munmap(block.data, block.size);
+	}
+}
+
+char* Arena::map_block(uint64_t size) {
+	bool huge = (size >= ARENA_HUGE_PAGE_SIZE);
+	size = round_up(size, ARENA_PAGE_SIZE);
+
+	HugePageMode mode = huge ? get_huge_page_mode() : HUGE_PAGES_OFF;
+	char* data = NULL;
+
+#ifdef MAP_HUGETLB
+	if (mode == HUGE_PAGES_EXPLICIT) {
+		// Pool pages are whole huge pages, so round the block up to them.
+		uint64_t huge_size = round_up(size, ARENA_HUGE_PAGE_SIZE);
+		data = (char*)mmap(
+				NULL,
+				huge_size,
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+				-1,
+				0
+				);
+		if (data == MAP_FAILED) {
+			data = NULL;
+			if (!warned_no_huge_pages.exchange(true)) {
+				std::cerr << "No free pages in the huge page pool. "
+						  << "Falling back to transparent huge pages." << std::endl;
+			}
+			mode = HUGE_PAGES_TRANSPARENT;
+		}
+		else {
+			size = huge_size;
+		}
+	}
+#endif
+
+	if (data == NULL) {
+		// A tail short of a whole huge page is backed by small pages.
+		data = huge ?
+			map_huge_page_aligned(size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1) :
+			(char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (data == NULL || data == MAP_FAILED) {
+			std::cerr << "Error mapping " << size << " bytes of arena memory." << std::endl;
+			std::exit(1);
+		}
+	}
+
+#ifdef MADV_HUGEPAGE
+	if (mode == HUGE_PAGES_TRANSPARENT) madvise(data, size, MADV_HUGEPAGE);
+#endif
+
+	// Nothing is touched yet, so every page faults in on numa_node.
+	if (numa_node >= 0) bind_to_numa_node(data, size, (uint16_t)numa_node);
+
+	ArenaBlock block;
+	block.data = data;
+	block.size = size;
+	blocks.push_back(block);
+	mapped_bytes += size;
+	return data;
+}
+
+void* Arena::allocate(uint64_t size, uint64_t alignment) {
+	if (size == 0) return NULL;
+
+	if (size > ARENA_BLOCK_SIZE / 4) {
+		used_bytes += size;
+		return map_block(size);
+	}
+
+	char* ptr = (char*)round_up((uint64_t)cursor, alignment);
+	if (cursor == NULL || ptr + size > end) {
+		// Double the arena with each block until blocks are huge pages.
+		uint64_t block_size = ARENA_BLOCK_SIZE;
+		if (mapped_bytes < ARENA_BLOCK_SIZE) {
+			block_size = std::max(mapped_bytes, (uint64_t)ARENA_MIN_BLOCK_SIZE);
+			block_size = std::max(block_size, round_up(size, ARENA_PAGE_SIZE));
+		}
+
+		cursor = map_block(block_size);
+		end    = cursor + blocks.back().size;
+		ptr    = cursor;
+	}
+
+	used_bytes += size;
+	cursor = ptr + size;
+	return ptr;
+}
+
+void* Arena::copy(const void* data, uint64_t size, uint64_t alignment) {
+	void* ptr = allocate(size, alignment);
+	if (size > 0) {
+		memcpy(ptr, data, size);
+	}
+	return ptr;
+}
+
+uint64_t Arena::get_mapped_bytes() const {
+	return mapped_bytes;
+}
+
+uint64_t Arena::get_used_bytes() const {
+	return used_bytes;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+
+// Blocks of a huge page or more start on a huge page boundary, so the
+// kernel can back them with huge pages and scoring walks postings with few
+// TLB misses. Smaller arenas, e.g. of a few appended rows, start with small
+// blocks and grow toward ARENA_BLOCK_SIZE.
+#define ARENA_PAGE_SIZE      4096
+#define ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define ARENA_MIN_BLOCK_SIZE (64 * 1024)
+#define ARENA_BLOCK_SIZE     ARENA_HUGE_PAGE_SIZE
+#define ARENA_ALIGNMENT      64
+
+// How blocks of a huge page or more are backed.
+// TRANSPARENT asks for transparent huge pages with madvise, which the kernel
+// honours when THP is set to always or madvise. EXPLICIT maps them from the
+// preallocated hugetlbfs pool (vm.nr_hugepages), falling back to TRANSPARENT
+// while the pool is empty. OFF leaves them to small pages.
+enum HugePageMode {
+	HUGE_PAGES_OFF,
+	HUGE_PAGES_TRANSPARENT,
+	HUGE_PAGES_EXPLICIT
+};
+
+// Process wide. Applies to blocks mapped from then on. TRANSPARENT by default.
+void set_huge_page_mode(HugePageMode mode);
+HugePageMode get_huge_page_mode();
+
+// Maps size bytes starting on a huge page boundary, of fd if not -1.
+// Trims the padding it maps to get there, so munmap(addr, size) frees it all.
+// For a file the boundary lines up the mapping with huge page offsets in the
+// file. NULL if the mapping failed.
+char* map_huge_page_aligned(uint64_t size, int prot, int flags, int fd);
+
+
+// Bump allocator over anonymous huge page aligned mappings.
+// Nothing is freed on its own. Deleting the arena unmaps every block at once,
+// so tearing down a partition costs one munmap per block instead of one free
+// per allocation. Allocations above a quarter of ARENA_BLOCK_SIZE get a block
+// of their own, so large arrays waste at most the rounding to a page.
+// Not thread safe. An arena is only allocated from by one thread at a time.
+class Arena {
+	public:
+		// Blocks are placed on numa_node if it isn't -1.
+		Arena(int32_t numa_node = -1);
+		~Arena();
+
+		Arena(const Arena&) = delete;
+		Arena& operator=(const Arena&) = delete;
+
+		// Zeroed, since blocks are fresh mappings and never reused. NULL for size 0.
+		void* allocate(uint64_t size, uint64_t alignment = ARENA_ALIGNMENT);
+
+		// Copies size bytes of data into the arena.
+		void* copy(const void* data, uint64_t size, uint64_t alignment = ARENA_ALIGNMENT);
+
+		// Bytes mapped, and the part of them handed out.
+		uint64_t get_mapped_bytes() const;
+		uint64_t get_used_bytes() const;
+
+	private:
+		typedef struct {
+			char*    data;
+			uint64_t size;
+		} ArenaBlock;
+
+		char* map_block(uint64_t size);
+
+		std::vector<ArenaBlock> blocks;
+		int32_t  numa_node;
+		uint64_t mapped_bytes;
+		uint64_t used_bytes;
+
+		// Free part of the current shared block.
+		char* cursor;
+		char* end;
+};
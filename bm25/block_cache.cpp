@@ -0,0 +1,258 @@
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <iostream>
+#include <algorithm>
+
+#include "block_cache.h"
+#include "arena.h"
+
+
+BlockCache::BlockCache(const std::string& path, uint64_t capacity) :
+	reads(0),
+	bytes_read(0) {
+	// Cached blocks are the only copy kept, so skip the page cache. Not every
+	// filesystem takes O_DIRECT, and some only refuse it on the first read.
+	direct_io = true;
+	fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+	if (fd == -1) {
+		direct_io = false;
+		fd = open(path.c_str(), O_RDONLY);
+	}
+	if (fd == -1) {
+		std::cerr << "Error opening index file: " << path << std::endl;
+		std::exit(1);
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) == -1) {
+		std::cerr << "Error getting index file size." << std::endl;
+		std::exit(1);
+	}
+	file_size = sb.st_size;
+
+	uint64_t frames_per_shard = (capacity + BLOCK_CACHE_NUM_SHARDS * BLOCK_CACHE_BLOCK_SIZE - 1) /
+		(BLOCK_CACHE_NUM_SHARDS * BLOCK_CACHE_BLOCK_SIZE);
+	frames_per_shard = std::max(frames_per_shard, (uint64_t)BLOCK_CACHE_MIN_FRAMES);
+
+	frames.resize(frames_per_shard * BLOCK_CACHE_NUM_SHARDS);
+	data_size = frames.size() * BLOCK_CACHE_BLOCK_SIZE;
+	data = map_huge_page_aligned(data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1);
+	if (data == NULL) {
+		std::cerr << "Error allocating " << data_size << " bytes of postings cache." << std::endl;
+		std::exit(1);
+	}
+
+	for (uint32_t shard_idx = 0; shard_idx < BLOCK_CACHE_NUM_SHARDS; ++shard_idx) {
+		Shard& shard = shards[shard_idx];
+		shard.first_frame = shard_idx * frames_per_shard;
+		shard.num_frames  = frames_per_shard;
+		shard.hand        = 0;
+		shard.num_waiting = 0;
+		shard.hits        = 0;
+		shard.misses      = 0;
+		shard.evictions   = 0;
+		shard.num_used    = 0;
+	}
+
+	if (direct_io && file_size > 0 && pread(fd, data, BLOCK_CACHE_BLOCK_SIZE, 0) < 0 && errno == EINVAL) {
+		close(fd);
+		direct_io = false;
+		fd = open(path.c_str(), O_RDONLY);
+		if (fd == -1) {
+			std::cerr << "Error opening index file: " << path << std::endl;
+			std::exit(1);
+		}
+	}
+}
+
+BlockCache::~BlockCache() {
+	munmap(data, data_size);
+	close(fd);
+}
+
+uint32_t BlockCache::claim_frame(Shard& shard, uint64_t block_id) {
+	// The first sweep may only clear reference bits.
+	for (uint32_t step = 0; step < 2 * shard.num_frames; ++step) {
+		uint32_t frame_idx = shard.first_frame + shard.hand;
+		shard.hand = (shard.hand + 1 == shard.num_frames) ? 0 : shard.hand + 1;
+
+		Frame& frame = frames[frame_idx];
+		if (frame.pins > 0 || frame.loading) continue;
+		if (frame.referenced) {
+			frame.referenced = false;
+			continue;
+		}
+
+		if (frame.used) {
+			shard.blocks.erase(frame.block_id);
+			++shard.evictions;
+		}
+		else {
+			++shard.num_used;
+		}
+
+		frame.block_id   = block_id;
+		frame.pins       = 0;
+		frame.used       = true;
+		frame.referenced = false;
+		frame.loading    = true;
+		shard.blocks[block_id] = frame_idx;
+		return frame_idx;
+	}
+	return UINT32_MAX;
+}
+
+void BlockCache::read_blocks(uint64_t block_id, const std::vector<uint32_t>& batch) {
+	struct iovec iov[BLOCK_CACHE_READ_AHEAD];
+	for (uint64_t idx = 0; idx < batch.size(); ++idx) {
+		iov[idx].iov_base = data + (uint64_t)batch[idx] * BLOCK_CACHE_BLOCK_SIZE;
+		iov[idx].iov_len  = BLOCK_CACHE_BLOCK_SIZE;
+	}
+
+	// The last block of the file is short.
+	const uint64_t offset = block_id * BLOCK_CACHE_BLOCK_SIZE;
+	const uint64_t size   = std::min(batch.size() * BLOCK_CACHE_BLOCK_SIZE, file_size - offset);
+
+	ssize_t n = preadv(fd, iov, batch.size(), offset);
+	if (n < 0) {
+		std::cerr << "Error reading index file (" << strerror(errno) << ")." << std::endl;
+		std::exit(1);
+	}
+
+	// Short reads are rare for regular files. Finish block by block.
+	uint64_t done = n;
+	while (done < size) {
+		uint64_t idx  = done / BLOCK_CACHE_BLOCK_SIZE;
+		uint64_t skip = done % BLOCK_CACHE_BLOCK_SIZE;
+		ssize_t m = pread(fd, (char*)iov[idx].iov_base + skip, BLOCK_CACHE_BLOCK_SIZE - skip, offset + done);
+		if (m <= 0) {
+			std::cerr << "Error reading index file (" << strerror(errno) << ")." << std::endl;
+			std::exit(1);
+		}
+		done += m;
+	}
+
+	if (!direct_io) {
+		posix_fadvise(fd, offset, size, POSIX_FADV_DONTNEED);
+	}
+	++reads;
+	bytes_read += size;
+
+	for (uint64_t idx = 0; idx < batch.size(); ++idx) {
+		Shard& shard = get_shard(block_id + idx);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		frames[batch[idx]].loading = false;
+		if (shard.num_waiting > 0) shard.loaded.notify_all();
+	}
+}
+
+const char* BlockCache::pin(uint64_t block_id, uint64_t last_block, uint32_t* frame) {
+	Shard& shard = get_shard(block_id);
+	std::unique_lock<std::mutex> lock(shard.mutex);
+
+	uint32_t claimed;
+	while (true) {
+		auto it = shard.blocks.find(block_id);
+		if (it == shard.blocks.end()) {
+			claimed = claim_frame(shard, block_id);
+			if (claimed != UINT32_MAX) break;
+		}
+		else if (!frames[it->second].loading) {
+			Frame& hit = frames[it->second];
+			++hit.pins;
+			hit.referenced = true;
+			++shard.hits;
+
+			*frame = it->second;
+			return data + (uint64_t)it->second * BLOCK_CACHE_BLOCK_SIZE;
+		}
+
+		// Being read by another thread, or every frame of the shard is pinned.
+		// Pins are held by cursors between reads, never while waiting here.
+		++shard.num_waiting;
+		shard.loaded.wait(lock);
+		--shard.num_waiting;
+	}
+
+	++shard.misses;
+	frames[claimed].pins       = 1;
+	frames[claimed].referenced = true;
+	lock.unlock();
+
+	// Read ahead the uncached blocks after it, up to the first cached one.
+	// Never waits for a frame, unlike the block asked for.
+	std::vector<uint32_t> batch = {claimed};
+	for (uint64_t next = block_id + 1; next <= last_block && batch.size() < BLOCK_CACHE_READ_AHEAD; ++next) {
+		Shard& next_shard = get_shard(next);
+		std::lock_guard<std::mutex> next_lock(next_shard.mutex);
+		if (next_shard.blocks.contains(next)) break;
+
+		uint32_t next_frame = claim_frame(next_shard, next);
+		if (next_frame == UINT32_MAX) break;
+		batch.push_back(next_frame);
+	}
+	read_blocks(block_id, batch);
+
+	*frame = claimed;
+	return data + (uint64_t)claimed * BLOCK_CACHE_BLOCK_SIZE;
+}
+
+void BlockCache::unpin(uint32_t frame_idx) {
+	Frame& frame = frames[frame_idx];
+	Shard& shard = get_shard(frame.block_id);
+
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	if (--frame.pins == 0 && shard.num_waiting > 0) {
+		shard.loaded.notify_all();
+	}
+}
+
+BlockCacheStats BlockCache::get_stats() {
+	BlockCacheStats stats;
+	memset(&stats, 0, sizeof(BlockCacheStats));
+
+	for (Shard& shard : shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		stats.hits      += shard.hits;
+		stats.misses    += shard.misses;
+		stats.evictions += shard.evictions;
+		stats.size      += shard.num_used * BLOCK_CACHE_BLOCK_SIZE;
+	}
+	stats.reads      = reads;
+	stats.bytes_read = bytes_read;
+	stats.capacity   = data_size;
+	stats.direct_io  = direct_io;
+	return stats;
+}
+
+
+BlockCursor::BlockCursor(BlockCache* cache, uint64_t end) :
+	cache(cache),
+	end(end),
+	last_block((end > 0) ? (end - 1) / BLOCK_CACHE_BLOCK_SIZE : 0),
+	block_data(NULL),
+	block_id(0),
+	frame(0) {}
+
+BlockCursor::~BlockCursor() {
+	if (block_data != NULL) cache->unpin(frame);
+}
+
+const char* BlockCursor::get(uint64_t pos, uint64_t* available) {
+	uint64_t id = pos / BLOCK_CACHE_BLOCK_SIZE;
+	if (block_data == NULL || id != block_id) {
+		// Unpinned first, so a cursor never holds a frame while waiting for one.
+		if (block_data != NULL) cache->unpin(frame);
+		block_data = cache->pin(id, last_block, &frame);
+		block_id   = id;
+	}
+
+	*available = std::min(end, (id + 1) * BLOCK_CACHE_BLOCK_SIZE) - pos;
+	return block_data + (pos - id * BLOCK_CACHE_BLOCK_SIZE);
+}
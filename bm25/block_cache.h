@@ -0,0 +1,133 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <string>
+#include <vector>
+
+#include <parallel_hashmap/phmap.h>
+
+// Fixed size cache of file blocks, for postings left on disk. Frames are
+// allocated once, so it never holds more than its capacity. Blocks map to
+// shards by id, each shard evicting its own frames with CLOCK. A miss reads
+// the block along with up to BLOCK_CACHE_READ_AHEAD - 1 uncached blocks
+// after it in one preadv, so long postings lists stream in large reads.
+// Reads bypass the page cache (O_DIRECT) where the filesystem allows it.
+#define BLOCK_CACHE_BLOCK_SIZE  (64 * 1024)
+#define BLOCK_CACHE_NUM_SHARDS  16
+#define BLOCK_CACHE_READ_AHEAD  8
+#define BLOCK_CACHE_MIN_FRAMES  4
+
+
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+
+	// preadv calls, and bytes they read. Read ahead blocks count here, not as misses.
+	uint64_t reads;
+	uint64_t bytes_read;
+	uint64_t evictions;
+
+	// Bytes of cached blocks, and of frames.
+	uint64_t size;
+	uint64_t capacity;
+
+	bool direct_io;
+} BlockCacheStats;
+
+
+class BlockCache {
+	public:
+		// Capacity is rounded up to BLOCK_CACHE_MIN_FRAMES frames per shard.
+		BlockCache(const std::string& path, uint64_t capacity);
+		~BlockCache();
+
+		BlockCache(const BlockCache&) = delete;
+		BlockCache& operator=(const BlockCache&) = delete;
+
+		// Data of block_id, valid until unpin(*frame). Blocks up to last_block
+		// may be read ahead. Short only for the last block of the file.
+		const char* pin(uint64_t block_id, uint64_t last_block, uint32_t* frame);
+		void unpin(uint32_t frame);
+
+		BlockCacheStats get_stats();
+
+	private:
+		typedef struct {
+			uint64_t block_id;
+			uint32_t pins;
+			bool     used;
+			bool     referenced;
+
+			// Claimed, read in progress. Waiters sleep on the shard's loaded.
+			bool     loading;
+		} Frame;
+
+		typedef struct {
+			std::mutex mutex;
+			std::condition_variable loaded;
+			phmap::flat_hash_map<uint64_t, uint32_t> blocks;
+
+			// Frames [first_frame, first_frame + num_frames) are the shard's.
+			uint32_t first_frame;
+			uint32_t num_frames;
+			uint32_t hand;
+			uint32_t num_waiting;
+
+			uint64_t hits;
+			uint64_t misses;
+			uint64_t evictions;
+			uint64_t num_used;
+		} Shard;
+
+		Shard& get_shard(uint64_t block_id) { return shards[block_id % BLOCK_CACHE_NUM_SHARDS]; }
+
+		// Frame for block_id, evicting with CLOCK. Holds shard.mutex.
+		// UINT32_MAX if every frame of the shard is pinned or loading.
+		uint32_t claim_frame(Shard& shard, uint64_t block_id);
+
+		// Reads the blocks of frames, block_id and on, and wakes their waiters.
+		void read_blocks(uint64_t block_id, const std::vector<uint32_t>& frames);
+
+		int      fd;
+		bool     direct_io;
+		uint64_t file_size;
+
+		char*    data;
+		uint64_t data_size;
+		std::vector<Frame> frames;
+		Shard    shards[BLOCK_CACHE_NUM_SHARDS];
+
+		std::atomic<uint64_t> reads;
+		std::atomic<uint64_t> bytes_read;
+};
+
+
+// Reads a cached file up to byte end, one pinned block at a time.
+// Inactive over a NULL cache.
+class BlockCursor {
+	public:
+		BlockCursor(BlockCache* cache, uint64_t end);
+		~BlockCursor();
+
+		BlockCursor(const BlockCursor&) = delete;
+		BlockCursor& operator=(const BlockCursor&) = delete;
+
+		bool is_active() const { return cache != NULL; }
+
+		// Data at pos, valid for *available bytes, up to the end of its block
+		// or of the range. Until the next get.
+		const char* get(uint64_t pos, uint64_t* available);
+
+	private:
+		BlockCache* cache;
+		uint64_t    end;
+		uint64_t    last_block;
+
+		const char* block_data;
+		uint64_t    block_id;
+		uint32_t    frame;
+};
@@ -1,15 +1,20 @@
 # cython: language_level=3
 
 cimport cython
+from cpython cimport array
 
 from libc.stdint cimport uint16_t, int32_t, uint32_t, uint64_t 
+from libc.string cimport memcpy
 from libcpp.vector cimport vector
 from libcpp.string cimport string
 from libcpp.pair cimport pair
+from libcpp.memory cimport shared_ptr
 from libcpp cimport bool
 
 from time import perf_counter
+import array
 import csv
+import json
 import os
 
 
@@ -30,13 +35,145 @@ cdef vector[string] ENGLISH_STOPWORDS = {
 
 cdef int INT_MAX = 2147483647
 
+cdef extern from "external_build.h":
+    ctypedef struct ExternalBuildConfig:
+        string   index_path
+        string   tmp_dir
+        uint64_t memory_budget
+        uint16_t num_threads
+        string   user_metadata
+
+cdef extern from "block_cache.h":
+    ctypedef struct BlockCacheStats:
+        uint64_t hits
+        uint64_t misses
+        uint64_t reads
+        uint64_t bytes_read
+        uint64_t evictions
+        uint64_t size
+        uint64_t capacity
+        bool     direct_io
+
 cdef extern from "engine.h":
     ctypedef struct BM25Result:
         uint64_t doc_id 
         float score
         uint16_t partition_id
 
+    ctypedef struct BM25BatchResult:
+        vector[uint64_t] doc_ids
+        vector[float]    scores
+        vector[uint16_t] partition_ids
+        vector[uint64_t] query_offsets
+
+    ctypedef struct BM25SpanResult:
+        vector[BM25Result] results
+        vector[uint64_t]   offsets
+        vector[uint32_t]   lengths
+        uint16_t           num_columns
+
+    ctypedef struct DocStoreStats:
+        uint64_t num_docs
+        uint64_t num_blocks
+        uint64_t raw_bytes
+        uint64_t stored_bytes
+        uint64_t cache_hits
+        uint64_t cache_misses
+        bool     compressed
+
+    ctypedef struct ColumnMemoryUsage:
+        uint64_t postings
+        uint64_t doc_sizes
+        uint64_t term_offsets
+        uint64_t doc_freqs
+        uint64_t vocab_buckets
+        uint64_t vocab_strings
+        uint64_t total
+
+    ctypedef struct PartitionMemoryUsage:
+        vector[ColumnMemoryUsage] columns
+        uint64_t line_offsets
+        uint64_t deleted_docs
+        uint64_t doc_store
+        uint64_t arena_unused
+        uint64_t total
+        uint64_t mapped
+
+    ctypedef struct MemoryUsage:
+        vector[PartitionMemoryUsage] partitions
+        uint64_t heap
+        uint64_t mapped
+        uint64_t source_file
+        uint64_t postings_cache
+        uint64_t total
+
+    ctypedef struct QueryCacheStats:
+        uint64_t hits
+        uint64_t misses
+        uint64_t size
+        uint64_t capacity
+
+    ctypedef struct LatencySummary:
+        uint64_t count
+        uint64_t total_ns
+        uint64_t max_ns
+        uint64_t p50_ns
+        uint64_t p90_ns
+        uint64_t p99_ns
+        uint64_t p999_ns
+
+    ctypedef struct QueryStatsSummary:
+        uint64_t num_queries
+        uint64_t postings_scanned
+        uint64_t bytes_decoded
+        uint64_t candidates
+        uint64_t partitions_touched
+        vector[LatencySummary] phase_latency
+        LatencySummary total_latency
+
+    ctypedef struct QueryStats:
+        uint64_t postings_scanned
+        uint64_t bytes_decoded
+        uint64_t candidates
+        uint64_t partitions_touched
+        uint64_t phase_ns[4]
+        uint64_t total_ns
+        bool     approximate
+
+    QueryStats get_last_query_stats() nogil
+
+    ctypedef struct MergePolicy:
+        uint32_t merge_factor
+        uint64_t min_segment_docs
+        uint64_t max_segment_docs
+        float    cpu_budget
+        uint64_t max_bytes_per_sec
+
+    cdef enum IndexWarmup:
+        WARMUP_NONE
+        WARMUP_POPULATE
+        WARMUP_LOCK
+
+    ctypedef struct TermExplanation:
+        string   term
+        uint16_t col_idx
+        uint64_t df
+        float    idf
+        bool     is_stop_word
+        bool     exceeds_max_df
+        vector[uint64_t] partition_posting_lengths
+        uint64_t walk_ns
+        vector[float] doc_contributions
+
+    ctypedef struct QueryExplanation:
+        vector[BM25Result]      results
+        vector[TermExplanation] terms
+
     cdef cppclass _BM25:
+        string filename
+        string user_metadata
+        vector[uint64_t] partition_boundaries
+
         _BM25(
                 string filename,
                 vector[string] search_col,
@@ -47,7 +184,20 @@ cdef extern from "engine.h":
                 uint16_t num_partitions,
                 const vector[string]& stopwords
                 ) nogil
-        _BM25(string db_dir) nogil
+        _BM25(
+                string filename,
+                vector[string] search_col,
+                float  bloom_df_threshold,
+                double bloom_fpr,
+                float  k1,
+                float  b,
+                uint16_t num_partitions,
+                const vector[string]& stopwords,
+                const ExternalBuildConfig& config
+                ) nogil
+        _BM25(string index_path) nogil
+        _BM25(string index_path, IndexWarmup warmup) nogil
+        _BM25(string index_path, IndexWarmup warmup, uint64_t postings_cache_bytes) nogil
         _BM25(
                 vector[vector[string]]& documents,
                 float  bloom_df_threshold,
@@ -58,6 +208,22 @@ cdef extern from "engine.h":
                 const vector[string]& stopwords
                 ) nogil
         vector[BM25Result] query(
+                string& query, 
+                uint32_t top_k, 
+                uint32_t query_max_df,
+                vector[float] boost_factors,
+                uint64_t deadline_us,
+                bool* approximate
+                ) nogil
+        void cancel_queries() nogil
+        BM25BatchResult query_batch(
+                vector[string]& queries, 
+                uint32_t top_k, 
+                uint32_t query_max_df,
+                vector[float] boost_factors,
+                bool shared_scan
+                ) nogil
+        QueryExplanation explain(
                 string& query, 
                 uint32_t top_k, 
                 uint32_t query_max_df,
@@ -67,14 +233,54 @@ cdef extern from "engine.h":
                 string& query, 
                 uint32_t k, 
                 uint32_t query_max_df,
-                vector[float] boost_factors
-                ) nogil 
+                vector[float] boost_factors,
+                vector[string]& column_names,
+                uint64_t deadline_us,
+                bool* approximate
+                ) nogil except +
         vector[vector[pair[string, string]]] get_topk_internal_multi(
                 vector[string]& queries, 
                 uint32_t k, 
                 uint32_t query_max_df,
-                vector[float] boost_factors
-                ) nogil 
+                vector[float] boost_factors,
+                vector[string]& column_names,
+                uint64_t deadline_us,
+                bool* approximate
+                ) nogil except +
+        BM25SpanResult get_topk_spans(
+                vector[string]& queries, 
+                uint32_t k, 
+                uint32_t query_max_df,
+                vector[float] boost_factors,
+                vector[string]& column_names
+                ) nogil except +
+        void save_to_disk(string& path) nogil
+        uint64_t append(uint64_t start_byte) nogil except +
+        uint64_t get_indexed_bytes() nogil
+        void delete_docs(const vector[uint64_t]& doc_ids) nogil
+        uint64_t update(const vector[uint64_t]& doc_ids, uint64_t start_byte) nogil except +
+        uint64_t get_num_docs() nogil
+        uint64_t get_num_deleted() nogil
+        void start_merges(const MergePolicy& policy) nogil except +
+        void stop_merges() nogil
+        void start_follow(uint32_t interval_ms) nogil except +
+        void stop_follow() nogil
+        uint16_t get_num_segments() nogil
+        bool can_merge() nogil
+        void build_doc_store(vector[string]& column_names) nogil except +
+        void build_doc_store_in_memory(
+                vector[vector[string]]& documents,
+                vector[string]& column_names
+                ) nogil
+        DocStoreStats get_doc_store_stats() nogil
+        MemoryUsage memory_usage() nogil
+        vector[uint16_t] get_partition_numa_nodes() nogil
+        void set_query_cache_capacity(uint64_t capacity) nogil
+        void invalidate_query_cache() nogil
+        QueryCacheStats get_query_cache_stats() nogil
+        BlockCacheStats get_postings_cache_stats() nogil
+        QueryStatsSummary get_query_stats() nogil
+        void reset_query_stats() nogil
         ## void save_to_disk(string db_dir) nogil
         ## void load_from_disk(string db_dir) nogil
 
@@ -88,6 +294,36 @@ def is_pandas_series(obj):
 def is_polars_dataframe(obj):
     return type(obj).__name__ == 'DataFrame' and hasattr(obj, 'select') and hasattr(obj, 'filter')
 
+cdef extern from "index_handle.h":
+    cdef cppclass IndexHandle:
+        IndexHandle() nogil
+        shared_ptr[_BM25] acquire() nogil
+        void publish(_BM25* bm25) nogil
+        void rebuild(const string& filename, uint16_t num_partitions, uint16_t num_threads) nogil
+        bool is_rebuilding() nogil
+        void wait() nogil
+
+cdef extern from "arena.h":
+    cdef enum HugePageMode:
+        HUGE_PAGES_OFF
+        HUGE_PAGES_TRANSPARENT
+        HUGE_PAGES_EXPLICIT
+
+    void set_huge_page_mode(HugePageMode mode) nogil
+
+def set_huge_pages(str mode):
+    ## How large index arrays are backed, for indexes built or loaded from now on.
+    ## "transparent" (default) madvises transparent huge pages, "explicit" takes
+    ## them from the preallocated pool (vm.nr_hugepages), "off" uses small pages.
+    modes = {
+        "off": HUGE_PAGES_OFF,
+        "transparent": HUGE_PAGES_TRANSPARENT,
+        "explicit": HUGE_PAGES_EXPLICIT
+    }
+    if mode not in modes:
+        raise ValueError(f"mode must be one of {list(modes)}")
+    set_huge_page_mode(modes[mode])
+
 def is_polars_series(obj):
     return type(obj).__name__ == 'Series' and hasattr(obj, 'to_frame') and hasattr(obj, 'name')
 
@@ -95,7 +331,7 @@ def is_numpy_array(obj):
     return type(obj).__name__ == 'ndarray'
 
 cdef class BM25:
-    cdef _BM25* bm25
+    cdef IndexHandle* handle
     cdef float  bloom_df_threshold
     cdef double bloom_fpr
     cdef str    filename 
@@ -107,6 +343,7 @@ cdef class BM25:
     cdef uint16_t num_partitions
     cdef list search_cols
     cdef list col_idx_mapping
+    cdef bool has_doc_store
 
 
     def __init__(
@@ -123,6 +360,7 @@ cdef class BM25:
         self.k1          = k1
         self.b           = b
         self.search_cols = []
+        self.has_doc_store = False
 
         if num_partitions < 1:
             num_partitions = os.cpu_count()
@@ -135,8 +373,19 @@ cdef class BM25:
             for stopword in stopwords:
                 self.stopwords.push_back(stopword.upper().encode("utf-8"))
 
+    def __cinit__(self):
+        self.handle = new IndexHandle()
+
+    def __dealloc__(self):
+        if self.handle != NULL:
+            with nogil:
+                del self.handle
+
 
-    def index_file(self, str filename, list search_cols):
+    def index_file(self, str filename, list search_cols, uint64_t memory_budget = 0, str index_path = None):
+        ## memory_budget (bytes) builds a csv index out of core, for files larger
+        ## than memory. The index is written to index_path as by save, then loaded.
+        ## Scratch files go next to it.
         self.filename = filename
         for idx, text_col in enumerate(search_cols):
             search_cols[idx] = text_col.lower()
@@ -154,67 +403,469 @@ cdef class BM25:
         for col in self.search_cols:
             vector_search_cols.push_back(col.encode("utf-8"))
 
+        if memory_budget > 0:
+            if not filename.endswith(".csv") or index_path is None:
+                raise ValueError("Out of core builds need a csv file and an index_path")
+            self._init_with_file_external(filename, vector_search_cols, memory_budget, index_path)
+            return
+
         self._init_with_file(filename, vector_search_cols)
 
 
 
-    def index_documents(self, documents):
+    def index_documents(self, documents, bool store_documents = False):
+        ## store_documents keeps the original documents in a compressed
+        ## document store so get_topk_docs can return them.
         assert len(documents) > 0, "Document count must be greater than 0"
 
         self.filename = "in_memory"
 
-        if isinstance(documents[0], tuple) or isinstance(documents[0], list):
-            self._init_lists(documents)
-        elif isinstance(documents[0], dict):
-            self._init_dicts(documents)
-        elif isinstance(documents[0], str):
-            self._init_documents(documents)
-        elif is_pandas_dataframe(documents):
+        if is_pandas_dataframe(documents):
             documents.fillna('', inplace=True)
-            self._init_lists(documents.values.tolist())
+            column_names = [str(col) for col in documents.columns]
+            rows = documents.values.tolist()
+            self._init_lists(rows)
         elif is_pandas_series(documents):
             documents.fillna('', inplace=True)
+            column_names = ["text"]
+            rows = [[doc] for doc in documents.tolist()]
             self._init_documents(documents.tolist())
         elif is_polars_dataframe(documents):
-            self._init_lists(documents.rows())
+            column_names = list(documents.columns)
+            rows = documents.rows()
+            self._init_lists(rows)
         elif is_polars_series(documents):
             documents = documents.str.fill_null("")
+            column_names = ["text"]
+            rows = [[doc] for doc in documents.to_list()]
             self._init_documents(documents.to_list())
+        elif isinstance(documents[0], tuple) or isinstance(documents[0], list):
+            column_names = [f"col_{idx}" for idx in range(len(documents[0]))]
+            rows = documents
+            self._init_lists(documents)
+        elif isinstance(documents[0], dict):
+            column_names = sorted(documents[0].keys())
+            rows = [[doc.get(col) for col in column_names] for doc in documents]
+            self._init_dicts(documents)
+        elif isinstance(documents[0], str):
+            column_names = ["text"]
+            rows = [[doc] for doc in documents]
+            self._init_documents(documents)
         else:
             raise ValueError("Documents must be list, tuple, or dict.")
 
+        if store_documents:
+            self._store_documents(rows, column_names)
 
-    '''
-    def save(self, db_dir):
-        self.db_dir = db_dir
-
-        self.bm25.save_to_disk(db_dir.encode("utf-8"))
-
-        ## Get from os when dir was last modified
-        last_modified = os.path.getmtime(self.db_dir)
-
-        ## Write to a file
-        with open(os.path.join(self.db_dir, "last_modified.txt"), "w") as f:
-            f.write(str(last_modified))
-
-        ## Write to a file
-        with open(os.path.join(self.db_dir, "filename.txt"), "w") as f:
-            f.write(self.filename)
-
+    cdef void _store_documents(self, rows, list column_names):
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        cdef vector[vector[string]] docs
+        docs.resize(len(rows))
+        for idx, row in enumerate(rows):
+            for value in row:
+                if value is None:
+                    value = ""
+                docs[idx].push_back(str(value).encode("utf-8"))
+
+        cdef vector[string] _column_names
+        for col in column_names:
+            _column_names.push_back(str(col).encode("utf-8"))
+
+        with nogil:
+            bm25.build_doc_store_in_memory(docs, _column_names)
+        self.has_doc_store = True
+
+    def build_doc_store(self, list columns = None):
+        ## Pack columns (all if None) of the indexed file into a compressed
+        ## document store. Rows are then fetched from it instead of the file.
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        if self.is_parquet or self.filename == "in_memory":
+            raise RuntimeError("build_doc_store requires a csv or json file. Use index_documents(..., store_documents=True)")
+
+        cdef vector[string] _columns = self._get_column_names(columns)
+        with nogil:
+            bm25.build_doc_store(_columns)
+        self.has_doc_store = True
+
+    def append(self, start_byte = None):
+        ## Index csv rows written after start_byte (default: where the index ends)
+        ## as a new segment. Incomplete trailing rows are left for the next call.
+        ## Returns the byte offset the next append starts from.
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        if self.is_parquet or not self.filename.endswith(".csv"):
+            raise RuntimeError("append requires an index over a csv file")
+
+        ## A start_byte other than where the index ends raises ValueError.
+        if start_byte is None:
+            start_byte = bm25.get_indexed_bytes()
+
+        cdef uint64_t _start_byte = start_byte
+        cdef uint64_t end_byte
+        with nogil:
+            end_byte = bm25.append(_start_byte)
+        return end_byte
+
+    cdef vector[uint64_t] _get_doc_ids(self, doc_ids) except *:
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        cdef uint64_t num_docs = bm25.get_num_docs()
+        cdef vector[uint64_t] _doc_ids
+        for doc_id in doc_ids:
+            if doc_id < 0 or doc_id >= num_docs:
+                raise IndexError(f"Document {doc_id} not in index of {num_docs} documents")
+            _doc_ids.push_back(doc_id)
+        return _doc_ids
+
+    def delete(self, doc_ids):
+        ## Delete documents by row number (0 based, header excluded). They stop
+        ## matching immediately. Their postings are dropped by the next merge.
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        if isinstance(doc_ids, int):
+            doc_ids = [doc_ids]
+
+        cdef vector[uint64_t] _doc_ids = self._get_doc_ids(doc_ids)
+        with nogil:
+            bm25.delete_docs(_doc_ids)
+
+    def update(self, doc_ids, start_byte = None):
+        ## Replace rows: write the corrected rows to the end of the csv, then
+        ## call update with the row numbers they replace. The old rows are
+        ## deleted as the new ones are indexed, so queries never see both.
+        ## Returns the byte offset the next append starts from.
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        if self.is_parquet or not self.filename.endswith(".csv"):
+            raise RuntimeError("update requires an index over a csv file")
+        if isinstance(doc_ids, int):
+            doc_ids = [doc_ids]
+
+        if start_byte is None:
+            start_byte = bm25.get_indexed_bytes()
+
+        cdef vector[uint64_t] _doc_ids = self._get_doc_ids(doc_ids)
+        cdef uint64_t _start_byte = start_byte
+        cdef uint64_t end_byte
+        with nogil:
+            end_byte = bm25.update(_doc_ids, _start_byte)
+        return end_byte
+
+    def get_num_deleted(self):
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        return bm25.get_num_deleted()
+
+    def start_merges(
+            self,
+            int   merge_factor = 10,
+            int   min_segment_docs = 1000,
+            int   max_segment_docs = 0,
+            float cpu_budget = 0.25,
+            int   max_bytes_per_sec = 0
+            ):
+        ## Merge small appended segments on a background thread so their count
+        ## stays logarithmic in the rows appended. merge_factor adjacent segments
+        ## of a similar size merge into one. max_segment_docs = 0 keeps merged
+        ## segments under the largest partition. cpu_budget is the fraction of a
+        ## core the merge thread may use, max_bytes_per_sec (0 = unlimited) caps
+        ## the bytes it rewrites.
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        if merge_factor < 2:
+            raise ValueError("merge_factor must be at least 2")
+        if not 0.0 < cpu_budget <= 1.0:
+            raise ValueError("cpu_budget must be in (0, 1]")
+        if not bm25.can_merge():
+            raise RuntimeError(
+                "start_merges requires an index over a source file, opened for every segment. "
+                "In-memory indexes and indexes loaded without their source file can't be merged."
+            )
+
+        cdef MergePolicy policy
+        policy.merge_factor      = merge_factor
+        policy.min_segment_docs  = max(1, min_segment_docs)
+        policy.max_segment_docs  = max(0, max_segment_docs)
+        policy.cpu_budget        = cpu_budget
+        policy.max_bytes_per_sec = max(0, max_bytes_per_sec)
+        with nogil:
+            bm25.start_merges(policy)
+
+    def stop_merges(self):
+        ## Stop the merge thread. A merge in progress finishes first.
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        with nogil:
+            bm25.stop_merges()
+
+    def follow(self, int interval_ms = 250):
+        ## Index rows as they are appended to the csv, like tail -f. Writes are
+        ## picked up through inotify, or by checking the file size every
+        ## interval where inotify is unavailable. Rows written within one
+        ## interval go into one segment, and background merging is started
+        ## if it isn't running. A row is indexed once it is complete.
+        if self.is_parquet or not self.filename.endswith(".csv"):
+            raise RuntimeError("follow requires an index over a csv file")
+        if interval_ms < 1:
+            raise ValueError("interval_ms must be at least 1")
+
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        cdef uint32_t _interval_ms = interval_ms
+        with nogil:
+            bm25.start_follow(_interval_ms)
+
+    def stop_follow(self):
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        with nogil:
+            bm25.stop_follow()
+
+    def get_num_segments(self):
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        return bm25.get_num_segments()
+
+    def get_doc_store_stats(self):
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        cdef DocStoreStats stats = bm25.get_doc_store_stats()
+        return {
+            "num_docs": stats.num_docs,
+            "num_blocks": stats.num_blocks,
+            "raw_bytes": stats.raw_bytes,
+            "stored_bytes": stats.stored_bytes,
+            "cache_hits": stats.cache_hits,
+            "cache_misses": stats.cache_misses,
+            "compressed": stats.compressed
+        }
+
+    def memory_usage(self):
+        ## Resident bytes of every index structure, per partition and per
+        ## search column. Heap structures count what the allocator handed out,
+        ## slack included. A loaded index counts its pages resident in the
+        ## mapped file. source_file is the page cache holding the csv, not
+        ## part of total. postings_cache is the blocks a postings cache holds.
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        cdef MemoryUsage usage
+        with nogil:
+            usage = bm25.memory_usage()
+
+        cdef list partitions = []
+        for partition in usage.partitions:
+            columns = []
+            for column in partition.columns:
+                columns.append({
+                    "postings": column.postings,
+                    "doc_sizes": column.doc_sizes,
+                    "term_offsets": column.term_offsets,
+                    "doc_freqs": column.doc_freqs,
+                    "vocab_buckets": column.vocab_buckets,
+                    "vocab_strings": column.vocab_strings,
+                    "total": column.total
+                })
+
+            partitions.append({
+                "columns": columns,
+                "line_offsets": partition.line_offsets,
+                "deleted_docs": partition.deleted_docs,
+                "doc_store": partition.doc_store,
+                "arena_unused": partition.arena_unused,
+                "mapped": partition.mapped,
+                "total": partition.total
+            })
+
+        return {
+            "partitions": partitions,
+            "heap": usage.heap,
+            "mapped": usage.mapped,
+            "source_file": usage.source_file,
+            "postings_cache": usage.postings_cache,
+            "total": usage.total
+        }
+
+    def partition_numa_nodes(self):
+        ## NUMA node each partition is placed and scored on, by partition.
+        ## Partitions go round robin over the nodes. All 0 on a single node.
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        cdef vector[uint16_t] numa_nodes
+        with nogil:
+            numa_nodes = bm25.get_partition_numa_nodes()
+        return list(numa_nodes)
+
+
+    def save(self, str db_dir):
+        ## Write the index to the single file db_dir. Loading it only maps the file.
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        if self.is_parquet:
+            raise RuntimeError("Saving parquet indexes is not supported")
 
-    def load(self, db_dir):
+        self.db_dir = db_dir
+        bm25.user_metadata = json.dumps({
+            "search_cols": self.search_cols,
+            "col_idx_mapping": self.col_idx_mapping
+        }).encode("utf-8")
+
+        cdef string _path = db_dir.encode("utf-8")
+        with nogil:
+            bm25.save_to_disk(_path)
+
+    def load(self, str db_dir, str warmup = "none", uint64_t postings_cache = 0):
+        ## warmup "populate" reads the whole index in at load instead of on first
+        ## use, "lock" also keeps it resident (needs a large enough RLIMIT_MEMLOCK).
+        ## postings_cache (bytes) leaves postings on disk, read into a block
+        ## cache of that size as queries need them. The vocab and per-term
+        ## arrays are read in at load, and warmup applies to them only.
         self.db_dir = db_dir
 
-        ## First check if db_dir exists
-        if not os.path.exists(self.db_dir):
-            raise RuntimeError("Database directory does not exist")
-
-        with open(os.path.join(self.db_dir, "filename.txt"), "r") as f:
-            self.filename = f.read()
-
-        self.bm25 = new _BM25(self.db_dir.encode("utf-8"))
+        if not os.path.exists(db_dir):
+            raise RuntimeError("Index file does not exist")
+
+        warmups = {
+            "none": WARMUP_NONE,
+            "populate": WARMUP_POPULATE,
+            "lock": WARMUP_LOCK
+        }
+        if warmup not in warmups:
+            raise ValueError(f"warmup must be one of {list(warmups)}")
+        cdef IndexWarmup _warmup = warmups[warmup]
+
+        ## Swapped in while serving. Queries running on an index built in this
+        ## process finish on it, then it is freed and only the shared mapping
+        ## stays resident.
+        cdef string _path = db_dir.encode("utf-8")
+        with nogil:
+            self.handle.publish(new _BM25(_path, _warmup, postings_cache))
+
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        metadata = json.loads(bm25.user_metadata.decode("utf-8") or "{}")
+        self.filename        = bm25.filename.decode("utf-8")
+        self.search_cols     = metadata.get("search_cols", [])
+        self.col_idx_mapping = metadata.get("col_idx_mapping")
+        self.is_parquet      = False
+        self.has_doc_store   = bm25.get_doc_store_stats().num_docs > 0
         return True
-    '''
+
+    def rebuild(self, int num_threads = 0, bool wait = False):
+        ## Re-index the source file in the background while queries keep being
+        ## served by the current index, then swap the new one in. Queries
+        ## already running finish on the old index. num_threads bounds the
+        ## threads the build uses (0 = one per partition), leaving cores for
+        ## serving. Returns at once unless wait is set. See wait_for_rebuild.
+        if self.is_parquet or not (self.filename.endswith(".csv") or self.filename.endswith(".json")):
+            raise RuntimeError("rebuild requires an index over a csv or json file")
+        if not os.path.exists(self.filename):
+            raise FileNotFoundError(self.filename)
+        if num_threads < 0:
+            raise ValueError("num_threads must be >= 0")
+
+        cdef string _filename = self.filename.encode("utf-8")
+        cdef uint16_t _num_threads = num_threads
+        with nogil:
+            self.handle.rebuild(_filename, self.num_partitions, _num_threads)
+
+        if wait:
+            self.wait_for_rebuild()
+
+    def is_rebuilding(self):
+        return self.handle.is_rebuilding()
+
+    def wait_for_rebuild(self):
+        with nogil:
+            self.handle.wait()
+
+
+    def enable_query_cache(self, uint64_t capacity = 1024):
+        ## Cache results of the last `capacity` distinct queries. 0 disables the cache.
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        bm25.set_query_cache_capacity(capacity)
+
+    def clear_query_cache(self):
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        bm25.invalidate_query_cache()
+
+    def get_query_cache_stats(self):
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        cdef QueryCacheStats stats = bm25.get_query_cache_stats()
+        return {
+            "hits": stats.hits,
+            "misses": stats.misses,
+            "size": stats.size,
+            "capacity": stats.capacity
+        }
+
+    def get_postings_cache_stats(self):
+        ## All 0 unless loaded with a postings cache. reads are the disk reads
+        ## misses led to, read ahead included. size and capacity in bytes.
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        cdef BlockCacheStats stats = bm25.get_postings_cache_stats()
+        return {
+            "hits": stats.hits,
+            "misses": stats.misses,
+            "reads": stats.reads,
+            "bytes_read": stats.bytes_read,
+            "evictions": stats.evictions,
+            "size": stats.size,
+            "capacity": stats.capacity,
+            "direct_io": stats.direct_io
+        }
+
+    def get_query_stats(self):
+        ## Totals and per phase latency percentiles (ns) across all queries so far.
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        cdef QueryStatsSummary stats = bm25.get_query_stats()
+        return {
+            "num_queries": stats.num_queries,
+            "postings_scanned": stats.postings_scanned,
+            "bytes_decoded": stats.bytes_decoded,
+            "candidates": stats.candidates,
+            "partitions_touched": stats.partitions_touched,
+            "latency_ns": {
+                "tokenize": stats.phase_latency[0],
+                "score": stats.phase_latency[1],
+                "merge": stats.phase_latency[2],
+                "fetch": stats.phase_latency[3],
+                "total": stats.total_latency
+            }
+        }
+
+    def get_last_query_stats(self):
+        ## Stats of the last query run on the calling thread.
+        cdef QueryStats stats = get_last_query_stats()
+        return {
+            "postings_scanned": stats.postings_scanned,
+            "bytes_decoded": stats.bytes_decoded,
+            "candidates": stats.candidates,
+            "partitions_touched": stats.partitions_touched,
+            "tokenize_ns": stats.phase_ns[0],
+            "score_ns": stats.phase_ns[1],
+            "merge_ns": stats.phase_ns[2],
+            "fetch_ns": stats.phase_ns[3],
+            "total_ns": stats.total_ns,
+            "approximate": stats.approximate
+        }
+
+    def reset_query_stats(self):
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        bm25.reset_query_stats()
+
+    def cancel_queries(self):
+        ## Stop all in-flight queries. They return their partial top-k.
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        bm25.cancel_queries()
 
 
     cdef void _init_lists(self, list documents):
@@ -231,7 +882,7 @@ cdef class BM25:
 
                 docs[idx].push_back(doc.upper().encode("utf-8"))
 
-        self.bm25 = new _BM25(
+        self.handle.publish(new _BM25(
                 docs,
                 self.bloom_df_threshold,
                 self.bloom_fpr,
@@ -239,7 +890,7 @@ cdef class BM25:
                 self.b,
                 self.num_partitions,
                 self.stopwords
-                )
+                ))
 
     cdef void _init_dicts(self, list documents):
         init = perf_counter()
@@ -252,7 +903,7 @@ cdef class BM25:
             for doc in doc_list:
                 docs[idx].push_back(doc.upper().encode("utf-8"))
 
-        self.bm25 = new _BM25(
+        self.handle.publish(new _BM25(
                 docs,
                 self.bloom_df_threshold,
                 self.bloom_fpr,
@@ -260,7 +911,7 @@ cdef class BM25:
                 self.b,
                 self.num_partitions,
                 self.stopwords
-                )
+                ))
 
     cdef void _init_documents(self, list documents):
         init = perf_counter()
@@ -271,7 +922,7 @@ cdef class BM25:
         for idx, doc in enumerate(documents):
             docs[idx].push_back(doc.upper().encode("utf-8"))
 
-        self.bm25 = new _BM25(
+        self.handle.publish(new _BM25(
                 docs,
                 self.bloom_df_threshold,
                 self.bloom_fpr,
@@ -279,7 +930,7 @@ cdef class BM25:
                 self.b,
                 self.num_partitions,
                 self.stopwords
-                )
+                ))
 
     cdef void _init_with_file(self, str filename, vector[string] search_cols):
         if filename.endswith(".parquet"):
@@ -288,7 +939,7 @@ cdef class BM25:
             return
 
         self.is_parquet = False
-        self.bm25 = new _BM25(
+        self.handle.publish(new _BM25(
                 filename.encode("utf-8"),
                 search_cols,
                 self.bloom_df_threshold,
@@ -297,7 +948,37 @@ cdef class BM25:
                 self.b,
                 self.num_partitions,
                 self.stopwords
-                )
+                ))
+
+    cdef void _init_with_file_external(
+            self,
+            str filename,
+            vector[string] search_cols,
+            uint64_t memory_budget,
+            str index_path
+            ):
+        cdef ExternalBuildConfig config
+        config.index_path    = index_path.encode("utf-8")
+        config.memory_budget = memory_budget
+        config.num_threads   = 0
+        config.user_metadata = json.dumps({
+            "search_cols": self.search_cols,
+            "col_idx_mapping": self.col_idx_mapping
+        }).encode("utf-8")
+
+        self.is_parquet = False
+        self.db_dir     = index_path
+        self.handle.publish(new _BM25(
+                filename.encode("utf-8"),
+                search_cols,
+                self.bloom_df_threshold,
+                self.bloom_fpr,
+                self.k1,
+                self.b,
+                self.num_partitions,
+                self.stopwords,
+                config
+                ))
 
     cdef void _init_with_parquet(self, str filename, str text_col):
         from pyarrow import parquet as pq
@@ -316,7 +997,7 @@ cdef class BM25:
         for idx in range(num_docs):
             docs.push_back(pydocs[idx].encode("utf-8"))
 
-        self.bm25 = new _BM25(
+        self.handle.publish(new _BM25(
                 docs,
                 self.bloom_df_threshold,
                 self.bloom_fpr,
@@ -324,7 +1005,7 @@ cdef class BM25:
                 self.b,
                 self.num_partitions,
                 self.stopwords
-                )
+                ))
         print(f"Reading parquet file took {perf_counter() - init:.2f} seconds")
 
     cpdef get_topk_indices(
@@ -332,8 +1013,14 @@ cdef class BM25:
             str query, 
             int query_max_df = INT_MAX, 
             int k = 10,
-            list boost_factors = [] 
+            list boost_factors = [],
+            uint64_t deadline_us = 0
             ):
+        ## deadline_us > 0 bounds scoring time, as does cancel_queries(). Stopped
+        ## queries return the top k found so far. Check "approximate" in
+        ## get_last_query_stats(), called from the same thread, to tell them apart.
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
         if query is None:
             return [], []
 
@@ -347,12 +1034,17 @@ cdef class BM25:
         for factor in boost_factors:
             _boost_factors.push_back(factor)
 
-        cdef vector[BM25Result] results = self.bm25.query(
-                query.upper().encode("utf-8"), 
-                k, 
-                query_max_df,
-                _boost_factors
-                )
+        cdef string _query = query.upper().encode("utf-8")
+        cdef vector[BM25Result] results
+        with nogil:
+            results = bm25.query(
+                    _query, 
+                    k, 
+                    query_max_df,
+                    _boost_factors,
+                    deadline_us,
+                    NULL
+                    )
 
         if results.size() == 0:
             return [], []
@@ -365,13 +1057,137 @@ cdef class BM25:
 
         return scores, indices
 
+    def explain(
+            self, 
+            str query, 
+            int query_max_df = INT_MAX, 
+            int k = 10,
+            list boost_factors = [] 
+            ):
+        ## Per term and column breakdown of df, idf, posting lengths, time to walk
+        ## the postings and score contribution to each returned doc.
+        ## walk_ns times a full walk of the term's postings after ranking, not the
+        ## ranking itself, which may skip postings.
+        ## For files indices are row numbers within partition_ids, as in get_topk_indices_batch.
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        if len(boost_factors) > 0 and self.col_idx_mapping is not None:
+            boost_factors = [boost_factors[idx] for idx in self.col_idx_mapping]
+
+        cdef vector[float] _boost_factors
+        _boost_factors.reserve(len(boost_factors))
+        for factor in boost_factors:
+            _boost_factors.push_back(factor)
+
+        cdef string _query = query.upper().encode("utf-8")
+        cdef QueryExplanation explanation
+        with nogil:
+            explanation = bm25.explain(
+                    _query, 
+                    k, 
+                    query_max_df,
+                    _boost_factors
+                    )
+
+        cdef list terms = []
+        for term in explanation.terms:
+            if term.col_idx < len(self.search_cols):
+                column = self.search_cols[term.col_idx]
+            else:
+                column = term.col_idx
+
+            terms.append({
+                "term": term.term.decode("utf-8"),
+                "column": column,
+                "df": term.df,
+                "idf": term.idf,
+                "stop_word": term.is_stop_word,
+                "exceeds_max_df": term.exceeds_max_df,
+                "posting_lengths": list(term.partition_posting_lengths),
+                "walk_ns": term.walk_ns,
+                "contributions": list(term.doc_contributions)
+            })
+
+        return {
+            "scores": [result.score for result in explanation.results],
+            "indices": [result.doc_id for result in explanation.results],
+            "partition_ids": [result.partition_id for result in explanation.results],
+            "terms": terms
+        }
+
+    cpdef get_topk_indices_batch(
+            self, 
+            list queries, 
+            int query_max_df = INT_MAX, 
+            int k = 10,
+            list boost_factors = [],
+            bool shared_scan = False
+            ):
+        ## Score many queries at once. Returns flat (scores, indices, offsets, partition_ids)
+        ## arrays. Results for queries[i] are scores[offsets[i]:offsets[i + 1]].
+        ## For files indices are row numbers within partition_ids, so a result
+        ## is the pair of the two.
+        ## shared_scan walks each posting list once per block of queries containing the term.
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        if len(boost_factors) > 0 and self.col_idx_mapping is not None:
+            boost_factors = [boost_factors[idx] for idx in self.col_idx_mapping]
+
+        cdef vector[float] _boost_factors
+        _boost_factors.reserve(len(boost_factors))
+        for factor in boost_factors:
+            _boost_factors.push_back(factor)
+
+        cdef vector[string] _queries
+        _queries.reserve(len(queries))
+        for query in queries:
+            if query is None:
+                query = ""
+            _queries.push_back(query.upper().encode("utf-8"))
+
+        cdef BM25BatchResult results
+        with nogil:
+            results = bm25.query_batch(
+                    _queries,
+                    k, 
+                    query_max_df,
+                    _boost_factors,
+                    shared_scan
+                    )
+
+        cdef size_t num_results = results.scores.size()
+        cdef array.array scores  = array.clone(array.array('f', []), num_results, zero=False)
+        cdef array.array indices = array.clone(array.array('Q', []), num_results, zero=False)
+        cdef array.array partition_ids = array.clone(array.array('H', []), num_results, zero=False)
+        cdef array.array offsets = array.clone(
+                array.array('Q', []), 
+                results.query_offsets.size(), 
+                zero=False
+                )
+
+        if num_results > 0:
+            memcpy(scores.data.as_floats, results.scores.data(), num_results * sizeof(float))
+            memcpy(indices.data.as_ulonglongs, results.doc_ids.data(), num_results * sizeof(uint64_t))
+            memcpy(partition_ids.data.as_ushorts, results.partition_ids.data(), num_results * sizeof(uint16_t))
+        memcpy(
+                offsets.data.as_ulonglongs, 
+                results.query_offsets.data(), 
+                results.query_offsets.size() * sizeof(uint64_t)
+                )
+
+        return scores, indices, offsets, partition_ids
+
     cdef list _get_topk_docs_parquet(
             self, 
             str query, 
             int k = 10, 
             int query_max_df = INT_MAX,
-            list boost_factors = None
+            list boost_factors = None,
+            list columns = None,
+            uint64_t deadline_us = 0
             ):
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
         if boost_factors is None:
             boost_factors = len(self.search_cols) * [1]
 
@@ -380,12 +1196,17 @@ cdef class BM25:
         for factor in boost_factors:
             _boost_factors.push_back(factor)
 
-        cdef vector[BM25Result] results = self.bm25.query(
-                query.upper().encode("utf-8"), 
-                k, 
-                query_max_df,
-                _boost_factors
-                )
+        cdef string _query = query.upper().encode("utf-8")
+        cdef vector[BM25Result] results
+        with nogil:
+            results = bm25.query(
+                    _query, 
+                    k, 
+                    query_max_df,
+                    _boost_factors,
+                    deadline_us,
+                    NULL
+                    )
 
         if results.size() == 0:
             return []
@@ -396,7 +1217,10 @@ cdef class BM25:
             scores.append(result.score)
             indices.append(result.doc_id)
 
-        rows = self.arrow_table.take(indices).to_pylist()
+        table = self.arrow_table.take(indices)
+        if columns:
+            table = table.select(columns)
+        rows = table.to_pylist()
 
         for idx, score in enumerate(scores):
             rows[idx]["score"] = score
@@ -408,10 +1232,14 @@ cdef class BM25:
             str query,
             int k = 10,
             int query_max_df = INT_MAX,
-            list boost_factors = None
+            list boost_factors = None,
+            list columns = None,
+            uint64_t deadline_us = 0
             ):
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
         if self.is_parquet:
-            return self._get_topk_docs_parquet(query, k, query_max_df)
+            return self._get_topk_docs_parquet(query, k, query_max_df, None, columns, deadline_us)
 
         if boost_factors is None:
             boost_factors = len(self.search_cols) * [1]
@@ -423,19 +1251,24 @@ cdef class BM25:
 
         cdef vector[vector[pair[string, string]]] results
         cdef list output = []
+        cdef vector[string] _columns = self._get_column_names(columns)
         cdef string _query = query.upper().encode("utf-8")
 
-        if self.filename == "in_memory":
+        if self.filename == "in_memory" and not self.has_doc_store:
             raise RuntimeError("""
                 Cannot get topk docs when documents were provided instead of a filename
+                unless they were indexed with store_documents=True
             """)
         else:
             with nogil:
-                results = self.bm25.get_topk_internal(
+                results = bm25.get_topk_internal(
                         _query,
                         k, 
                         query_max_df,
-                        _boost_factors
+                        _boost_factors,
+                        _columns,
+                        deadline_us,
+                        NULL
                         )
 
         for idx in range(len(results)):
@@ -452,8 +1285,12 @@ cdef class BM25:
             dict _query,
             int k = 10,
             int query_max_df = INT_MAX,
-            list boost_factors = None
+            list boost_factors = None,
+            list columns = None,
+            uint64_t deadline_us = 0
             ):
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
         query = len(self.search_cols) * []
         for col in self.search_cols:
             query.append(_query.get(col, "").upper())
@@ -462,7 +1299,7 @@ cdef class BM25:
             boost_factors = len(self.search_cols) * [1]
 
         if self.is_parquet:
-            return self._get_topk_docs_parquet(query, k, query_max_df)
+            return self._get_topk_docs_parquet(query, k, query_max_df, None, columns, deadline_us)
 
         cdef vector[float] _boost_factors
         _boost_factors.reserve(len(boost_factors))
@@ -471,21 +1308,26 @@ cdef class BM25:
 
         cdef vector[vector[pair[string, string]]] results
         cdef list output = []
+        cdef vector[string] _columns = self._get_column_names(columns)
         cdef vector[string] _queries
         for q in query:
             _queries.push_back(q.upper().encode("utf-8"))
 
-        if self.filename == "in_memory":
+        if self.filename == "in_memory" and not self.has_doc_store:
             raise RuntimeError("""
                 Cannot get topk docs when documents were provided instead of a filename
+                unless they were indexed with store_documents=True
             """)
         else:
             with nogil:
-                results = self.bm25.get_topk_internal_multi(
+                results = bm25.get_topk_internal_multi(
                         _queries,
                         k, 
                         query_max_df,
-                        _boost_factors
+                        _boost_factors,
+                        _columns,
+                        deadline_us,
+                        NULL
                         )
 
         for idx in range(len(results)):
@@ -502,15 +1344,95 @@ cdef class BM25:
             query, 
             int k = 10, 
             int query_max_df = INT_MAX,
-            list boost_factors = None
+            list boost_factors = None,
+            list columns = None,
+            uint64_t deadline_us = 0
             ):
+        ## columns restricts the returned fields. Only those fields are decoded.
+        ## deadline_us and cancel_queries() stop scoring as in get_topk_indices.
         if query is None:
             return []
         if isinstance(query, str):
             query = query.upper()
-            return self._get_topk_docs(query, k, query_max_df, boost_factors)
+            return self._get_topk_docs(query, k, query_max_df, boost_factors, columns, deadline_us)
         elif isinstance(query, dict):
-            return self._get_topk_docs_multi(query, k, query_max_df, boost_factors)
+            return self._get_topk_docs_multi(query, k, query_max_df, boost_factors, columns, deadline_us)
         else:
             raise ValueError("Query must be a string or a dict of strings")
 
+    cdef vector[string] _get_column_names(self, list columns):
+        cdef vector[string] _columns
+        if columns is None:
+            return _columns
+
+        _columns.reserve(len(columns))
+        for col in columns:
+            _columns.push_back(col.encode("utf-8"))
+        return _columns
+
+    def get_topk_spans(
+            self, 
+            query, 
+            int k = 10, 
+            int query_max_df = INT_MAX,
+            list boost_factors = None,
+            list columns = None
+            ):
+        ## Zero-copy fetch for csv files. Returns (scores, indices, offsets, lengths, partition_ids).
+        ## Indices are row numbers within partition_ids, as in get_topk_indices_batch.
+        ## Field j of result i is the byte range
+        ## [offsets[i * n + j], offsets[i * n + j] + lengths[i * n + j]) of the source file,
+        ## where n = len(columns), or the number of csv columns if columns is None.
+        ## Quoted fields are returned raw, quotes included.
+        cdef shared_ptr[_BM25] snapshot = self.handle.acquire()
+        cdef _BM25* bm25 = snapshot.get()
+        if self.is_parquet or self.filename == "in_memory" or not self.filename.endswith(".csv"):
+            raise RuntimeError("get_topk_spans is only supported for csv files")
+
+        if isinstance(query, str):
+            query = {col: query for col in self.search_cols}
+        elif not isinstance(query, dict):
+            raise ValueError("Query must be a string or a dict of strings")
+
+        if boost_factors is None:
+            boost_factors = len(self.search_cols) * [1]
+
+        cdef vector[float] _boost_factors
+        _boost_factors.reserve(len(boost_factors))
+        for factor in boost_factors:
+            _boost_factors.push_back(factor)
+
+        cdef vector[string] _queries
+        for col in self.search_cols:
+            _queries.push_back(query.get(col, "").upper().encode("utf-8"))
+
+        cdef vector[string] _columns = self._get_column_names(columns)
+        cdef BM25SpanResult results
+        with nogil:
+            results = bm25.get_topk_spans(
+                    _queries,
+                    k, 
+                    query_max_df,
+                    _boost_factors,
+                    _columns
+                    )
+
+        cdef size_t num_results = results.results.size()
+        cdef size_t num_spans   = results.offsets.size()
+        cdef array.array scores  = array.clone(array.array('f', []), num_results, zero=False)
+        cdef array.array indices = array.clone(array.array('Q', []), num_results, zero=False)
+        cdef array.array offsets = array.clone(array.array('Q', []), num_spans, zero=False)
+        cdef array.array lengths = array.clone(array.array('I', []), num_spans, zero=False)
+        cdef array.array partition_ids = array.clone(array.array('H', []), num_results, zero=False)
+
+        for idx in range(num_results):
+            scores.data.as_floats[idx] = results.results[idx].score
+            indices.data.as_ulonglongs[idx] = results.results[idx].doc_id
+            partition_ids.data.as_ushorts[idx] = results.results[idx].partition_id
+
+        if num_spans > 0:
+            memcpy(offsets.data.as_ulonglongs, results.offsets.data(), num_spans * sizeof(uint64_t))
+            memcpy(lengths.data.as_uints, results.lengths.data(), num_spans * sizeof(uint32_t))
+
+        return scores, indices, offsets, lengths, partition_ids
+
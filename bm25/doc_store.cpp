@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <iostream>
+#include <algorithm>
+
+#ifdef BM25_USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "doc_store.h"
+#include "memory_usage.h"
+
+
+static inline void put_vbyte(std::string& out, uint64_t value) {
+	while (value >= 128) {
+		out.push_back((char)((value & 127) | 128));
+		value >>= 7;
+	}
+	out.push_back((char)value);
+}
+
+static inline uint64_t get_vbyte(const char*& ptr) {
+	uint64_t value = 0;
+	int shift = 0;
+	while ((uint8_t)*ptr & 128) {
+		value |= (uint64_t)((uint8_t)*ptr & 127) << shift;
+		shift += 7;
+		++ptr;
+	}
+	value |= (uint64_t)(uint8_t)*ptr << shift;
+	++ptr;
+	return value;
+}
+
+
+DocStore::DocStore(uint16_t num_fields, uint64_t cache_capacity) :
+	num_fields(num_fields),
+	num_docs(0),
+	raw_bytes(0),
+	cache_capacity(cache_capacity),
+	cache_hits(0),
+	cache_misses(0) {
+
+	block_offsets.push_back(0);
+	block_first_doc.push_back(0);
+	bind_arrays();
+}
+
+DocStore::DocStore(IndexFileReader& reader, uint64_t cache_capacity) :
+	cache_capacity(cache_capacity),
+	cache_hits(0),
+	cache_misses(0) {
+
+	num_fields = reader.read_u16();
+	num_docs   = reader.read_u64();
+	raw_bytes  = reader.read_u64();
+
+	// Views into the mapping, shared by every process that maps the file.
+	uint64_t size;
+	blocks       = (const uint8_t*)reader.read_array(&size);
+	stored_bytes = size;
+	offsets      = (const uint64_t*)reader.read_array(&size);
+	num_blocks   = size / sizeof(uint64_t) - 1;
+	first_doc    = (const uint64_t*)reader.read_array();
+	raw_sizes    = (const uint32_t*)reader.read_array();
+}
+
+void DocStore::bind_arrays() {
+	blocks       = data.data();
+	offsets      = block_offsets.data();
+	first_doc    = block_first_doc.data();
+	raw_sizes    = block_raw_sizes.data();
+	num_blocks   = block_raw_sizes.size();
+	stored_bytes = data.size();
+}
+
+void DocStore::add(const std::vector<std::string>& fields) {
+	for (uint16_t field_idx = 0; field_idx < num_fields; ++field_idx) {
+		if (field_idx >= fields.size()) {
+			put_vbyte(pending, 0);
+			continue;
+		}
+		put_vbyte(pending, fields[field_idx].size());
+		pending += fields[field_idx];
+	}
+	++num_docs;
+
+	if (pending.size() >= DOC_STORE_BLOCK_SIZE) {
+		seal_block();
+	}
+}
+
+void DocStore::finish() {
+	if (!pending.empty()) {
+		seal_block();
+	}
+	data.shrink_to_fit();
+	bind_arrays();
+}
+
+void DocStore::seal_block() {
+#ifdef BM25_USE_ZSTD
+	uint64_t offset = data.size();
+	size_t bound = ZSTD_compressBound(pending.size());
+	data.resize(offset + bound);
+
+	size_t compressed_size = ZSTD_compress(
+			&data[offset],
+			bound,
+			pending.data(),
+			pending.size(),
+			DOC_STORE_ZSTD_LEVEL
+			);
+	if (ZSTD_isError(compressed_size)) {
+		std::cerr << "Error compressing document block: " << ZSTD_getErrorName(compressed_size) << std::endl;
+		std::exit(1);
+	}
+	data.resize(offset + compressed_size);
+#else
+	data.insert(data.end(), pending.begin(), pending.end());
+#endif
+
+	raw_bytes += pending.size();
+	block_raw_sizes.push_back((uint32_t)pending.size());
+	block_offsets.push_back(data.size());
+	block_first_doc.push_back(num_docs);
+	pending.clear();
+}
+
+DocStore::Block DocStore::get_block(uint64_t block_idx) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		auto it = cached_blocks.find(block_idx);
+		if (it != cached_blocks.end()) {
+			lru.splice(lru.begin(), lru, it->second);
+			cache_hits.fetch_add(1, std::memory_order_relaxed);
+			return it->second->second;
+		}
+	}
+	cache_misses.fetch_add(1, std::memory_order_relaxed);
+
+	// Decompress outside the lock. Two threads missing on the same block both decode it.
+	const uint8_t* src = blocks + offsets[block_idx];
+	size_t src_size = offsets[block_idx + 1] - offsets[block_idx];
+
+	std::string* block = new std::string(raw_sizes[block_idx], '\0');
+
+#ifdef BM25_USE_ZSTD
+	size_t size = ZSTD_decompress(&(*block)[0], block->size(), src, src_size);
+	if (ZSTD_isError(size) || size != block->size()) {
+		std::cerr << "Error decompressing document block " << block_idx << std::endl;
+		std::exit(1);
+	}
+#else
+	memcpy(&(*block)[0], src, src_size);
+#endif
+	Block _block(block);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (cache_capacity == 0) return _block;
+
+	if (cached_blocks.find(block_idx) == cached_blocks.end()) {
+		lru.emplace_front(block_idx, _block);
+		cached_blocks[block_idx] = lru.begin();
+
+		while (lru.size() > cache_capacity) {
+			cached_blocks.erase(lru.back().first);
+			lru.pop_back();
+		}
+	}
+	return _block;
+}
+
+void DocStore::get(uint64_t doc_id, std::vector<std::string>& fields) {
+	fields.clear();
+	if (doc_id >= num_docs) {
+		std::cerr << "Error: Document " << doc_id << " not in document store." << std::endl;
+		std::exit(1);
+	}
+
+	// Last block whose first doc is <= doc_id.
+	uint64_t block_idx = std::upper_bound(
+			first_doc,
+			first_doc + num_blocks + 1,
+			doc_id
+			) - first_doc - 1;
+
+	Block block = get_block(block_idx);
+	const char* ptr = block->data();
+
+	// Skip preceding docs in the block.
+	for (uint64_t idx = first_doc[block_idx]; idx < doc_id; ++idx) {
+		for (uint16_t field_idx = 0; field_idx < num_fields; ++field_idx) {
+			uint64_t length = get_vbyte(ptr);
+			ptr += length;
+		}
+	}
+
+	fields.reserve(num_fields);
+	for (uint16_t field_idx = 0; field_idx < num_fields; ++field_idx) {
+		uint64_t length = get_vbyte(ptr);
+		fields.emplace_back(ptr, length);
+		ptr += length;
+	}
+}
+
+void DocStore::save(IndexFileWriter& writer) {
+	writer.write_u16(num_fields);
+	writer.write_u64(num_docs);
+	writer.write_u64(raw_bytes);
+	writer.write_array(blocks, stored_bytes);
+	writer.write_array(offsets, (num_blocks + 1) * sizeof(uint64_t));
+	writer.write_array(first_doc, (num_blocks + 1) * sizeof(uint64_t));
+	writer.write_array(raw_sizes, num_blocks * sizeof(uint32_t));
+}
+
+DocStoreStats DocStore::get_stats() {
+	DocStoreStats stats;
+	stats.num_docs     = num_docs;
+	stats.num_blocks   = num_blocks;
+	stats.raw_bytes    = raw_bytes;
+	stats.stored_bytes = stored_bytes;
+	stats.cache_hits   = cache_hits.load(std::memory_order_relaxed);
+	stats.cache_misses = cache_misses.load(std::memory_order_relaxed);
+#ifdef BM25_USE_ZSTD
+	stats.compressed = true;
+#else
+	stats.compressed = false;
+#endif
+	return stats;
+}
+
+void DocStore::get_memory_usage(uint64_t& heap, uint64_t& mapped) {
+	// A loaded store reads its arrays out of the mapping.
+	if (block_offsets.empty()) {
+		mapped += mapped_resident_bytes(blocks, stored_bytes);
+		mapped += mapped_resident_bytes(offsets, (num_blocks + 1) * sizeof(uint64_t));
+		mapped += mapped_resident_bytes(first_doc, (num_blocks + 1) * sizeof(uint64_t));
+		mapped += mapped_resident_bytes(raw_sizes, num_blocks * sizeof(uint32_t));
+	}
+	else {
+		heap += heap_bytes(data.data());
+		heap += heap_bytes(block_offsets.data());
+		heap += heap_bytes(block_first_doc.data());
+		heap += heap_bytes(block_raw_sizes.data());
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (const auto& [block_idx, block] : lru) {
+		heap += string_heap_bytes(*block);
+	}
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "index_file.h"
+
+// Uncompressed bytes per block before it is sealed. Small blocks keep single row fetches cheap.
+#define DOC_STORE_BLOCK_SIZE   8192
+#define DOC_STORE_CACHE_BLOCKS 256
+#define DOC_STORE_ZSTD_LEVEL   3
+
+
+typedef struct {
+	uint64_t num_docs;
+	uint64_t num_blocks;
+	uint64_t raw_bytes;
+	uint64_t stored_bytes;
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+
+	// False when built without zstd. Blocks are then stored raw.
+	bool compressed;
+} DocStoreStats;
+
+// Append only store of documents packed into compressed blocks.
+// Documents are added by a single thread, then read concurrently.
+// Each document is num_fields (vbyte length, bytes) pairs.
+// A loaded store reads its blocks straight out of the index file mapping.
+// Only the block cache is private to the process.
+class DocStore {
+	public:
+		DocStore(uint16_t num_fields, uint64_t cache_capacity = DOC_STORE_CACHE_BLOCKS);
+		DocStore(IndexFileReader& reader, uint64_t cache_capacity = DOC_STORE_CACHE_BLOCKS);
+
+		void add(const std::vector<std::string>& fields);
+		void finish();
+		void get(uint64_t doc_id, std::vector<std::string>& fields);
+		DocStoreStats get_stats();
+
+		// Adds the resident bytes of the blocks, their index arrays and the block
+		// cache to heap, or to mapped for arrays read out of an index file.
+		void get_memory_usage(uint64_t& heap, uint64_t& mapped);
+
+		// Sealed blocks only. Call finish first.
+		void save(IndexFileWriter& writer);
+
+		uint16_t num_fields;
+
+	private:
+		typedef std::shared_ptr<const std::string> Block;
+		typedef std::list<std::pair<uint64_t, Block>> LRUList;
+
+		void  seal_block();
+		void  bind_arrays();
+		Block get_block(uint64_t block_idx);
+
+		std::string pending;
+		uint64_t    num_docs;
+		uint64_t    raw_bytes;
+
+		// Owned while building. Empty for a loaded store.
+		std::vector<uint8_t>  data;
+		std::vector<uint64_t> block_offsets;
+		std::vector<uint64_t> block_first_doc;
+		std::vector<uint32_t> block_raw_sizes;
+
+		// Block i is blocks[offsets[i], offsets[i + 1]) and holds docs
+		// [first_doc[i], first_doc[i + 1]). Point into the vectors above or the mapping.
+		const uint8_t*  blocks;
+		const uint64_t* offsets;
+		const uint64_t* first_doc;
+		const uint32_t* raw_sizes;
+		uint64_t num_blocks;
+		uint64_t stored_bytes;
+
+		// LRU of decompressed blocks.
+		uint64_t cache_capacity;
+		LRUList  lru;
+		std::unordered_map<uint64_t, LRUList::iterator> cached_blocks;
+		std::mutex mutex;
+
+		std::atomic<uint64_t> cache_hits;
+		std::atomic<uint64_t> cache_misses;
+};
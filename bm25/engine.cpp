@@ -5,6 +5,8 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <errno.h>
+#include <string.h>
 #undef NDEBUG
 #include <assert.h>
 
@@ -15,15 +17,21 @@
 #include <string>
 #include <cstdint>
 #include <cmath>
+#include <cfloat>
 #include <sstream>
 
 #include <chrono>
 #include <ctime>
 #include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <omp.h>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
 #include <termios.h>
 
 #include <parallel_hashmap/phmap.h>
@@ -31,6 +39,9 @@
 // #include "robin_hood.h"
 
 #include "engine.h"
+#include "query_cache.h"
+#include "topk.h"
+#include "index_file.h"
 #include "vbyte_encoding.h"
 // #include "serialize.h"
 #include "bloom.h"
@@ -60,9 +71,9 @@ void flush_token_stream(TokenStream* token_stream) {
 	token_stream->num_terms = 0;
 }
 
-void init_token_stream(TokenStream* token_stream, const std::string& out_file) {
-	token_stream->term_ids   = (uint32_t*)malloc(TOKEN_STREAM_CAPACITY * sizeof(uint32_t));
-	token_stream->term_freqs = (uint8_t*)malloc(TOKEN_STREAM_CAPACITY * sizeof(uint8_t));
+void init_token_stream(TokenStream* token_stream, const std::string& out_file, Arena* arena) {
+	token_stream->term_ids   = (uint32_t*)arena->allocate(TOKEN_STREAM_CAPACITY * sizeof(uint32_t));
+	token_stream->term_freqs = (uint8_t*)arena->allocate(TOKEN_STREAM_CAPACITY * sizeof(uint8_t));
 	token_stream->num_terms  = 0;
 	token_stream->file = fopen(out_file.c_str(), "w+b");
 }
@@ -83,13 +94,15 @@ void add_token(
 }
 
 void free_token_stream(TokenStream* token_stream) {
-	free(token_stream->term_ids);
-	free(token_stream->term_freqs);
+	// The buffers go with their arena.
+	token_stream->term_ids   = NULL;
+	token_stream->term_freqs = NULL;
 }
 
 
 void init_inverted_index_new(InvertedIndexNew* II) {
 	II->doc_ids      = NULL;
+	II->doc_sizes    = NULL;
 	II->term_offsets = NULL;
 	II->doc_freqs    = NULL;
 
@@ -98,15 +111,10 @@ void init_inverted_index_new(InvertedIndexNew* II) {
 	II->avg_doc_size = 0.0f;
 }
 
-void free_inverted_index_new(InvertedIndexNew* II) {
-	free(II->doc_ids);
-	free(II->term_offsets);
-	free(II->doc_freqs);
-}
-
 void read_token_stream(
 		InvertedIndexNew* II, 
-		TokenStream* token_stream
+		TokenStream* token_stream,
+		Arena* arena
 		) {
 	// Reset file pointer to beginning
 	if (fseek(token_stream->file, 0, SEEK_SET) != 0) {
@@ -114,26 +122,38 @@ void read_token_stream(
 		exit(1);
 	}
 
+	// Chunks of an out-of-core build can be empty in a column.
+	if (II->num_terms == 0) {
+		free(II->doc_freqs);
+		II->doc_freqs = NULL;
+		free_token_stream(token_stream);
+		fclose(token_stream->file);
+		return;
+	}
+
 	// Assume num_terms, num_docs, and avg_doc_size are known and set.
 	assert(II->num_terms > 0);
 	assert(II->num_docs > 0);
 	assert(II->avg_doc_size > 0.0f);
 
+	// doc_freqs grew by doubling while tokenizing. Keep only what's used.
+	uint32_t* doc_freqs = (uint32_t*)arena->copy(II->doc_freqs, II->num_terms * sizeof(uint32_t));
+	free(II->doc_freqs);
+	II->doc_freqs = doc_freqs;
+
 	assert(II->term_offsets == NULL);
-	II->term_offsets = (uint32_t*)malloc(II->num_terms * sizeof(uint32_t));
+	II->term_offsets = (uint32_t*)arena->allocate(II->num_terms * sizeof(uint32_t));
 
 	// Calculate doc offsets from doc_freqs
 	uint32_t offset = 0;
-	II->term_offsets[0] = offset;
-	for (size_t term_idx = 1; term_idx < II->num_terms; ++term_idx) {
-		offset += II->doc_freqs[term_idx];
+	for (size_t term_idx = 0; term_idx < II->num_terms; ++term_idx) {
 		II->term_offsets[term_idx] = offset;
+		offset += II->doc_freqs[term_idx];
 
 		assert(II->doc_freqs[term_idx] <= II->num_docs);
 	}
-	offset += II->doc_freqs[0];
 
-	II->doc_ids = (tf_df_t*)malloc(offset * sizeof(tf_df_t));
+	II->doc_ids = (tf_df_t*)arena->allocate(offset * sizeof(tf_df_t));
 
 	uint32_t* num_docs_read = (uint32_t*)malloc(II->num_terms * sizeof(uint32_t));
 	memset(num_docs_read, 0, II->num_terms * sizeof(uint32_t));
@@ -312,42 +332,92 @@ void read_token_stream(
 }
 */
 
-uint64_t calc_inverted_index_size(const InvertedIndexNew* II) {
-	uint64_t size = 0;
-
-	// Num tokens
-	uint64_t num_tokens = II->term_offsets[II->num_terms - 1] + II->doc_freqs[II->num_terms - 1];
+void init_bm25_partition_new(BM25PartitionNew* IP, uint64_t num_docs, uint16_t num_cols, uint16_t numa_node) {
+	assert(num_cols > 0);
+	assert(num_cols < 4096);
 
-	// doc_ids
-	size += num_tokens * sizeof(tf_df_t);
+	IP->II = (InvertedIndexNew*)malloc(num_cols * sizeof(InvertedIndexNew));
+	IP->arena = new Arena(numa_node);
+	IP->unique_term_mappings = new VocabMap[num_cols];
+	IP->vocab_bytes = (uint64_t*)calloc(num_cols, sizeof(uint64_t));
+	for (uint16_t col_idx = 0; col_idx < num_cols; ++col_idx) {
+		IP->unique_term_mappings[col_idx] = VocabMap(
+				VocabMap::allocator_type(&IP->vocab_bytes[col_idx])
+				);
+	}
 
-	// doc_sizes
-	size += II->num_docs * sizeof(uint16_t);
+	IP->line_offsets  = (uint64_t*)IP->arena->allocate(num_docs * sizeof(uint64_t));
+	IP->frozen_vocabs = NULL;
+	IP->deleted_docs  = NULL;
+	IP->num_deleted   = 0;
+	IP->num_docs = num_docs;
+	IP->numa_node = numa_node;
+}
 
-	// term_offsets + doc_freqs
-	size += II->num_terms * 2 * sizeof(uint32_t);
+void free_bm25_partition_new(BM25PartitionNew* IP) {
+	free(IP->II);
+	delete[] IP->unique_term_mappings;
+	free(IP->vocab_bytes);
+	delete[] IP->frozen_vocabs;
+	free(IP->deleted_docs);
 
-	// num_terms + num_docs + avg_doc_size
-	size += 2 * sizeof(uint32_t) + sizeof(float);
+	// Vocab keys point into the arena. Only drop it once the maps are gone.
+	delete IP->arena;
+}
 
-	return size;
+static inline uint64_t deleted_docs_words(uint64_t num_docs) {
+	return (num_docs + 63) / 64;
 }
 
-void init_bm25_partition_new(BM25PartitionNew* IP, uint64_t num_docs, uint16_t num_cols) {
-	assert(num_cols > 0);
-	assert(num_cols < 4096);
+static inline bool is_doc_deleted(const uint64_t* deleted_docs, uint64_t doc_id) {
+	return (deleted_docs[doc_id >> 6] >> (doc_id & 63)) & 1;
+}
 
-	IP->II = (InvertedIndexNew*)malloc(num_cols * sizeof(InvertedIndexNew));
-	IP->unique_term_mappings = new MAP<std::string, uint32_t>[num_cols];
+// Adds term with id term_id to the partition vocab of col_idx unless it's
+// already there. New terms are copied into the partition arena.
+static inline std::pair<VocabMap::iterator, bool> add_vocab_term(
+		BM25PartitionNew* IP, 
+		uint16_t col_idx, 
+		const std::string& term,
+		uint32_t term_id
+		) {
+	bool add = false;
+	auto it = IP->unique_term_mappings[col_idx].lazy_emplace(
+			term,
+			[&](const VocabMap::constructor& ctor) {
+				add = true;
+				const char* data = (const char*)IP->arena->copy(term.data(), term.size(), 1);
+				ctor(std::string_view(data, term.size()), term_id);
+			});
+	return {it, add};
+}
 
-	IP->line_offsets = (uint64_t*)malloc(num_docs * sizeof(uint64_t));
-	IP->num_docs = num_docs;
+static inline uint64_t hash_vocab_term(
+		const BM25PartitionNew* IP, 
+		uint16_t col_idx, 
+		const std::string& term
+		) {
+	if (IP->frozen_vocabs != NULL) {
+		return fnv1a_hash(term.data(), term.size());
+	}
+	return IP->unique_term_mappings[col_idx].hash(term);
 }
 
-void free_bm25_partition_new(BM25PartitionNew* IP) {
-	free(IP->II);
-	free(IP->unique_term_mappings);
-	free(IP->line_offsets);
+// Term id in the partition vocab of col_idx, or UINT32_MAX.
+// hash comes from hash_vocab_term, which is the same for every partition.
+static inline uint32_t find_vocab_term(
+		const BM25PartitionNew* IP, 
+		uint16_t col_idx, 
+		const std::string& term,
+		uint64_t hash
+		) {
+	if (IP->frozen_vocabs != NULL) {
+		return frozen_vocab_find(&IP->frozen_vocabs[col_idx], term, hash);
+	}
+
+	const VocabMap& vocab = IP->unique_term_mappings[col_idx];
+	auto it = vocab.find(term, hash);
+	return (it == vocab.end()) ? UINT32_MAX : it->second;
 }
 
 uint64_t _BM25::get_doc_freqs_sum(
@@ -359,9 +429,9 @@ uint64_t _BM25::get_doc_freqs_sum(
 	for (size_t i = 0; i < num_partitions; ++i) {
 		BM25PartitionNew* IP = &index_partitions[i];
 
-		auto it = IP->unique_term_mappings[col_idx].find(term);
-		if (it != IP->unique_term_mappings[col_idx].end()) {
-			doc_freqs_sum += IP->II[col_idx].doc_freqs[it->second];
+		uint32_t term_idx = find_vocab_term(IP, col_idx, term, hash_vocab_term(IP, col_idx, term));
+		if (term_idx != UINT32_MAX) {
+			doc_freqs_sum += IP->II[col_idx].doc_freqs[term_idx];
 		}
 	}
 	return doc_freqs_sum;
@@ -637,7 +707,8 @@ void _BM25::determine_partition_boundaries_json() {
 		init_bm25_partition_new(
 				&index_partitions[i],
 				chunk_size,
-				search_cols.size()
+				search_cols.size(),
+				numa_node_for_partition(i)
 				);
 
 		size_t idx = 0;
@@ -699,6 +770,22 @@ void _BM25::proccess_csv_header() {
 	free(line);
 }
 
+// Offset just past the newline ending the csv row that starts at pos.
+// Newlines inside quoted fields don't end a row. 0 if the row isn't complete before end.
+static inline uint64_t find_csv_row_end(const char* file_data, uint64_t pos, uint64_t end) {
+	bool quoted = false;
+	for (; pos < end; ++pos) {
+		// An escaped quote toggles twice.
+		if (file_data[pos] == '"') {
+			quoted = !quoted;
+		}
+		else if (file_data[pos] == '\n' && !quoted) {
+			return pos + 1;
+		}
+	}
+	return 0;
+}
+
 void _BM25::determine_partition_boundaries_csv_rfc_4180() {
     FILE* f = reference_file_handles[0];
 
@@ -768,7 +855,8 @@ void _BM25::determine_partition_boundaries_csv_rfc_4180() {
 		init_bm25_partition_new(
 				&index_partitions[i],
 				current_chunk_size,
-				search_cols.size()
+				search_cols.size(),
+				numa_node_for_partition(i)
 				);
 
 		size_t idx = 0;
@@ -776,7 +864,8 @@ void _BM25::determine_partition_boundaries_csv_rfc_4180() {
 			IP->line_offsets[idx++] = line_offsets[j];
 		}
     }
-    partition_boundaries.push_back(line_offsets.back());
+	// End of the last row, not its start. Appended segments begin here.
+    partition_boundaries.push_back(file_size);
 
 	assert((uint16_t)partition_boundaries.size() == num_partitions + 1);
 
@@ -1051,10 +1140,7 @@ uint32_t _BM25::process_doc_partition_json(
 				continue;
 			}
 
-			auto [it, add] = IP->unique_term_mappings[col_idx].try_emplace(
-					term, 
-					II->num_terms
-					);
+			auto [it, add] = add_vocab_term(IP, col_idx, term, II->num_terms);
 			if (add) {
 				// New term
 				terms_seen.insert({it->second, 1});
@@ -1093,10 +1179,7 @@ uint32_t _BM25::process_doc_partition_json(
 
 	if (term != "") {
 		if ((stop_words.find(term) == stop_words.end()) && is_valid_token(term)) {
-			auto [it, add] = IP->unique_term_mappings[col_idx].try_emplace(
-					term, 
-					II->num_terms
-					);
+			auto [it, add] = add_vocab_term(IP, col_idx, term, II->num_terms);
 
 			if (add) {
 				// New term
@@ -1207,10 +1290,7 @@ uint32_t _BM25::process_doc_partition_rfc_4180(
 				continue;
 			}
 
-			auto [it, add] = IP->unique_term_mappings[col_idx].try_emplace(
-					term, 
-					unique_terms_found
-					);
+			auto [it, add] = add_vocab_term(IP, col_idx, term, unique_terms_found);
 			if (add) {
 				// New term
 				terms_seen.insert({it->second, 1});
@@ -1502,10 +1582,7 @@ uint32_t _BM25::process_doc_partition_rfc_4180_v2(
 				continue;
 			}
 
-			auto [it, add] = IP->unique_term_mappings[col_idx].try_emplace(
-					term, 
-					II->num_terms
-					);
+			auto [it, add] = add_vocab_term(IP, col_idx, term, II->num_terms);
 			if (add) {
 				// New term
 				terms_seen.insert({it->second, 1});
@@ -1543,10 +1620,7 @@ uint32_t _BM25::process_doc_partition_rfc_4180_v2(
 
 	if (term != "") {
 		if ((stop_words.find(term) == stop_words.end()) && is_valid_token(term)) {
-			auto [it, add] = IP->unique_term_mappings[col_idx].try_emplace(
-					term, 
-					II->num_terms
-					);
+			auto [it, add] = add_vocab_term(IP, col_idx, term, II->num_terms);
 
 			if (add) {
 				// New term
@@ -1655,10 +1729,7 @@ uint32_t _BM25::_process_doc_partition_rfc_4180_quoted_v2(
 				continue;
 			}
 
-			auto [it, add] = IP->unique_term_mappings[col_idx].try_emplace(
-					term, 
-					II->num_terms
-					);
+			auto [it, add] = add_vocab_term(IP, col_idx, term, II->num_terms);
 			if (add) {
 				// New term
 				terms_seen.insert({it->second, 1});
@@ -1697,10 +1768,7 @@ uint32_t _BM25::_process_doc_partition_rfc_4180_quoted_v2(
 
 	if (term != "") {
 		if ((stop_words.find(term) == stop_words.end()) && is_valid_token(term)) {
-			auto [it, add] = IP->unique_term_mappings[col_idx].try_emplace(
-					term, 
-					II->num_terms
-					);
+			auto [it, add] = add_vocab_term(IP, col_idx, term, II->num_terms);
 
 			if (add) {
 				// New term
@@ -1904,6 +1972,8 @@ void _BM25::process_doc_partition_rfc_4180_mmap(
 */
 
 void _BM25::update_progress(int line_num, int num_lines, uint16_t partition_id) {
+	if (!show_progress) return;
+
     const int bar_width = 121;
 
     float percentage = static_cast<float>(line_num) / num_lines;
@@ -2109,6 +2179,7 @@ void _BM25::write_bloom_filters(uint16_t partition_id) {
 void _BM25::read_json(uint64_t start_byte, uint64_t end_byte, uint16_t partition_id) {
 	FILE* f = reference_file_handles[partition_id];
 	BM25PartitionNew* IP = &index_partitions[partition_id];
+	NumaAffinity affinity(IP->numa_node);
 
 	if (fseek(f, start_byte, SEEK_SET) != 0) {
 		std::cerr << "Error seeking file." << std::endl;
@@ -2123,16 +2194,20 @@ void _BM25::read_json(uint64_t start_byte, uint64_t end_byte, uint16_t partition
 	cmd = "mkdir -p " + dir;
 	system(cmd.c_str());
 
+	// Token stream buffers only live until the partition is built.
+	Arena build_arena;
 	TokenStream* token_streams = (TokenStream*)malloc(search_cols.size() * sizeof(TokenStream));
 	uint32_t* doc_freqs_capacity = (uint32_t*)malloc(search_cols.size() * sizeof(uint32_t));
 
 	for (size_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		init_inverted_index_new(&IP->II[col_idx]);
+
 		doc_freqs_capacity[col_idx] = (uint32_t)(IP->num_docs * 0.1);
 		IP->II[col_idx].doc_freqs = (uint32_t*)malloc(doc_freqs_capacity[col_idx] * sizeof(uint32_t));
-		IP->II[col_idx].doc_sizes = (uint16_t*)malloc(IP->num_docs * sizeof(uint16_t));
+		IP->II[col_idx].doc_sizes = (uint16_t*)IP->arena->allocate(IP->num_docs * sizeof(uint16_t));
 
 		std::string filename = dir + "/" + "col_" + std::to_string(col_idx) + ".txt";
-		init_token_stream(&token_streams[col_idx], filename);
+		init_token_stream(&token_streams[col_idx], filename, &build_arena);
 	}
 
 	// Reset file pointer to beginning
@@ -2263,7 +2338,7 @@ void _BM25::read_json(uint64_t start_byte, uint64_t end_byte, uint16_t partition
 		IP->II[col_idx].num_docs  = IP->num_docs;
 		IP->II[col_idx].avg_doc_size = IP->II[col_idx].avg_doc_size;
 
-		read_token_stream(&IP->II[col_idx], &token_streams[col_idx]);
+		read_token_stream(&IP->II[col_idx], &token_streams[col_idx], IP->arena);
 	}
 
 	free(token_streams);
@@ -2278,6 +2353,10 @@ void _BM25::read_csv_rfc_4180(uint64_t start_byte, uint64_t end_byte, uint16_t p
 	FILE* f = reference_file_handles[partition_id];
 	BM25PartitionNew* IP = &index_partitions[partition_id];
 
+	// Token streams, vocab and postings are all touched first from here, so
+	// the partition's heap memory lands on its node along with the arena.
+	NumaAffinity affinity(IP->numa_node);
+
 	// Reset file pointer to beginning
 	if (fseek(f, start_byte, SEEK_SET) != 0) {
 		std::cerr << "Error seeking file." << std::endl;
@@ -2295,20 +2374,23 @@ void _BM25::read_csv_rfc_4180(uint64_t start_byte, uint64_t end_byte, uint16_t p
 	cmd = "mkdir -p " + dir;
 	system(cmd.c_str());
 
+	// Token stream buffers only live until the partition is built.
+	Arena build_arena;
 	TokenStream* token_streams = (TokenStream*)malloc(search_cols.size() * sizeof(TokenStream));
 	uint32_t* doc_freqs_capacity = (uint32_t*)malloc(search_cols.size() * sizeof(uint32_t));
 
 	for (size_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
 		init_inverted_index_new(&IP->II[col_idx]);
 
-		doc_freqs_capacity[col_idx] = (uint32_t)(IP->num_docs * 0.1);
+		// Appended segments can be a handful of rows. Keep room to grow.
+		doc_freqs_capacity[col_idx] = max(16, (uint32_t)(IP->num_docs * 0.1));
 		IP->II[col_idx].doc_freqs = (uint32_t*)malloc(
 				doc_freqs_capacity[col_idx] * sizeof(uint32_t)
 				);
-		IP->II[col_idx].doc_sizes = (uint16_t*)malloc(IP->num_docs * sizeof(uint16_t));
+		IP->II[col_idx].doc_sizes = (uint16_t*)IP->arena->allocate(IP->num_docs * sizeof(uint16_t));
 
 		std::string filename = dir + "/" + "col_" + std::to_string(col_idx) + ".txt";
-		init_token_stream(&token_streams[col_idx], filename);
+		init_token_stream(&token_streams[col_idx], filename, &build_arena);
 	}
 
 	std::string doc = "";
@@ -2441,7 +2523,7 @@ void _BM25::read_csv_rfc_4180(uint64_t start_byte, uint64_t end_byte, uint16_t p
 		IP->II[col_idx].num_docs  = IP->num_docs;
 		IP->II[col_idx].avg_doc_size = IP->II[col_idx].avg_doc_size;
 
-		read_token_stream(&IP->II[col_idx], &token_streams[col_idx]);
+		read_token_stream(&IP->II[col_idx], &token_streams[col_idx], IP->arena);
 	}
 
 	free(token_streams);
@@ -2461,6 +2543,7 @@ void _BM25::read_in_memory(
 		uint16_t partition_id
 		) {
 	BM25PartitionNew* IP = &index_partitions[partition_id];
+	NumaAffinity affinity(IP->numa_node);
 
 	IP->num_docs = end_idx - start_idx;
 
@@ -2471,18 +2554,20 @@ void _BM25::read_in_memory(
 	cmd = "mkdir -p " + dir;
 	system(cmd.c_str());
 
+	// Token stream buffers only live until the partition is built.
+	Arena build_arena;
 	TokenStream* token_streams = (TokenStream*)malloc(search_cols.size() * sizeof(TokenStream));
 	uint32_t* doc_freqs_capacity = (uint32_t*)malloc(search_cols.size() * sizeof(uint32_t));
 
 	for (size_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		init_inverted_index_new(&IP->II[col_idx]);
+
 		doc_freqs_capacity[col_idx] = (uint32_t)(IP->num_docs * 0.1);
 		IP->II[col_idx].doc_freqs = (uint32_t*)malloc(doc_freqs_capacity[col_idx] * sizeof(uint32_t));
-		IP->II[col_idx].doc_sizes = (uint16_t*)malloc(IP->num_docs * sizeof(uint16_t));
+		IP->II[col_idx].doc_sizes = (uint16_t*)IP->arena->allocate(IP->num_docs * sizeof(uint16_t));
 
 		std::string filename = dir + "/" + "col_" + std::to_string(col_idx) + ".txt";
-		init_token_stream(&token_streams[col_idx], filename);
-
-		init_inverted_index_new(&IP->II[col_idx]);
+		init_token_stream(&token_streams[col_idx], filename, &build_arena);
 	}
 
 	uint32_t cntr = 0;
@@ -2505,6 +2590,12 @@ void _BM25::read_in_memory(
 		}
 		++cntr;
 	}
+
+	// Flush remaining tokens
+	for (size_t col = 0; col < search_cols.size(); ++col) {
+		flush_token_stream(&token_streams[col]);
+	}
+
 	if (!DEBUG) update_progress(cntr + 1, IP->num_docs, partition_id);
 
 	// Calc avg_doc_size
@@ -2522,7 +2613,7 @@ void _BM25::read_in_memory(
 		IP->II[col_idx].num_docs  = IP->num_docs;
 		IP->II[col_idx].avg_doc_size = IP->II[col_idx].avg_doc_size;
 
-		read_token_stream(&IP->II[col_idx], &token_streams[col_idx]);
+		read_token_stream(&IP->II[col_idx], &token_streams[col_idx], IP->arena);
 	}
 
 	free(token_streams);
@@ -2534,78 +2625,218 @@ void _BM25::read_in_memory(
 }
 
 
-std::vector<std::pair<std::string, std::string>> _BM25::get_csv_line(
+void _BM25::map_source_file() {
+	FILE* f = reference_file_handles[0];
+
+	struct stat sb;
+	if (fstat(fileno(f), &sb) == -1) {
+		std::cerr << "Error getting file size." << std::endl;
+		std::exit(1);
+	}
+	source_size = sb.st_size;
+	if (source_size == 0) return;
+
+	// Read only view shared by all fetches and all processes mapping the file.
+	// No file position, so no locking.
+	source_data = (char*)mmap(NULL, source_size, PROT_READ, MAP_SHARED, fileno(f), 0);
+	if (source_data == MAP_FAILED) {
+		std::cerr << "Error mapping file to memory." << std::endl;
+		std::exit(1);
+	}
+	madvise(source_data, source_size, MADV_RANDOM);
+}
+
+std::pair<uint64_t, uint64_t> _BM25::get_line_span(
 		uint32_t line_num, 
 		uint16_t partition_id
 		) {
-	FILE* f = reference_file_handles[partition_id];
+	if (source_data == NULL) {
+		std::cerr << "Error: Source file " << filename << " is not available. ";
+		std::cerr << "Build a document store to fetch rows without it." << std::endl;
+		std::exit(1);
+	}
 	BM25PartitionNew* IP = &index_partitions[partition_id];
 
-	// seek from FILE* reference_file which is already open
-	fseek(f, IP->line_offsets[line_num], SEEK_SET);
-	char*   line = NULL;
-	size_t  len  = 0;
-	ssize_t read = rfc4180_getline(&line, &len, f);
+	uint64_t start = IP->line_offsets[line_num];
+	uint64_t end;
+	if (line_num + 1 < IP->num_docs) {
+		end = IP->line_offsets[line_num + 1];
+	} else if (partition_id + 1 < num_partitions || file_type == CSV) {
+		// Csv boundaries end at the last indexed row. Bytes past it may be a row still being written.
+		end = partition_boundaries[partition_id + 1];
+	} else {
+		end = source_size;
+	}
+	end = min(end, source_size);
 
-	// Create effective json by combining column names with values split by commas
-	std::vector<std::pair<std::string, std::string>> row;
-	std::string cell;
-	size_t col_idx = 0;
+	// Drop the line terminator, \n or \r\n.
+	if (end > start && source_data[end - 1] == '\n') --end;
+	if (end > start && source_data[end - 1] == '\r') --end;
+
+	return std::make_pair(start, end);
+}
+
+void _BM25::get_csv_field_spans(
+		uint32_t line_num, 
+		uint16_t partition_id,
+		uint16_t num_fields,
+		std::vector<FieldSpan>& spans
+		) {
+	auto [start, end] = get_line_span(line_num, partition_id);
+	const char*  line = source_data + start;
+	const size_t len  = end - start;
+
+	spans.clear();
+
+	// Only quotes and commas are inspected. Fields past num_fields are never scanned.
 	size_t i = 0;
+	while (spans.size() < num_fields) {
+		size_t field_start = i;
+
+		while (i < len && line[i] != ',') {
+			if (line[i] == '"') {
+				// Scan to next unescaped quote
+				++i;
+				while (i < len) {
+					if (line[i] == '"') {
+						if (i + 1 < len && line[i + 1] == '"') {
+							i += 2;
+							continue;
+						}
+						break;
+					}
+					++i;
+				}
+			}
+			++i;
+		}
+		i = min(i, len);
 
-	while (i < (size_t)read - 1) {
+		FieldSpan span;
+		span.offset = start + field_start;
+		span.length = (uint32_t)(i - field_start);
+		spans.push_back(span);
 
-		if (line[i] == '"') {
-			// Scan to next unescaped quote
+		if (i >= len) break;
+		++i;
+	}
+}
+
+std::string _BM25::decode_csv_field(const FieldSpan& span) {
+	const char* field = source_data + span.offset;
+
+	std::string cell;
+	cell.reserve(span.length);
+
+	size_t i = 0;
+	while (i < span.length) {
+		if (field[i] == '"') {
+			// Unescape the quoted section.
 			++i;
-			while (1) {
-				if (line[i] == '"') {
-					if (line[i + 1] == '"') {
+			while (i < span.length) {
+				if (field[i] == '"') {
+					if (i + 1 < span.length && field[i + 1] == '"') {
 						cell += '"';
 						i += 2;
 						continue;
 					} 
-					else {
-						++i;
-						break;
-					}
+					++i;
+					break;
 				}
-				cell += line[i];
+				cell += field[i];
 				++i;
 			}
+			continue;
 		}
+		cell += field[i];
+		++i;
+	}
+	return cell;
+}
 
-		if (line[i] == ',') {
-			row.emplace_back(columns[col_idx], cell);
-			cell.clear();
-			++col_idx;
+std::vector<uint16_t> _BM25::get_column_projection(const std::vector<std::string>& column_names) {
+	std::vector<uint16_t> projection;
+
+	// Case insensitive. Csv headers are lowercased but in-memory column names are not.
+	std::vector<std::string> lower_columns = columns;
+	for (std::string& col : lower_columns) {
+		std::transform(col.begin(), col.end(), col.begin(), ::tolower);
+	}
+
+	for (std::string name : column_names) {
+		std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+		auto it = std::find(lower_columns.begin(), lower_columns.end(), name);
+		// Caller input, not index state. Raised as a ValueError in python.
+		if (it == lower_columns.end()) {
+			throw std::invalid_argument("Column " + name + " not found.");
 		}
-		else {
-			cell += line[i];
+		projection.push_back((uint16_t)(it - lower_columns.begin()));
+	}
+	return projection;
+}
+
+std::vector<std::pair<std::string, std::string>> _BM25::get_csv_line(
+		uint32_t line_num, 
+		uint16_t partition_id,
+		const std::vector<uint16_t>* projection
+		) {
+	std::vector<FieldSpan> spans;
+	std::vector<std::pair<std::string, std::string>> row;
+
+	if (projection == NULL) {
+		get_csv_field_spans(line_num, partition_id, columns.size(), spans);
+
+		for (uint16_t col_idx = 0; col_idx < spans.size(); ++col_idx) {
+			row.emplace_back(columns[col_idx], decode_csv_field(spans[col_idx]));
 		}
-		++i;
+		return row;
+	}
+
+	uint16_t num_fields = 0;
+	for (const uint16_t& col_idx : *projection) {
+		num_fields = max(num_fields, col_idx + 1);
+	}
+	get_csv_field_spans(line_num, partition_id, num_fields, spans);
+
+	// Only the projected fields are decoded.
+	for (const uint16_t& col_idx : *projection) {
+		if (col_idx >= spans.size()) continue;
+		row.emplace_back(columns[col_idx], decode_csv_field(spans[col_idx]));
 	}
-	row.emplace_back(columns[col_idx], cell);
 	return row;
 }
 
 
 std::vector<std::pair<std::string, std::string>> _BM25::get_json_line(
 		uint32_t line_num, 
-		uint16_t partition_id
+		uint16_t partition_id,
+		const std::vector<uint16_t>* projection
 		) {
-	FILE* f = reference_file_handles[partition_id];
-	BM25PartitionNew* IP = &index_partitions[partition_id];
+	std::vector<std::pair<std::string, std::string>> row = _get_json_line(line_num, partition_id);
+	if (projection == NULL) {
+		return row;
+	}
 
-	// seek from FILE* reference_file which is already open
-	fseek(f, IP->line_offsets[line_num], SEEK_SET);
-	char* line = NULL;
-	size_t len = 0;
-	ssize_t size = getline(&line, &len, f);
-	if (size == -1) {
-		std::cerr << "Error reading line." << std::endl;
-		std::exit(1);
+	std::vector<std::pair<std::string, std::string>> projected_row;
+	for (const uint16_t& col_idx : *projection) {
+		for (auto& pair : row) {
+			if (pair.first == columns[col_idx]) {
+				projected_row.push_back(std::move(pair));
+				break;
+			}
+		}
 	}
+	return projected_row;
+}
+
+std::vector<std::pair<std::string, std::string>> _BM25::_get_json_line(
+		uint32_t line_num, 
+		uint16_t partition_id
+		) {
+	auto [start, end] = get_line_span(line_num, partition_id);
+	const char*  line = source_data + start;
+	const size_t len  = end - start;
 
 	// Create effective json by combining column names with values split by commas
 	std::vector<std::pair<std::string, std::string>> row;
@@ -2613,14 +2844,15 @@ std::vector<std::pair<std::string, std::string>> _BM25::get_json_line(
 	std::string first  = "";
 	std::string second = "";
 
-	if (line[1] == '}') {
+	if (len < 2 || line[1] == '}') {
 		return row;
 	}
 
 	size_t char_idx = 2;
-	while (true) {
-		while (line[char_idx] != '"') {
-			if (line[char_idx] == '\\') {
+	while (char_idx < len) {
+		while (char_idx < len && line[char_idx] != '"') {
+			// A backslash ending the line has nothing to escape.
+			if (line[char_idx] == '\\' && char_idx + 1 < len) {
 				++char_idx;
 				first += line[char_idx];
 				++char_idx;
@@ -2632,12 +2864,12 @@ std::vector<std::pair<std::string, std::string>> _BM25::get_json_line(
 		char_idx += 2;
 
 		// Go to first char of value.
-		while (line[char_idx] == '"' || line[char_idx] == ' ') {
+		while (char_idx < len && (line[char_idx] == '"' || line[char_idx] == ' ')) {
 			++char_idx;
 		}
 
-		while (line[char_idx] != '}' || line[char_idx] != '"' || line[char_idx] != ',') {
-			if (line[char_idx] == '\\') {
+		while (char_idx < len) {
+			if (line[char_idx] == '\\' && char_idx + 1 < len) {
 				++char_idx;
 				second += line[char_idx];
 				++char_idx;
@@ -2652,329 +2884,585 @@ std::vector<std::pair<std::string, std::string>> _BM25::get_json_line(
 			++char_idx;
 		}
 		++char_idx;
-		if (line[char_idx] == '}') {
+		if (char_idx < len && line[char_idx] == '}') {
 			return row;
 		}
 	}
 	return row;
 }
 
-/*
-void _BM25::save_index_partition(
-		std::string db_dir,
-		uint16_t partition_id
+std::vector<std::pair<std::string, std::string>> _BM25::get_stored_line(
+		uint64_t doc_id,
+		uint16_t partition_id,
+		const std::vector<uint16_t>* projection
 		) {
-	std::string UNIQUE_TERM_MAPPING_PATH = db_dir + "/unique_term_mapping.bin";
-	std::string INVERTED_INDEX_PATH 	 = db_dir + "/inverted_index.bin";
-	std::string DOC_SIZES_PATH 		     = db_dir + "/doc_sizes.bin";
-	std::string LINE_OFFSETS_PATH 		 = db_dir + "/line_offsets.bin";
+	// In memory results carry global doc ids.
+	if (file_type == IN_MEMORY) {
+		doc_id -= partition_boundaries[partition_id];
+	}
 
-	BM25Partition& IP = index_partitions[partition_id];
+	std::vector<std::string> fields;
+	doc_stores[partition_id]->get(doc_id, fields);
 
+	std::vector<std::pair<std::string, std::string>> row;
+	if (projection == NULL) {
+		for (uint16_t field_idx = 0; field_idx < fields.size(); ++field_idx) {
+			row.emplace_back(columns[doc_store_cols[field_idx]], std::move(fields[field_idx]));
+		}
+		return row;
+	}
 
-	for (uint16_t col_idx = 0; col_idx < search_col_idxs.size(); ++col_idx) {
-		serialize_robin_hood_flat_map_string_u32(
-				IP.unique_term_mapping[col_idx],
-				UNIQUE_TERM_MAPPING_PATH + "_" + std::to_string(partition_id) + "_" + std::to_string(col_idx)
-				);
-		serialize_inverted_index(
-				IP.II[col_idx], 
-				INVERTED_INDEX_PATH + "_" + std::to_string(partition_id) + "_" + std::to_string(col_idx)
-				);
+	// Columns that were not stored are left out.
+	for (const uint16_t& col_idx : *projection) {
+		for (uint16_t field_idx = 0; field_idx < fields.size(); ++field_idx) {
+			if (doc_store_cols[field_idx] == col_idx) {
+				row.emplace_back(columns[col_idx], fields[field_idx]);
+				break;
+			}
+		}
 	}
+	return row;
+}
 
-	std::vector<uint8_t> compressed_line_offsets;
-	compressed_line_offsets.reserve(IP.line_offsets.size() * 2);
-	compress_uint64(IP.line_offsets, compressed_line_offsets);
+DocStore* _BM25::build_partition_doc_store(uint16_t partition_id, const std::vector<uint16_t>& projection) {
+	DocStore* store = new DocStore(projection.size());
+	std::vector<std::string> fields(projection.size());
+	std::vector<std::pair<std::string, std::string>> row;
 
-	serialize_vector_u8(
-			compressed_line_offsets, LINE_OFFSETS_PATH + "_" + std::to_string(partition_id)
-			);
+	for (uint64_t line_num = 0; line_num < index_partitions[partition_id].num_docs; ++line_num) {
+		if (file_type == CSV) {
+			row = get_csv_line(line_num, partition_id, &projection);
+		}
+		else {
+			row = get_json_line(line_num, partition_id, &projection);
+		}
 
-	// Save doc_freqs
-	for (uint16_t col_idx = 0; col_idx < search_col_idxs.size(); ++col_idx) {
-		serialize_vector_u32(
-				IP.II[col_idx].doc_freqs, 
-				db_dir + "/doc_freqs_" + std::to_string(partition_id) + "_" + std::to_string(col_idx)
-				);
+		// Missing fields are stored empty so every doc has the same layout.
+		for (uint16_t field_idx = 0; field_idx < projection.size(); ++field_idx) {
+			fields[field_idx].clear();
+			for (auto& pair : row) {
+				if (pair.first == columns[projection[field_idx]]) {
+					fields[field_idx] = std::move(pair.second);
+					break;
+				}
+			}
+		}
+		store->add(fields);
 	}
+	store->finish();
+	return store;
 }
 
-void _BM25::load_index_partition(
-		std::string db_dir,
-		uint16_t partition_id
-		) {
-	std::string UNIQUE_TERM_MAPPING_PATH = db_dir + "/unique_term_mapping.bin";
-	std::string INVERTED_INDEX_PATH 	 = db_dir + "/inverted_index.bin";
-	std::string DOC_SIZES_PATH 		     = db_dir + "/doc_sizes.bin";
-	std::string LINE_OFFSETS_PATH 		 = db_dir + "/line_offsets.bin";
+void _BM25::build_doc_store(const std::vector<std::string>& column_names) {
+	if (file_type == IN_MEMORY) {
+		std::cerr << "Error: Use build_doc_store_in_memory for in-memory indexes." << std::endl;
+		std::exit(1);
+	}
 
-	BM25Partition& IP = index_partitions[partition_id];
-	IP.unique_term_mapping.resize(search_col_idxs.size());
-	IP.II.resize(search_col_idxs.size());
+	std::lock_guard<std::mutex> merge_lock(merge_mutex);
+	std::lock_guard<std::mutex> append_lock(append_mutex);
+	std::unique_lock<std::shared_mutex> lock(index_mutex);
 
-	for (uint16_t col_idx = 0; col_idx < search_col_idxs.size(); ++col_idx) {
-		deserialize_robin_hood_flat_map_string_u32(
-				IP.unique_term_mapping[col_idx],
-				UNIQUE_TERM_MAPPING_PATH + "_" + std::to_string(partition_id) + "_" + std::to_string(col_idx)
-				);
-		deserialize_inverted_index(
-				IP.II[col_idx], 
-				INVERTED_INDEX_PATH + "_" + std::to_string(partition_id) + "_" + std::to_string(col_idx)
-				);
+	// Empty column_names stores every column.
+	std::vector<uint16_t> projection = get_column_projection(column_names);
+	if (projection.empty()) {
+		for (uint16_t col_idx = 0; col_idx < columns.size(); ++col_idx) {
+			projection.push_back(col_idx);
+		}
 	}
 
-	std::vector<uint8_t> compressed_line_offsets;
-	deserialize_vector_u8(
-			compressed_line_offsets, LINE_OFFSETS_PATH + "_" + std::to_string(partition_id)
-			);
+	free_doc_stores();
+	doc_store_cols = projection;
+	doc_stores.resize(num_partitions, NULL);
 
-	decompress_uint64(compressed_line_offsets, IP.line_offsets);
-	printf("Line offsets size: %lu\n", IP.line_offsets.size());
+	std::vector<std::thread> threads;
+	for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+		threads.push_back(std::thread([this, &projection, partition_id] {
+			doc_stores[partition_id] = build_partition_doc_store(partition_id, projection);
+		}));
+	}
 
-	// Load doc_freqs
-	for (uint16_t col_idx = 0; col_idx < search_col_idxs.size(); ++col_idx) {
-		deserialize_vector_u32(
-				IP.II[col_idx].doc_freqs, 
-				db_dir + "/doc_freqs_" + std::to_string(partition_id) + "_" + std::to_string(col_idx)
-				);
+	for (auto& thread : threads) {
+		thread.join();
 	}
 
-	IP.num_docs = IP.II[0].doc_sizes.size();
+	// Cached rows may hold columns that are no longer fetched.
+	invalidate_query_cache();
 }
 
-void _BM25::save_to_disk(const std::string& db_dir) {
-	auto start = std::chrono::high_resolution_clock::now();
-
-	if (access(db_dir.c_str(), F_OK) != -1) {
-		// Remove the directory if it exists
-		std::string command = "rm -r " + db_dir;
-		int success = system(command.c_str());
-		if (success != 0) {
-			std::cerr << "Error removing directory.\n";
-			std::exit(1);
-		}
-
-		// Create the directory
-		command = "mkdir " + db_dir;
-		success = system(command.c_str());
-		if (success != 0) {
-			std::cerr << "Error creating directory.\n";
-			std::exit(1);
-		}
+void _BM25::build_doc_store_in_memory(
+		const std::vector<std::vector<std::string>>& documents,
+		const std::vector<std::string>& column_names
+		) {
+	if (file_type != IN_MEMORY) {
+		std::cerr << "Error: build_doc_store_in_memory requires an in-memory index." << std::endl;
+		std::exit(1);
 	}
-	else {
-		// Create the directory if it does not exist
-		std::string command = "mkdir " + db_dir;
-		int success = system(command.c_str());
-		if (success != 0) {
-			std::cerr << "Error creating directory.\n";
-			std::exit(1);
-		}
+	if (documents.size() != num_docs) {
+		std::cerr << "Error: Expected " << num_docs << " documents, got " << documents.size() << std::endl;
+		std::exit(1);
 	}
+	std::unique_lock<std::shared_mutex> lock(index_mutex);
 
-	// Join paths
-	std::string METADATA_PATH = db_dir + "/metadata.bin";
+	free_doc_stores();
+	columns = column_names;
+	doc_store_cols.clear();
+	for (uint16_t col_idx = 0; col_idx < columns.size(); ++col_idx) {
+		doc_store_cols.push_back(col_idx);
+	}
+	doc_stores.resize(num_partitions, NULL);
 
 	std::vector<std::thread> threads;
 	for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
-		threads.push_back(std::thread(&_BM25::save_index_partition, this, db_dir, partition_id));
+		threads.push_back(std::thread([this, &documents, partition_id] {
+			DocStore* store = new DocStore(columns.size());
+			for (
+					uint64_t idx = partition_boundaries[partition_id]; 
+					idx < partition_boundaries[partition_id + 1]; 
+					++idx
+					) {
+				store->add(documents[idx]);
+			}
+			store->finish();
+			doc_stores[partition_id] = store;
+		}));
 	}
 
 	for (auto& thread : threads) {
 		thread.join();
 	}
+	invalidate_query_cache();
+}
+
+void _BM25::free_doc_stores() {
+	for (DocStore* store : doc_stores) {
+		delete store;
+	}
+	doc_stores.clear();
+	doc_store_cols.clear();
+}
 
-	// Save partition boundaries
-	std::string PARTITION_BOUNDARY_PATH = db_dir + "/partition_boundaries.bin";
-	serialize_vector_u64(partition_boundaries, PARTITION_BOUNDARY_PATH);
+DocStoreStats _BM25::get_doc_store_stats() {
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
 
-	// Serialize smaller members.
-	std::ofstream out_file(METADATA_PATH, std::ios::binary);
-	if (!out_file) {
-		std::cerr << "Error opening file for writing.\n";
-		return;
+	DocStoreStats stats;
+	memset(&stats, 0, sizeof(stats));
+
+	for (DocStore* store : doc_stores) {
+		DocStoreStats partition_stats = store->get_stats();
+		stats.num_docs     += partition_stats.num_docs;
+		stats.num_blocks   += partition_stats.num_blocks;
+		stats.raw_bytes    += partition_stats.raw_bytes;
+		stats.stored_bytes += partition_stats.stored_bytes;
+		stats.cache_hits   += partition_stats.cache_hits;
+		stats.cache_misses += partition_stats.cache_misses;
+		stats.compressed    = partition_stats.compressed;
 	}
+	return stats;
+}
 
-	// Write basic types directly
-	out_file.write(reinterpret_cast<const char*>(&num_docs), sizeof(num_docs));
-	out_file.write(reinterpret_cast<const char*>(&bloom_df_threshold), sizeof(bloom_df_threshold));
-	out_file.write(reinterpret_cast<const char*>(&bloom_fpr), sizeof(bloom_fpr));
-	out_file.write(reinterpret_cast<const char*>(&k1), sizeof(k1));
-	out_file.write(reinterpret_cast<const char*>(&b), sizeof(b));
-	out_file.write(reinterpret_cast<const char*>(&num_partitions), sizeof(num_partitions));
 
-	// Write std::string
-	size_t filename_length = filename.size();
-	out_file.write(reinterpret_cast<const char*>(&filename_length), sizeof(filename_length));
-	out_file.write(filename.data(), filename_length);
+void _BM25::save_index_partition(IndexFileWriter& writer, uint16_t partition_id) {
+	BM25PartitionNew* IP = &index_partitions[partition_id];
 
-	// Write enum as int
-	int file_type_int = static_cast<int>(file_type);
-	out_file.write(reinterpret_cast<const char*>(&file_type_int), sizeof(file_type_int));
+	writer.write_u64(IP->num_docs);
 
-	// Write std::vector<std::string>
-	size_t columns_size = columns.size();
-	out_file.write(reinterpret_cast<const char*>(&columns_size), sizeof(columns_size));
-	for (const auto& col : columns) {
-		size_t col_length = col.size();
-		out_file.write(reinterpret_cast<const char*>(&col_length), sizeof(col_length));
-		out_file.write(col.data(), col_length);
+	// In-memory partitions have no source lines.
+	if (file_type == IN_MEMORY || IP->line_offsets == NULL) {
+		writer.write_array(NULL, 0);
 	}
-
-	// Write search_cols std::vector<std::string>
-	columns_size = search_cols.size();
-	out_file.write(reinterpret_cast<const char*>(&columns_size), sizeof(columns_size));
-	for (const auto& search_col : search_cols) {
-		size_t search_col_length = search_col.size();
-		out_file.write(reinterpret_cast<const char*>(&search_col_length), sizeof(search_col_length));
-		out_file.write(search_col.data(), search_col_length);
+	else {
+		writer.write_array(IP->line_offsets, IP->num_docs * sizeof(uint64_t));
 	}
 
-	for (const auto& search_col_idx : search_col_idxs) {
-		out_file.write(reinterpret_cast<const char*>(&search_col_idx), sizeof(search_col_idx));
+	if (IP->deleted_docs == NULL) {
+		writer.write_array(NULL, 0);
+	}
+	else {
+		writer.write_array(IP->deleted_docs, deleted_docs_words(IP->num_docs) * sizeof(uint64_t));
 	}
 
-	out_file.write(reinterpret_cast<const char*>(&header_bytes), sizeof(header_bytes));
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		InvertedIndexNew* II = &IP->II[col_idx];
+
+		uint64_t num_postings = 0;
+		for (uint32_t term_idx = 0; term_idx < II->num_terms; ++term_idx) {
+			num_postings += II->doc_freqs[term_idx];
+		}
 
-	out_file.close();
+		writer.write_u32(II->num_terms);
+		writer.write_u32(II->num_docs);
+		writer.write_float(II->avg_doc_size);
+		writer.write_array(II->doc_ids,      num_postings * sizeof(tf_df_t));
+		writer.write_array(II->doc_sizes,    II->num_docs * sizeof(uint16_t));
+		writer.write_array(II->term_offsets, II->num_terms * sizeof(uint32_t));
+		writer.write_array(II->doc_freqs,    II->num_terms * sizeof(uint32_t));
+
+		// A loaded partition already has a frozen vocab. Write it back as is.
+		if (IP->frozen_vocabs != NULL) {
+			const FrozenVocab& vocab = IP->frozen_vocabs[col_idx];
+			writer.write_u64(vocab.num_slots);
+			writer.write_array(vocab.slots, vocab.num_slots * sizeof(uint64_t));
+			writer.write_array(vocab.term_offsets, (vocab.num_terms + 1) * sizeof(uint64_t));
+			writer.write_array(vocab.strings, vocab.term_offsets[vocab.num_terms]);
+			continue;
+		}
 
-	auto end = std::chrono::high_resolution_clock::now();
-	std::chrono::duration<double> elapsed_seconds = end - start;
+		std::vector<std::string> terms;
+		get_vocab_terms(IP, col_idx, terms);
 
-	if (DEBUG) {
-		std::cout << "Saved in " << elapsed_seconds.count() << "s" << std::endl;
+		std::vector<uint64_t> slots;
+		std::vector<uint64_t> term_offsets;
+		std::string strings;
+		build_frozen_vocab(terms, slots, term_offsets, strings);
+
+		writer.write_u64(slots.size());
+		writer.write_array(slots.data(), slots.size() * sizeof(uint64_t));
+		writer.write_array(term_offsets.data(), term_offsets.size() * sizeof(uint64_t));
+		writer.write_array(strings.data(), strings.size());
 	}
 }
 
-void _BM25::load_from_disk(const std::string& db_dir) {
-	auto start = std::chrono::high_resolution_clock::now();
+void _BM25::load_index_partition(
+		IndexFileReader& reader,
+		uint16_t partition_id,
+		std::vector<std::pair<const void*, uint64_t>>* resident_arrays
+		) {
+	BM25PartitionNew* IP = &index_partitions[partition_id];
 
-	// Join paths
-	std::string UNIQUE_TERM_MAPPING_PATH = db_dir + "/unique_term_mapping.bin";
-	std::string INVERTED_INDEX_PATH 	 = db_dir + "/inverted_index.bin";
-	std::string LINE_OFFSETS_PATH 		 = db_dir + "/line_offsets.bin";
-	std::string METADATA_PATH 			 = db_dir + "/metadata.bin";
-	std::string PARTITION_BOUNDARY_PATH  = db_dir + "/partition_boundaries.bin";
-
-	// Load smaller members.
-	std::ifstream in_file(METADATA_PATH, std::ios::binary);
-    if (!in_file) {
-        std::cerr << "Error opening file for reading.\n";
-        return;
-    }
+	// Every array but the postings, to keep resident when they stay on disk.
+	auto read_resident_array = [&]() {
+		uint64_t size;
+		const void* array = reader.read_array(&size);
+		if (resident_arrays != NULL) resident_arrays->emplace_back(array, size);
+		return array;
+	};
+
+	uint64_t partition_num_docs = reader.read_u64();
+	init_bm25_partition_new(IP, 0, search_cols.size(), numa_node_for_partition(partition_id));
+	IP->num_docs = partition_num_docs;
+
+	// Every array points into the mapped file. Nothing is copied.
+	IP->line_offsets  = (uint64_t*)read_resident_array();
+	IP->frozen_vocabs = new FrozenVocab[search_cols.size()];
+
+	// Copied out of the mapping so later deletes can set bits.
+	uint64_t deleted_size;
+	const uint64_t* deleted_docs = (const uint64_t*)reader.read_array(&deleted_size);
+	if (deleted_size > 0) {
+		IP->deleted_docs = (uint64_t*)malloc(deleted_size);
+		memcpy(IP->deleted_docs, deleted_docs, deleted_size);
+		for (uint64_t idx = 0; idx < deleted_size / sizeof(uint64_t); ++idx) {
+			IP->num_deleted += __builtin_popcountll(deleted_docs[idx]);
+		}
+	}
 
-    // Read basic types directly.
-    in_file.read(reinterpret_cast<char*>(&num_docs), sizeof(num_docs));
-    in_file.read(reinterpret_cast<char*>(&bloom_df_threshold), sizeof(bloom_df_threshold));
-    in_file.read(reinterpret_cast<char*>(&bloom_fpr), sizeof(bloom_fpr));
-    in_file.read(reinterpret_cast<char*>(&k1), sizeof(k1));
-    in_file.read(reinterpret_cast<char*>(&b), sizeof(b));
-	in_file.read(reinterpret_cast<char*>(&num_partitions), sizeof(num_partitions));
-
-	// Read and prep file data.
-    size_t filename_length;
-    in_file.read(reinterpret_cast<char*>(&filename_length), sizeof(filename_length));
-    filename.resize(filename_length);
-    in_file.read(&filename[0], filename_length);
-
-	// read fn_file contents into filename 
-	FILE* f = fopen(filename.c_str(), "r");
-	if (f == nullptr) {
-		printf("Error opening file: %s\n", filename.c_str());
-		exit(1);
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		InvertedIndexNew* II = &IP->II[col_idx];
+		init_inverted_index_new(II);
+
+		II->num_terms    = reader.read_u32();
+		II->num_docs     = reader.read_u32();
+		II->avg_doc_size = reader.read_float();
+		II->doc_ids      = (tf_df_t*)reader.read_array();
+		II->doc_sizes    = (uint16_t*)read_resident_array();
+		II->term_offsets = (uint32_t*)read_resident_array();
+		II->doc_freqs    = (uint32_t*)read_resident_array();
+
+		FrozenVocab& vocab = IP->frozen_vocabs[col_idx];
+		vocab.num_terms    = II->num_terms;
+		vocab.num_slots    = reader.read_u64();
+		vocab.slots        = (const uint64_t*)read_resident_array();
+		vocab.term_offsets = (const uint64_t*)read_resident_array();
+		vocab.strings      = (const char*)read_resident_array();
 	}
-	char buf[1024];
-	char* res = fgets(buf, 1024, f);
-	if (res == nullptr) {
-		printf("Error reading file: %s\n", filename.c_str());
-		exit(1);
+}
+
+void _BM25::save_index_header(IndexFileWriter& writer) {
+	writer.write_u64(num_docs);
+	writer.write_float(bloom_df_threshold);
+	writer.write_double(bloom_fpr);
+	writer.write_float(k1);
+	writer.write_float(b);
+	writer.write_u16(num_partitions);
+	writer.write_u32((uint32_t)file_type);
+	writer.write_u16(header_bytes);
+	writer.write_string(filename);
+	writer.write_u64(source_size);
+	writer.write_string(user_metadata);
+
+	writer.write_u64(columns.size());
+	for (const std::string& col : columns) {
+		writer.write_string(col);
 	}
-	fclose(f);
 
-	if (filename == "in_memory") {
-		file_type = IN_MEMORY;
-	} else if (filename.find(".json") != std::string::npos) {
-		file_type = JSON;
-	} else if (filename.find(".csv") != std::string::npos) {
-		file_type = CSV;
-	} else {
-		std::cerr << "Error: file type not supported" << std::endl;
-		exit(1);
+	writer.write_u64(search_cols.size());
+	for (const std::string& search_col : search_cols) {
+		writer.write_string(search_col);
 	}
 
-	if (file_type == IN_MEMORY) {
-		return;
+	writer.write_u64(search_col_idxs.size());
+	for (const int16_t& search_col_idx : search_col_idxs) {
+		writer.write_u16((uint16_t)search_col_idx);
 	}
 
-	// Open the reference file
-	for (uint16_t i = 0; i < num_partitions; i++) {
-		FILE* ref_f = fopen(filename.c_str(), "r");
-		if (ref_f == nullptr) {
-			printf("Error opening file: %s\n", filename.c_str());
-			printf("Partition id: %d\n", i);
-			exit(1);
+	writer.write_u64(partition_boundaries.size());
+	for (const uint64_t& boundary : partition_boundaries) {
+		writer.write_u64(boundary);
+	}
+
+	writer.write_u64(stop_words.size());
+	for (const std::string& stop_word : stop_words) {
+		writer.write_string(stop_word);
+	}
+}
+
+void _BM25::save_doc_stores(IndexFileWriter& writer) {
+	writer.write_u64(doc_store_cols.size());
+	for (const uint16_t& col_idx : doc_store_cols) {
+		writer.write_u16(col_idx);
+	}
+	writer.write_u8(!doc_stores.empty());
+	for (DocStore* store : doc_stores) {
+		store->save(writer);
+	}
+}
+
+void _BM25::save_to_disk(const std::string& path) {
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	IndexFileWriter writer(path);
+
+	save_index_header(writer);
+	for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+		save_index_partition(writer, partition_id);
+	}
+	save_doc_stores(writer);
+
+	writer.finish();
+
+	auto end = std::chrono::high_resolution_clock::now();
+	std::chrono::duration<double> elapsed_seconds = end - start;
+
+	if (DEBUG) {
+		std::cout << "Saved in " << elapsed_seconds.count() << "s" << std::endl;
+	}
+}
+
+// Faults in arrays of the index mapping, and with WARMUP_LOCK keeps them in.
+static void warm_up_index_arrays(const std::vector<std::pair<const void*, uint64_t>>& arrays, IndexWarmup warmup) {
+	// Arrays are page aligned in the file, and so in the mapping.
+	for (const auto& [array, size] : arrays) {
+		if (size > 0) madvise((void*)array, size, MADV_WILLNEED);
+	}
+
+	bool lock_failed = false;
+	for (const auto& [array, size] : arrays) {
+		if (size == 0) continue;
+
+		if (warmup == WARMUP_LOCK) {
+			lock_failed |= (mlock(array, size) != 0);
+			continue;
+		}
+		for (uint64_t offset = 0; offset < size; offset += INDEX_FILE_ALIGNMENT) {
+			(void)((volatile const char*)array)[offset];
 		}
-		reference_file_handles.push_back(ref_f);
 	}
 
-	// Load partition boundaries
-	deserialize_vector_u64(partition_boundaries, PARTITION_BOUNDARY_PATH);
+	if (lock_failed) {
+		std::cerr << "Could not lock the index in memory (" << strerror(errno)
+				  << "). Raise RLIMIT_MEMLOCK to keep it resident." << std::endl;
+	}
+}
 
-	index_partitions.clear();
-	index_partitions.resize(num_partitions);
+void _BM25::load_from_disk(const std::string& path, IndexWarmup warmup, uint64_t postings_cache_bytes) {
+	auto start = std::chrono::high_resolution_clock::now();
 
-    // Read enum as int
-    int file_type_int;
-    in_file.read(reinterpret_cast<char*>(&file_type_int), sizeof(file_type_int));
-    file_type = static_cast<SupportedFileTypes>(file_type_int);
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1) {
+		std::cerr << "Error opening index file: " << path << std::endl;
+		std::exit(1);
+	}
 
-    // Read std::vector<std::string>
-    size_t columns_size;
-    in_file.read(reinterpret_cast<char*>(&columns_size), sizeof(columns_size));
-    columns.resize(columns_size);
-    for (auto& col : columns) {
-        size_t col_length;
-        in_file.read(reinterpret_cast<char*>(&col_length), sizeof(col_length));
-        col.resize(col_length);
-        in_file.read(&col[0], col_length);
-    }
+	struct stat sb;
+	if (fstat(fd, &sb) == -1) {
+		std::cerr << "Error getting index file size." << std::endl;
+		std::exit(1);
+	}
+	index_size = sb.st_size;
+
+	// Pages fault in on first use unless warmed up. Shared and read only, so
+	// every process loading the same file uses the same page cache pages.
+	// Anything mutable (query cache, document store block cache) lives on the
+	// process heap.
+	// Mapped at a huge page boundary. Arrays in the file are page aligned, so
+	// where the filesystem caches files in huge pages, large postings arrays
+	// are backed by them as well.
+	// With a postings cache only the rest of the index is made resident, the
+	// vocab and per-term arrays, doc sizes and line offsets. Postings are read
+	// block by block as queries need them, so memory stays at that plus the
+	// cache however large the postings are.
+	int flags = MAP_SHARED;
+	if (warmup != WARMUP_NONE && postings_cache_bytes == 0) flags |= MAP_POPULATE;
+
+	index_data = map_huge_page_aligned(index_size, PROT_READ, flags, fd);
+	close(fd);
+	if (index_data == NULL) {
+		std::cerr << "Error mapping index file to memory." << std::endl;
+		std::exit(1);
+	}
 
-    // Read search_cols std::vector<std::string>
-	in_file.read(reinterpret_cast<char*>(&columns_size), sizeof(columns_size));
-	search_cols.resize(columns_size);
-	for (auto& search_col : search_cols) {
-		size_t search_col_length;
-		in_file.read(reinterpret_cast<char*>(&search_col_length), sizeof(search_col_length));
-		search_col.resize(search_col_length);
-		in_file.read(&search_col[0], search_col_length);
+#ifdef MADV_HUGEPAGE
+	// A huge page would pull postings in around the arrays kept resident.
+	if (get_huge_page_mode() != HUGE_PAGES_OFF && postings_cache_bytes == 0) {
+		madvise(index_data, index_size, MADV_HUGEPAGE);
 	}
+#endif
 
-	search_col_idxs.resize(search_cols.size());
-	for (auto& search_col_idx : search_col_idxs) {
-		in_file.read(reinterpret_cast<char*>(&search_col_idx), sizeof(search_col_idx));
+	if (warmup == WARMUP_LOCK && postings_cache_bytes == 0 && mlock(index_data, index_size) != 0) {
+		std::cerr << "Could not lock the index in memory (" << strerror(errno)
+				  << "). Raise RLIMIT_MEMLOCK to keep it resident." << std::endl;
 	}
 
-	in_file.read(reinterpret_cast<char*>(&header_bytes), sizeof(header_bytes));
+	IndexFileReader reader(index_data, index_size);
 
-    in_file.close();
+	num_docs           = reader.read_u64();
+	bloom_df_threshold = reader.read_float();
+	bloom_fpr          = reader.read_double();
+	k1                 = reader.read_float();
+	b                  = reader.read_float();
+	num_partitions     = reader.read_u16();
+	file_type          = (SupportedFileTypes)reader.read_u32();
+	header_bytes       = reader.read_u16();
+	filename           = reader.read_string();
+	uint64_t _source_size = reader.read_u64();
+	user_metadata      = reader.read_string();
 
-	std::vector<std::thread> threads;
+	columns.resize(reader.read_u64());
+	for (std::string& col : columns) {
+		col = reader.read_string();
+	}
+
+	search_cols.resize(reader.read_u64());
+	for (std::string& search_col : search_cols) {
+		search_col = reader.read_string();
+	}
+
+	search_col_idxs.resize(reader.read_u64());
+	for (int16_t& search_col_idx : search_col_idxs) {
+		search_col_idx = (int16_t)reader.read_u16();
+	}
+
+	partition_boundaries.resize(reader.read_u64());
+	for (uint64_t& boundary : partition_boundaries) {
+		boundary = reader.read_u64();
+	}
+
+	uint64_t num_stop_words = reader.read_u64();
+	for (uint64_t idx = 0; idx < num_stop_words; ++idx) {
+		stop_words.insert(reader.read_string());
+	}
 
+	std::vector<std::pair<const void*, uint64_t>> resident_arrays;
+	index_partitions = (BM25PartitionNew*)malloc(num_partitions * sizeof(BM25PartitionNew));
 	for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
-		threads.push_back(std::thread(&_BM25::load_index_partition, this, db_dir, partition_id));
+		load_index_partition(reader, partition_id, (postings_cache_bytes > 0) ? &resident_arrays : NULL);
 	}
+	update_avg_doc_sizes();
 
-	for (auto& thread : threads) {
-		thread.join();
+	if (postings_cache_bytes > 0) {
+		postings_cache = new BlockCache(path, postings_cache_bytes);
+		warm_up_index_arrays(resident_arrays, warmup);
+	}
+
+	doc_store_cols.resize(reader.read_u64());
+	for (uint16_t& col_idx : doc_store_cols) {
+		col_idx = reader.read_u16();
+	}
+	if (reader.read_u8()) {
+		for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+			doc_stores.push_back(new DocStore(reader));
+		}
+	}
+
+	// The source file is optional once loaded. Without it rows come from the
+	// document store, or can't be fetched at all.
+	// A csv that only grew had rows appended. Indexed rows didn't move and
+	// the new ones can be indexed with append.
+	struct stat source_sb;
+	bool has_source = (file_type != IN_MEMORY && stat(filename.c_str(), &source_sb) == 0);
+	bool appended   = (has_source && file_type == CSV && (uint64_t)source_sb.st_size > _source_size);
+	if (has_source && (uint64_t)source_sb.st_size != _source_size && !appended) {
+		std::cerr << "Warning: " << filename << " changed since the index was saved. ";
+		std::cerr << "Rows will not be fetched from it." << std::endl;
+		has_source = false;
+	}
+
+	if (has_source) {
+		for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+			FILE* f = fopen(filename.c_str(), "r");
+			if (f == NULL) {
+				std::cerr << "Unable to open file: " << filename << std::endl;
+				std::exit(1);
+			}
+			reference_file_handles.push_back(f);
+		}
+		map_source_file();
 	}
 
 	auto end = std::chrono::high_resolution_clock::now();
 	std::chrono::duration<double> elapsed_seconds = end - start;
 
-	printf("Loaded in %fs\n", elapsed_seconds.count()); fflush(stdout);
+	if (DEBUG) {
+		std::cout << "Loaded in " << elapsed_seconds.count() << "s" << std::endl;
+	}
+}
+
+static void print_memory_usage(const MemoryUsage& usage) {
+	uint64_t vocab_size = 0;
+	uint64_t line_offsets_size = 0;
+	uint64_t inverted_index_size = 0;
+	for (const PartitionMemoryUsage& partition : usage.partitions) {
+		line_offsets_size += partition.line_offsets;
+		for (const ColumnMemoryUsage& column : partition.columns) {
+			vocab_size += column.vocab_buckets + column.vocab_strings;
+			inverted_index_size += column.postings + column.doc_sizes + column.term_offsets + column.doc_freqs;
+		}
+	}
+
+	printf("Total size of vocab mappings:   %luMB\n", vocab_size / 1048576);
+	printf("Total size of line offsets:     %luMB\n", line_offsets_size / 1048576);
+	printf("Total size of inverted indexes: %luMB\n", inverted_index_size / 1048576);
+	printf("--------------------------------------\n");
+	printf("Total in-memory size:           %luMB\n\n", usage.total / 1048576);
+}
+
+// Run fn(task_idx) for every task_idx in [0, num_tasks) on up to num_threads threads.
+// Tasks are handed out dynamically so uneven task costs still balance across cores.
+template <typename F>
+static void parallel_for(size_t num_tasks, size_t num_threads, F fn) {
+	num_threads = max(1, min(num_threads, num_tasks));
+
+	std::atomic<size_t> next_task(0);
+	auto worker = [&next_task, num_tasks, &fn] {
+		size_t task_idx;
+		while ((task_idx = next_task.fetch_add(1, std::memory_order_relaxed)) < num_tasks) {
+			fn(task_idx);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < num_threads; ++i) {
+		threads.push_back(std::thread(worker));
+	}
+	worker();
+
+	for (auto& thread : threads) {
+		thread.join();
+	}
 }
-*/
 
 _BM25::_BM25(
 		std::string filename,
@@ -2984,7 +3472,8 @@ _BM25::_BM25(
 		float  k1,
 		float  b,
 		uint16_t num_partitions,
-		const std::vector<std::string>& _stop_words
+		const std::vector<std::string>& _stop_words,
+		uint16_t num_threads
 		) : bloom_df_threshold(bloom_df_threshold),
 			bloom_fpr(bloom_fpr),
 			k1(k1), 
@@ -3007,12 +3496,12 @@ _BM25::_BM25(
 		}
 		reference_file_handles.push_back(f);
 	}
+	map_source_file();
 
 	auto overall_start = std::chrono::high_resolution_clock::now();
 
-	std::vector<std::thread> threads;
-
-	// num_docs = 0;
+	// 0 reads every partition at once.
+	if (num_threads == 0) num_threads = num_partitions;
 
 	progress_bars.resize(num_partitions);
 
@@ -3024,15 +3513,11 @@ _BM25::_BM25(
 
 		init_terminal();
 
-		// Launch num_partitions threads to read csv file
-		for (uint16_t i = 0; i < num_partitions; ++i) {
-			threads.push_back(std::thread(
-				[this, i] {
-					read_csv_rfc_4180(partition_boundaries[i], partition_boundaries[i + 1], i);
-					// write_bloom_filters(i);
-				}
-			));
-		}
+		// Read the partitions on up to num_threads threads
+		parallel_for(num_partitions, num_threads, [this](size_t i) {
+			read_csv_rfc_4180(partition_boundaries[i], partition_boundaries[i + 1], i);
+			// write_bloom_filters(i);
+		});
 
 		file_type = CSV;
 	}
@@ -3042,15 +3527,11 @@ _BM25::_BM25(
 
 		init_terminal();
 
-		// Launch num_partitions threads to read json file
-		for (uint16_t i = 0; i < num_partitions; ++i) {
-			threads.push_back(std::thread(
-				[this, i] {
-					read_json(partition_boundaries[i], partition_boundaries[i + 1], i);
-					// write_bloom_filters(i);
-				}
-			));
-		}
+		// Read the partitions on up to num_threads threads
+		parallel_for(num_partitions, num_threads, [this](size_t i) {
+			read_json(partition_boundaries[i], partition_boundaries[i + 1], i);
+			// write_bloom_filters(i);
+		});
 		file_type = JSON;
 	}
 	else {
@@ -3058,53 +3539,463 @@ _BM25::_BM25(
 		std::exit(1);
 	}
 
-
-	for (auto& thread : threads) {
-		thread.join();
-	}
-
 	num_docs = 0;
 	for (size_t i = 0; i < num_partitions; ++i) {
 		num_docs += index_partitions[i].num_docs;
 	}
+	update_avg_doc_sizes();
 
 	if (!DEBUG) finalize_progress_bar();
 
-	uint64_t total_size = 0;
-	uint32_t unique_terms_found = 0;
+	uint64_t unique_terms_found = 0;
 	for (size_t i = 0; i < num_partitions; ++i) {
-		BM25PartitionNew* IP = &index_partitions[i];
-
-		uint64_t part_size = 0;
 		for (size_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-			unique_terms_found += IP->unique_term_mappings[col_idx].size();
-			total_size += calc_inverted_index_size(&IP->II[col_idx]);
+			unique_terms_found += index_partitions[i].II[col_idx].num_terms;
+		}
+	}
+	print_memory_usage(memory_usage());
+
+	printf("Total number of documents:      %lu\n", num_docs);
+	printf("Total number of unique terms:   %lu\n", unique_terms_found);
+
+	auto read_end = std::chrono::high_resolution_clock::now();
+	std::chrono::duration<double> read_elapsed_seconds = read_end - overall_start;
+
+	printf("Read file in %fs\n", read_elapsed_seconds.count());
+	printf("KDocs/s: %lu\n", (uint64_t)(num_docs * 0.001f / read_elapsed_seconds.count()));
+}
+
+
+_BM25::_BM25(
+		std::string filename,
+		std::vector<std::string> search_cols,
+		float  bloom_df_threshold,
+		double bloom_fpr,
+		float  k1,
+		float  b,
+		uint16_t num_partitions,
+		const std::vector<std::string>& _stop_words,
+		const ExternalBuildConfig& config
+		) : bloom_df_threshold(bloom_df_threshold),
+			bloom_fpr(bloom_fpr),
+			k1(k1), 
+			b(b),
+			num_partitions(num_partitions),
+			search_cols(search_cols), 
+			filename(filename) {
+
+	if (filename.size() < 3 || filename.substr(filename.size() - 3, 3) != "csv") {
+		std::cerr << "Only csv files can be indexed out of core." << std::endl;
+		std::exit(1);
+	}
+
+	for (const std::string& stop_word : _stop_words) {
+		stop_words.insert(stop_word);
+	}
+
+	// Open file handles
+	for (uint16_t i = 0; i < num_partitions; ++i) {
+		FILE* f = fopen(filename.c_str(), "r");
+		if (f == NULL) {
+			std::cerr << "Unable to open file: " << filename << std::endl;
+			exit(1);
 		}
-		total_size += part_size;
+		reference_file_handles.push_back(f);
+	}
+	file_type     = CSV;
+	user_metadata = config.user_metadata;
+
+	auto overall_start = std::chrono::high_resolution_clock::now();
 
+	proccess_csv_header();
+	build_external(config);
+
+	// Every partition is in the index file now. Load it like any saved index.
+	for (FILE* f : reference_file_handles) {
+		fclose(f);
 	}
-	total_size /= 1024 * 1024;
-	uint64_t vocab_size = unique_terms_found * (4 + 32 + 5 + 1) / 1048576;
-	uint64_t line_offsets_size = num_docs * 8 / 1048576;
-	uint64_t inverted_index_size = total_size;
-	total_size = vocab_size + line_offsets_size + inverted_index_size;
+	reference_file_handles.clear();
+	free(index_partitions);
+	index_partitions = NULL;
 
-	printf("Total size of vocab mappings: ~%luMB\n", vocab_size);
-	printf("Total size of line offsets: %luMB\n", line_offsets_size);
-	printf("Total size of inverted indexes: %luMB\n", inverted_index_size);
-	printf("--------------------------------------\n");
-	printf("Approx total in-memory size:    %luMB\n\n", total_size);
+	load_from_disk(config.index_path);
+
+	uint64_t unique_terms_found = 0;
+	for (size_t i = 0; i < num_partitions; ++i) {
+		for (size_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+			unique_terms_found += index_partitions[i].II[col_idx].num_terms;
+		}
+	}
 
 	printf("Total number of documents:      %lu\n", num_docs);
-	printf("Total number of unique terms:   %u\n", unique_terms_found);
+	printf("Total number of unique terms:   %lu\n", unique_terms_found);
 
 	auto read_end = std::chrono::high_resolution_clock::now();
 	std::chrono::duration<double> read_elapsed_seconds = read_end - overall_start;
 
-	printf("Read file in %fs\n", read_elapsed_seconds.count());
+	printf("Built index out of core in %fs\n", read_elapsed_seconds.count());
 	printf("KDocs/s: %lu\n", (uint64_t)(num_docs * 0.001f / read_elapsed_seconds.count()));
 }
 
+void _BM25::build_external(const ExternalBuildConfig& config) {
+	std::string tmp_dir = config.tmp_dir;
+	if (tmp_dir.empty()) {
+		size_t slash = config.index_path.rfind('/');
+		tmp_dir = (slash == std::string::npos) ? "." : config.index_path.substr(0, slash);
+	}
+
+	int fd = fileno(reference_file_handles[0]);
+	struct stat sb;
+	if (fstat(fd, &sb) == -1) {
+		std::cerr << "Error getting file size." << std::endl;
+		std::exit(1);
+	}
+	source_size = sb.st_size;
+
+	// Count rows, keeping only the start of every EXTERNAL_BUILD_ROW_SAMPLE'th.
+	std::vector<uint64_t> sampled_rows;
+	uint64_t num_lines = 0;
+	{
+		CsvRowScanner scanner(fd, header_bytes, source_size);
+		uint64_t row_start = header_bytes;
+		do {
+			if (num_lines % EXTERNAL_BUILD_ROW_SAMPLE == 0) sampled_rows.push_back(row_start);
+			++num_lines;
+			row_start = scanner.next_row();
+		} while (row_start < source_size);
+	}
+
+	auto row_offset = [&](uint64_t row) {
+		uint64_t offset = sampled_rows[row / EXTERNAL_BUILD_ROW_SAMPLE];
+		CsvRowScanner scanner(fd, offset, source_size);
+		for (uint64_t idx = 0; idx < row % EXTERNAL_BUILD_ROW_SAMPLE; ++idx) {
+			offset = scanner.next_row();
+		}
+		return offset;
+	};
+
+	// Same split as determine_partition_boundaries_csv_rfc_4180.
+	uint64_t chunk_size       = num_lines / num_partitions;
+	uint64_t final_chunk_size = chunk_size + (num_lines % num_partitions);
+	if (chunk_size == 0) {
+		std::cerr << "Error: Fewer rows than partitions." << std::endl;
+		std::exit(1);
+	}
+	if (final_chunk_size >= (1ULL << 28)) {
+		std::cerr << "Error: A partition holds at most 2^28 rows. Use more partitions." << std::endl;
+		std::exit(1);
+	}
+
+	std::vector<ExternalPartition> partitions(num_partitions);
+	partition_boundaries.clear();
+	for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+		partition_boundaries.push_back(row_offset(partition_id * chunk_size));
+		partitions[partition_id].num_docs = (partition_id != num_partitions - 1) ? chunk_size : final_chunk_size;
+	}
+	partition_boundaries.push_back(source_size);
+
+	for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+		partitions[partition_id].start_byte = partition_boundaries[partition_id];
+		partitions[partition_id].end_byte   = partition_boundaries[partition_id + 1];
+	}
+	num_docs = num_lines;
+
+	uint16_t num_threads = (config.num_threads == 0) ? num_partitions : config.num_threads;
+	num_threads = min(num_threads, num_partitions);
+
+	uint64_t io_buffer_size = std::clamp(
+			config.memory_budget / 64,
+			(uint64_t)EXTERNAL_BUILD_MIN_IO_BUFFER,
+			(uint64_t)EXTERNAL_BUILD_IO_BUFFER_SIZE
+			);
+
+	// Held by a thread whatever its chunk size. Token stream buffers and the
+	// line buffer of read_csv_rfc_4180, the row scanner and scratch file buffers.
+	uint64_t fixed_bytes = search_cols.size() * TOKEN_STREAM_CAPACITY * (sizeof(uint32_t) + sizeof(uint8_t))
+						 + 1048576 + EXTERNAL_BUILD_IO_BUFFER_SIZE + 3 * io_buffer_size;
+	while (num_threads > 1 && config.memory_budget / num_threads < 2 * fixed_bytes) {
+		--num_threads;
+	}
+	if (config.memory_budget / num_threads < 2 * fixed_bytes) {
+		std::cerr << "Error: A memory budget of " << config.memory_budget / 1048576 << "MB is too small. ";
+		std::cerr << "Building needs at least " << 2 * fixed_bytes / 1048576 + 1 << "MB." << std::endl;
+		std::exit(1);
+	}
+
+	// Half of the rest for a chunk's index, half for the slack of growing it.
+	uint64_t chunk_budget = (config.memory_budget / num_threads - fixed_bytes) / 2;
+
+	index_partitions = (BM25PartitionNew*)malloc(num_partitions * sizeof(BM25PartitionNew));
+
+	bool _show_progress = show_progress;
+	show_progress = false;
+	parallel_for(num_partitions, num_threads, [&](size_t i) {
+		build_external_partition(&partitions[i], i, chunk_budget, io_buffer_size, tmp_dir);
+	});
+	show_progress = _show_progress;
+
+	// One partition at a time, since the index file is written front to back.
+	IndexFileWriter writer(config.index_path);
+	save_index_header(writer);
+	for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+		ExternalPartition* partition = &partitions[partition_id];
+		write_external_partition(writer, partition, config.memory_budget, io_buffer_size, tmp_dir);
+
+		delete partition->runs;
+		delete partition->doc_sizes;
+		delete partition->line_offsets;
+	}
+	save_doc_stores(writer);
+	writer.finish();
+}
+
+typedef struct {
+	uint64_t         hash;
+	std::string_view term;
+	uint32_t         term_id;
+} RunEntry;
+
+void _BM25::build_external_partition(
+		ExternalPartition* partition,
+		uint16_t partition_id,
+		uint64_t chunk_budget,
+		uint64_t io_buffer_size,
+		const std::string& tmp_dir
+		) {
+	partition->runs         = new ScratchFile(tmp_dir, io_buffer_size);
+	partition->doc_sizes    = new ScratchFile(tmp_dir, io_buffer_size);
+	partition->line_offsets = new ScratchFile(tmp_dir, io_buffer_size);
+	partition->doc_size_sums.assign(search_cols.size(), 0.0);
+
+	BM25PartitionNew* IP = &index_partitions[partition_id];
+	CsvRowScanner scanner(fileno(reference_file_handles[partition_id]), partition->start_byte, partition->end_byte);
+
+	// Row bytes per chunk. A guess at first, then sized from how many index
+	// bytes per row byte the last chunk took.
+	uint64_t max_chunk_bytes = max(chunk_budget / 8, 1);
+
+	std::vector<uint64_t> row_offsets;
+	std::vector<RunEntry> entries;
+
+	uint64_t row = 0;
+	uint64_t row_start = partition->start_byte;
+	while (row < partition->num_docs) {
+		uint64_t chunk_start = row_start;
+		row_offsets.clear();
+		do {
+			row_offsets.push_back(row_start);
+			++row;
+			row_start = (row < partition->num_docs) ? scanner.next_row() : partition->end_byte;
+		} while (row < partition->num_docs && row_start - chunk_start < max_chunk_bytes);
+
+		ExternalChunk chunk;
+		chunk.num_docs = row_offsets.size();
+		chunk.doc_base = row - chunk.num_docs;
+
+		// Built like a partition of its own, doc ids starting at 0.
+		init_bm25_partition_new(IP, chunk.num_docs, search_cols.size(), numa_node_for_partition(partition_id));
+		memcpy(IP->line_offsets, row_offsets.data(), chunk.num_docs * sizeof(uint64_t));
+		read_csv_rfc_4180(chunk_start, row_start, partition_id);
+
+		partition->line_offsets->write(row_offsets.data(), chunk.num_docs * sizeof(uint64_t));
+		uint64_t chunk_bytes = get_partition_memory_usage(IP, partition_id).total;
+
+		for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+			InvertedIndexNew* II = &IP->II[col_idx];
+
+			entries.clear();
+			for (const auto& [term, term_id] : IP->unique_term_mappings[col_idx]) {
+				entries.push_back({fnv1a_hash(term.data(), term.size()), term, term_id});
+			}
+			std::sort(entries.begin(), entries.end(), [](const RunEntry& a, const RunEntry& b) {
+				return (a.hash != b.hash) ? a.hash < b.hash : a.term < b.term;
+			});
+
+			chunk.run_offsets.push_back(partition->runs->size());
+			for (const RunEntry& entry : entries) {
+				write_run_term(
+						*partition->runs,
+						entry.term,
+						&II->doc_ids[II->term_offsets[entry.term_id]],
+						II->doc_freqs[entry.term_id]
+						);
+			}
+
+			chunk.doc_sizes_offsets.push_back(partition->doc_sizes->size());
+			partition->doc_sizes->write(II->doc_sizes, chunk.num_docs * sizeof(uint16_t));
+			for (uint64_t idx = 0; idx < chunk.num_docs; ++idx) {
+				partition->doc_size_sums[col_idx] += (double)II->doc_sizes[idx];
+			}
+		}
+		chunk.run_offsets.push_back(partition->runs->size());
+		chunk_bytes += entries.capacity() * sizeof(RunEntry);
+
+		free_bm25_partition_new(IP);
+		partition->chunks.push_back(chunk);
+
+		// The vocab grows slower than the rows, so this only overestimates.
+		double bytes_per_row_byte = (double)chunk_bytes / max(row_start - chunk_start, 1);
+		max_chunk_bytes = max((uint64_t)(chunk_budget / bytes_per_row_byte), 1);
+	}
+
+	partition->runs->finish();
+	partition->doc_sizes->finish();
+	partition->line_offsets->finish();
+}
+
+void _BM25::write_external_partition(
+		IndexFileWriter& writer,
+		ExternalPartition* partition,
+		uint64_t memory_budget,
+		uint64_t io_buffer_size,
+		const std::string& tmp_dir
+		) {
+	// Same layout as save_index_partition.
+	writer.write_u64(partition->num_docs);
+
+	writer.begin_array();
+	partition->line_offsets->copy_to(writer, 0, partition->line_offsets->size());
+	writer.end_array();
+
+	// Nothing deleted yet.
+	writer.write_array(NULL, 0);
+
+	auto write_scratch_array = [&writer](ScratchFile& file) {
+		writer.begin_array();
+		file.copy_to(writer, 0, file.size());
+		writer.end_array();
+	};
+
+	const std::vector<ExternalChunk>& chunks = partition->chunks;
+	uint64_t reader_buffer_size = std::clamp(
+			memory_budget / (4 * chunks.size()),
+			(uint64_t)EXTERNAL_BUILD_MIN_IO_BUFFER,
+			(uint64_t)EXTERNAL_BUILD_IO_BUFFER_SIZE
+			);
+	std::vector<tf_df_t> postings(EXTERNAL_BUILD_IO_BUFFER_SIZE / sizeof(tf_df_t));
+
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		uint64_t num_terms_position = writer.reserve_u32();
+		writer.write_u32(partition->num_docs);
+		writer.write_float((float)(partition->doc_size_sums[col_idx] / partition->num_docs));
+
+		// Term arrays and the vocab come after the postings in the file. They
+		// are collected here while the postings are merged.
+		ScratchFile term_offsets(tmp_dir, io_buffer_size);
+		ScratchFile doc_freqs(tmp_dir, io_buffer_size);
+		ScratchFile hashes(tmp_dir, io_buffer_size);
+		ScratchFile vocab_offsets(tmp_dir, io_buffer_size);
+		ScratchFile strings(tmp_dir, io_buffer_size);
+
+		std::vector<RunReader*> readers;
+		for (const ExternalChunk& chunk : chunks) {
+			readers.push_back(new RunReader(
+						partition->runs,
+						chunk.run_offsets[col_idx],
+						chunk.run_offsets[col_idx + 1],
+						reader_buffer_size
+						));
+		}
+
+		// Min heap of runs by (hash, term, chunk). A term's postings come
+		// chunk by chunk, so in doc id order.
+		auto greater = [&readers](size_t a, size_t b) {
+			const RunReader* run_a = readers[a];
+			const RunReader* run_b = readers[b];
+			if (run_a->get_hash() != run_b->get_hash()) return run_a->get_hash() > run_b->get_hash();
+
+			int cmp = run_a->get_term().compare(run_b->get_term());
+			return (cmp != 0) ? cmp > 0 : a > b;
+		};
+		std::vector<size_t> heap;
+		for (size_t idx = 0; idx < readers.size(); ++idx) {
+			if (!readers[idx]->next_term()) continue;
+			heap.push_back(idx);
+			std::push_heap(heap.begin(), heap.end(), greater);
+		}
+
+		uint64_t num_postings = 0;
+		uint64_t num_terms    = 0;
+		uint64_t strings_size = 0;
+		std::vector<size_t> term_runs;
+
+		writer.begin_array();
+		while (!heap.empty()) {
+			term_runs.clear();
+			do {
+				std::pop_heap(heap.begin(), heap.end(), greater);
+				term_runs.push_back(heap.back());
+				heap.pop_back();
+			} while (
+					!heap.empty() &&
+					readers[heap.front()]->get_hash() == readers[term_runs[0]]->get_hash() &&
+					readers[heap.front()]->get_term() == readers[term_runs[0]]->get_term()
+					);
+
+			uint32_t doc_freq = 0;
+			for (size_t idx : term_runs) {
+				uint32_t n;
+				while ((n = readers[idx]->read_postings(postings.data(), postings.size())) > 0) {
+					for (uint32_t i = 0; i < n; ++i) {
+						postings[i].doc_id += chunks[idx].doc_base;
+					}
+					writer.append_array(postings.data(), n * sizeof(tf_df_t));
+					doc_freq += n;
+				}
+			}
+
+			if (num_postings + doc_freq > UINT32_MAX) {
+				std::cerr << "Error: More than 2^32 postings in a column of a partition. ";
+				std::cerr << "Use more partitions." << std::endl;
+				std::exit(1);
+			}
+
+			const std::string& term = readers[term_runs[0]]->get_term();
+			uint32_t term_offset = num_postings;
+			uint64_t hash = readers[term_runs[0]]->get_hash();
+			term_offsets.write(&term_offset, sizeof(uint32_t));
+			doc_freqs.write(&doc_freq, sizeof(uint32_t));
+			hashes.write(&hash, sizeof(uint64_t));
+			vocab_offsets.write(&strings_size, sizeof(uint64_t));
+			strings.write(term.data(), term.size());
+
+			strings_size += term.size();
+			num_postings += doc_freq;
+			++num_terms;
+
+			for (size_t idx : term_runs) {
+				if (!readers[idx]->next_term()) continue;
+				heap.push_back(idx);
+				std::push_heap(heap.begin(), heap.end(), greater);
+			}
+		}
+		writer.end_array();
+		vocab_offsets.write(&strings_size, sizeof(uint64_t));
+
+		for (RunReader* reader : readers) {
+			delete reader;
+		}
+		writer.patch_u32(num_terms_position, num_terms);
+
+		writer.begin_array();
+		for (const ExternalChunk& chunk : chunks) {
+			partition->doc_sizes->copy_to(writer, chunk.doc_sizes_offsets[col_idx], chunk.num_docs * sizeof(uint16_t));
+		}
+		writer.end_array();
+
+		write_scratch_array(term_offsets);
+		write_scratch_array(doc_freqs);
+
+		writer.write_u64(frozen_vocab_num_slots(num_terms));
+		writer.begin_array();
+		write_frozen_vocab_slots(hashes, num_terms, writer, tmp_dir, memory_budget / 4);
+		writer.end_array();
+
+		write_scratch_array(vocab_offsets);
+		write_scratch_array(strings);
+	}
+}
+
 
 _BM25::_BM25(
 		std::vector<std::vector<std::string>>& documents,
@@ -3143,7 +4034,8 @@ _BM25::_BM25(
 		init_bm25_partition_new(
 				&index_partitions[i],
 				num_docs / num_partitions,
-				search_cols.size()
+				search_cols.size(),
+				numa_node_for_partition(i)
 				);
 	}
 	partition_boundaries[num_partitions] = num_docs;
@@ -3181,41 +4073,17 @@ _BM25::_BM25(
 	for (auto& thread : threads) {
 		thread.join();
 	}
+	update_avg_doc_sizes();
 
 	if (!DEBUG) finalize_progress_bar();
 
-	uint64_t total_size = 0;
-	uint32_t unique_terms_found = 0;
-	/*
+	uint64_t unique_terms_found = 0;
 	for (uint16_t i = 0; i < num_partitions; ++i) {
-		BM25Partition& IP = index_partitions[i];
-
-		uint64_t part_size = 0;
 		for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-			for (const auto& row : IP.II[col_idx].inverted_index_compressed) {
-				part_size += sizeof(uint8_t) * row.doc_ids.size();
-				part_size += sizeof(RLEElement_u8) * row.term_freqs.size();
-			}
-			unique_terms_found += IP.unique_term_mapping[col_idx].size();
+			unique_terms_found += index_partitions[i].II[col_idx].num_terms;
 		}
-		total_size += part_size;
-
 	}
-	total_size /= 1024 * 1024;
-	*/
-
-	uint64_t vocab_size = unique_terms_found * (4 + 5 + 1) / 1048576;
-	uint64_t line_offsets_size = num_docs * 8 / 1048576;
-	uint64_t doc_sizes_size = num_docs * 2 * search_cols.size() / 1048576;
-	uint64_t inverted_index_size = total_size;
-	total_size = vocab_size + line_offsets_size + doc_sizes_size + inverted_index_size;
-
-	std::cout << "Total size of vocab mappings:  ~" << vocab_size << "MB" << std::endl;
-	std::cout << "Total size of line offsets:     " << line_offsets_size << "MB" << std::endl;
-	std::cout << "Total size of doc sizes:        " << doc_sizes_size << "MB" << std::endl;
-	std::cout << "Total size of inverted indexes: " << inverted_index_size << "MB" << std::endl;
-	std::cout << "--------------------------------------" << std::endl;
-	std::cout << "Approx total in-memory size:    " << total_size << "MB" << std::endl << std::endl;
+	print_memory_usage(memory_usage());
 
 	std::cout << "Total number of documents:      " << num_docs << std::endl;
 	std::cout << "Total number of unique terms:   " << unique_terms_found << std::endl;
@@ -3227,264 +4095,1139 @@ _BM25::_BM25(
 	printf("KDocs/s: %lu\n", (uint64_t)(num_docs * 0.001f / read_elapsed_seconds.count()));
 }
 
-inline float _BM25::_compute_bm25(
-		uint64_t doc_id,
-		float tf,
-		float idf,
-		uint16_t col_idx,
-		uint16_t partition_id
-		) {
-	BM25PartitionNew IP = index_partitions[partition_id];
+void _BM25::update_avg_doc_sizes() {
+	// Weighted by partition size so a small appended segment doesn't skew it.
+	avg_doc_sizes.assign(search_cols.size(), 0.0f);
+	if (num_docs == 0) return;
 
-	float weigted_doc_size = IP.II[col_idx].doc_sizes[doc_id] / IP.II[col_idx].avg_doc_size;
-	return idf * tf / (tf + k1 * (1 - b + b * weigted_doc_size));
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		double total_doc_size = 0.0;
+		for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+			const InvertedIndexNew* II = &index_partitions[partition_id].II[col_idx];
+			total_doc_size += (double)II->avg_doc_size * II->num_docs;
+		}
+		avg_doc_sizes[col_idx] = (float)(total_doc_size / num_docs);
+	}
 }
 
-void _BM25::add_query_term(
-		std::string& substr,
-		std::vector<std::vector<uint64_t>>& term_idxs,
-		uint16_t partition_id
-		) {
-	BM25PartitionNew* IP = &index_partitions[partition_id];
+uint64_t _BM25::append(uint64_t start_byte, const std::vector<uint64_t>& deleted_doc_ids) {
+	if (file_type != CSV) {
+		throw std::invalid_argument("Append is only supported for csv files.");
+	}
+	std::lock_guard<std::mutex> append_lock(append_mutex);
 
-	for (size_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-		MAP<std::string, uint32_t>& vocab = IP->unique_term_mappings[col_idx];
+	uint64_t indexed_bytes = get_indexed_bytes();
+	if (start_byte != indexed_bytes) {
+		throw std::invalid_argument(
+				"Index ends at byte " + std::to_string(indexed_bytes) + 
+				", can't append rows starting at byte " + std::to_string(start_byte) + "."
+				);
+	}
+	return append_new_rows(deleted_doc_ids);
+}
 
-		if (vocab.find(substr) == vocab.end()) {
-			continue;
-		}
+uint64_t _BM25::get_indexed_bytes() {
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
+	return partition_boundaries.back();
+}
 
-		if (stop_words.find(substr) != stop_words.end()) {
-			continue;
-		}
+// Indexes the complete rows past the end of the index as a new segment.
+// Caller holds append_mutex.
+uint64_t _BM25::append_new_rows(const std::vector<uint64_t>& deleted_doc_ids) {
+	uint64_t start_byte = get_indexed_bytes();
+
+	FILE* f = fopen(filename.c_str(), "r");
+	if (f == NULL) {
+		std::cerr << "Unable to open file: " << filename << std::endl;
+		std::exit(1);
+	}
 
-		term_idxs[col_idx].push_back(vocab[substr]);
+	struct stat sb;
+	if (fstat(fileno(f), &sb) == -1) {
+		std::cerr << "Error getting file size." << std::endl;
+		std::exit(1);
 	}
-	substr.clear();
-}
+	uint64_t file_size = sb.st_size;
 
+	// Only complete rows. A row still being written is picked up by a later append.
+	std::vector<uint64_t> line_offsets;
+	uint64_t end_byte = start_byte;
+	if (file_size > start_byte) {
+		char* file_data = (char*)mmap(NULL, file_size, PROT_READ, MAP_SHARED, fileno(f), 0);
+		if (file_data == MAP_FAILED) {
+			std::cerr << "Error mapping file to memory." << std::endl;
+			std::exit(1);
+		}
 
-TermType _BM25::add_query_term_bloom(
-		std::string& substr,
-		std::vector<std::vector<uint64_t>>& term_idxs,
-		std::vector<MAP<uint64_t, BloomEntry>>& bloom_entries,
-		uint16_t partition_id,
-		uint16_t col_idx
-		) {
-	BM25PartitionNew* IP = &index_partitions[partition_id];
+		uint64_t row_end;
+		while ((row_end = find_csv_row_end(file_data, end_byte, file_size)) != 0) {
+			line_offsets.push_back(end_byte);
+			end_byte = row_end;
+		}
+		munmap(file_data, file_size);
+	}
 
-	MAP<std::string, uint32_t>& vocab = IP->unique_term_mappings[col_idx];
+	if (line_offsets.empty()) {
+		fclose(f);
 
-	auto it = vocab.find(substr);
-	if (it == vocab.end()) {
-		substr.clear();
-		term_idxs[col_idx].push_back(UINT64_MAX);
-		return UNKNOWN;
+		if (!deleted_doc_ids.empty()) {
+			std::unique_lock<std::shared_mutex> lock(index_mutex);
+			mark_deleted(deleted_doc_ids);
+			invalidate_query_cache();
+		}
+		return start_byte;
 	}
 
-	if (stop_words.find(substr) != stop_words.end()) {
-		substr.clear();
-		term_idxs[col_idx].push_back(UINT64_MAX);
-		return UNKNOWN;
+	// Reserve the segment and remap the grown source. Queries only look at
+	// partitions below num_partitions, so the segment fills in unlocked.
+	uint16_t partition_id = num_partitions;
+	{
+		std::unique_lock<std::shared_mutex> lock(index_mutex);
+
+		index_partitions = (BM25PartitionNew*)realloc(
+				index_partitions, 
+				(num_partitions + 1) * sizeof(BM25PartitionNew)
+				);
+		init_bm25_partition_new(
+				&index_partitions[partition_id], 
+				line_offsets.size(), 
+				search_cols.size(), 
+				numa_node_for_partition(partition_id)
+				);
+		memcpy(
+				index_partitions[partition_id].line_offsets, 
+				line_offsets.data(), 
+				line_offsets.size() * sizeof(uint64_t)
+				);
+		reference_file_handles.push_back(f);
+		partition_boundaries.push_back(end_byte);
+
+		if (source_data != NULL) {
+			munmap(source_data, source_size);
+			source_data = NULL;
+		}
+		map_source_file();
 	}
-	substr.clear();
-	term_idxs[col_idx].push_back(it->second);
 
-	// TODO: Fix
-	/*
-	auto it2 = IP.II[col_idx].bloom_filters.find(it->second);
-	if (it2 == IP.II[col_idx].bloom_filters.end()) {
-		return LOW_DF;
+	bool _show_progress = show_progress;
+	show_progress = false;
+	read_csv_rfc_4180(start_byte, end_byte, partition_id);
+	show_progress = _show_progress;
+
+	DocStore* store = NULL;
+	if (!doc_stores.empty()) {
+		store = build_partition_doc_store(partition_id, doc_store_cols);
 	}
-	else {
-		bloom_entries[col_idx][it->second] = it2->second;
-		return HIGH_DF;
+
+	// Publish. df and num_docs are summed over partitions at query time, so
+	// only avgdl needs recomputing. Replaced rows disappear in the same step
+	// the new ones show up.
+	{
+		std::unique_lock<std::shared_mutex> lock(index_mutex);
+
+		mark_deleted(deleted_doc_ids);
+		if (store != NULL) {
+			doc_stores.push_back(store);
+		}
+		num_docs += index_partitions[partition_id].num_docs;
+		++num_partitions;
+		update_avg_doc_sizes();
+
+		invalidate_query_cache();
 	}
-	*/
-	return LOW_DF;
+	request_merge();
+	return end_byte;
 }
 
+void _BM25::check_doc_ids(const std::vector<uint64_t>& doc_ids) {
+	for (uint64_t doc_id : doc_ids) {
+		if (doc_id >= num_docs) {
+			std::cerr << "Error: Document " << doc_id << " not in index of ";
+			std::cerr << num_docs << " documents." << std::endl;
+			std::exit(1);
+		}
+	}
+}
 
-static inline uint64_t get_doc_id(
-		StandardEntry& IIE,
-		uint32_t& current_idx,
-		uint64_t& prev_doc_id
-		) {
-	uint64_t doc_id;
+void _BM25::mark_deleted(const std::vector<uint64_t>& doc_ids) {
+	if (doc_ids.empty()) return;
 
-	current_idx += decompress_uint64_differential_single_bytes(
-			&(IIE.doc_ids[current_idx]),
-			doc_id,
-			prev_doc_id
-			);
+	// Doc ids number the rows of the partitions in order.
+	std::vector<uint64_t> partition_starts(num_partitions);
+	uint64_t doc_start = 0;
+	for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+		partition_starts[partition_id] = doc_start;
+		doc_start += index_partitions[partition_id].num_docs;
+	}
 
-	prev_doc_id = doc_id;
+	for (uint64_t doc_id : doc_ids) {
+		uint16_t partition_id = std::upper_bound(
+				partition_starts.begin(), 
+				partition_starts.end(), 
+				doc_id
+				) - partition_starts.begin() - 1;
+		BM25PartitionNew* IP = &index_partitions[partition_id];
+		uint64_t local_doc_id = doc_id - partition_starts[partition_id];
 
-	return doc_id;
+		if (IP->deleted_docs == NULL) {
+			IP->deleted_docs = (uint64_t*)calloc(deleted_docs_words(IP->num_docs), sizeof(uint64_t));
+		}
+		if (!is_doc_deleted(IP->deleted_docs, local_doc_id)) {
+			IP->deleted_docs[local_doc_id >> 6] |= 1ULL << (local_doc_id & 63);
+			++IP->num_deleted;
+		}
+	}
 }
 
-static inline std::pair<uint64_t, uint16_t> pop_replace_minheap(
-		std::priority_queue<
-			std::pair<uint64_t, uint16_t>,
-			std::vector<std::pair<uint64_t, uint16_t>>,
-			_compare_64_16>& min_heap,
-		MAP<uint16_t, StandardEntry*>& II_streams,
-		std::vector<uint32_t>& stream_idxs,
-		std::vector<uint64_t>& prev_doc_ids
-		) {
+void _BM25::delete_docs(const std::vector<uint64_t>& doc_ids) {
+	std::unique_lock<std::shared_mutex> lock(index_mutex);
 
-	std::pair<uint64_t, uint16_t> min = min_heap.top(); min_heap.pop();
-	uint16_t min_idx = min.second;
+	check_doc_ids(doc_ids);
+	mark_deleted(doc_ids);
+	invalidate_query_cache();
+}
 
-	uint64_t doc_id = get_doc_id(*II_streams[min_idx], stream_idxs[min_idx], prev_doc_ids[min_idx]);
-	if (stream_idxs[min_idx] < II_streams[min_idx]->doc_ids.size() - 1) {
-		min_heap.push(std::make_pair(doc_id, min_idx));
+uint64_t _BM25::update(const std::vector<uint64_t>& doc_ids, uint64_t start_byte) {
+	{
+		std::shared_lock<std::shared_mutex> lock(index_mutex);
+		check_doc_ids(doc_ids);
 	}
 
-	return std::make_pair(min.first, min_idx);
+	// The replacement rows were appended to the file. Deleting the old rows
+	// with the append's publish means no query sees both or neither.
+	return append(start_byte, doc_ids);
 }
 
+uint64_t _BM25::get_num_docs() {
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
+	return num_docs;
+}
 
+uint64_t _BM25::get_num_deleted() {
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
 
-/*
-std::vector<BM25Result> _BM25::_query_partition_streaming(
-		std::string& query, 
-		uint32_t k,
-		uint32_t query_max_df,
-		uint16_t partition_id,
-		std::vector<float> boost_factors
-		) {
-	printf("NOT IMPLEMENTED\n");
-	return std::vector<BM25Result>();
+	uint64_t num_deleted = 0;
+	for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+		num_deleted += index_partitions[partition_id].num_deleted;
+	}
+	return num_deleted;
+}
 
-	std::vector<std::vector<uint64_t>> term_idxs(search_cols.size());
-	BM25Partition& IP = index_partitions[partition_id];
+std::vector<uint64_t> _BM25::get_deleted_doc_ids() {
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
 
-	uint64_t doc_offset = (file_type == IN_MEMORY) ? partition_boundaries[partition_id] : 0;
+	std::vector<uint64_t> doc_ids;
+	uint64_t doc_start = 0;
+	for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+		BM25PartitionNew* IP = &index_partitions[partition_id];
 
-	std::string substr = "";
-	for (const char& c : query) {
-		if (c != ' ') {
-			substr += toupper(c); 
-			continue;
+		if (IP->deleted_docs != NULL) {
+			for (uint64_t doc_id = 0; doc_id < IP->num_docs; ++doc_id) {
+				if (is_doc_deleted(IP->deleted_docs, doc_id)) {
+					doc_ids.push_back(doc_start + doc_id);
+				}
+			}
 		}
-
-		add_query_term(substr, term_idxs, partition_id);	
-	}
-	if (!substr.empty()) {
-		add_query_term(substr, term_idxs, partition_id);
+		doc_start += IP->num_docs;
 	}
+	return doc_ids;
+}
+
+PartitionMemoryUsage _BM25::get_partition_memory_usage(const BM25PartitionNew* IP, uint16_t partition_id) {
+	// Columns come zeroed.
+	PartitionMemoryUsage usage;
+	usage.columns.resize(search_cols.size());
+	usage.line_offsets = 0;
+	usage.deleted_docs = 0;
+	usage.doc_store    = 0;
+	usage.arena_unused = 0;
+	usage.total        = 0;
+	usage.mapped       = 0;
+
+	// Loaded partitions point into the index file mapping. Only count pages
+	// already resident, and read no more of the arrays than needed, so
+	// measuring doesn't fault the index in. Arrays of built partitions are
+	// in the arena. Its padding and unused block tails count separately.
+	bool frozen = (IP->frozen_vocabs != NULL);
+	auto array_bytes = [frozen](const void* data, uint64_t size) {
+		return frozen ? mapped_resident_bytes(data, size) : size;
+	};
 
-	uint32_t total_terms = 0;
 	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-		total_terms += term_idxs[col_idx].size();
+		const InvertedIndexNew* II = &IP->II[col_idx];
+		ColumnMemoryUsage& column = usage.columns[col_idx];
+
+		uint64_t num_postings = 0;
+		if (II->num_terms > 0) {
+			num_postings = II->term_offsets[II->num_terms - 1] + II->doc_freqs[II->num_terms - 1];
+		}
+		column.postings     = array_bytes(II->doc_ids, num_postings * sizeof(tf_df_t));
+		column.doc_sizes    = array_bytes(II->doc_sizes, II->num_docs * sizeof(uint16_t));
+		column.term_offsets = array_bytes(II->term_offsets, II->num_terms * sizeof(uint32_t));
+		column.doc_freqs    = array_bytes(II->doc_freqs, II->num_terms * sizeof(uint32_t));
+
+		if (frozen) {
+			const FrozenVocab& vocab = IP->frozen_vocabs[col_idx];
+			column.vocab_buckets = mapped_resident_bytes(vocab.slots, vocab.num_slots * sizeof(uint64_t));
+			column.vocab_strings = mapped_resident_bytes(
+					vocab.term_offsets,
+					(vocab.num_terms + 1) * sizeof(uint64_t)
+					);
+			column.vocab_strings += mapped_resident_bytes(vocab.strings, vocab.term_offsets[vocab.num_terms]);
+		}
+		else {
+			column.vocab_buckets = IP->vocab_bytes[col_idx];
+			for (const auto& [term, term_idx] : IP->unique_term_mappings[col_idx]) {
+				column.vocab_strings += term.size();
+			}
+		}
+
+		column.total = column.postings + column.doc_sizes + column.term_offsets
+					 + column.doc_freqs + column.vocab_buckets + column.vocab_strings;
+		usage.total += column.total;
 	}
-	if (total_terms == 0) return std::vector<BM25Result>();
+	if (frozen) usage.mapped += usage.total;
 
-	MAP<uint16_t, StandardEntry*> II_streams;
-	MAP<uint16_t, BloomEntry*> bloom_entries;
+	usage.line_offsets = array_bytes(IP->line_offsets, IP->num_docs * sizeof(uint64_t));
+	if (frozen) usage.mapped += usage.line_offsets;
+	usage.arena_unused = IP->arena->get_mapped_bytes() - IP->arena->get_used_bytes();
 
-	std::vector<uint64_t> doc_freqs(total_terms, 0);
-	std::vector<float> idfs(total_terms, 0);
-	uint32_t cntr = 0;
-	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-		for (const uint64_t& term_idx : term_idxs[col_idx]) {
-			doc_freqs[cntr] = IP.II[col_idx].doc_freqs[term_idx];
-			idfs[cntr] = log((IP.num_docs - doc_freqs[cntr] + 0.5) / (doc_freqs[cntr] + 0.5));
+	// Always heap, also for loaded partitions.
+	usage.deleted_docs = heap_bytes(IP->deleted_docs);
 
-			auto it = IP.II[col_idx].bloom_filters.find(term_idx);
-			if (it != IP.II[col_idx].bloom_filters.end()) {
-				bloom_entries[cntr] = &it->second;
-				continue;
-			}
+	if (partition_id < doc_stores.size()) {
+		uint64_t doc_store_heap = 0;
+		uint64_t doc_store_mapped = 0;
+		doc_stores[partition_id]->get_memory_usage(doc_store_heap, doc_store_mapped);
 
-			II_streams[cntr++] = &IP.II[col_idx].inverted_index_compressed[term_idx];
-		}
+		usage.doc_store = doc_store_heap + doc_store_mapped;
+		usage.mapped   += doc_store_mapped;
 	}
 
-	std::priority_queue<
-		BM25Result,
-		std::vector<BM25Result>,
-		_compare_bm25_result> top_k_docs;
+	usage.total += usage.line_offsets + usage.deleted_docs + usage.doc_store + usage.arena_unused;
+	return usage;
+}
 
-	// Define minheap of size total_terms to keep track of current smallest doc_id and its index
-	std::priority_queue<
-		std::pair<uint64_t, uint16_t>,
-		std::vector<std::pair<uint64_t, uint16_t>>,
-		_compare_64_16> min_heap;
+std::vector<uint16_t> _BM25::get_partition_numa_nodes() {
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
 
-	std::vector<uint64_t> prev_doc_ids(total_terms, 0);
-	std::vector<uint32_t> stream_idxs(total_terms, 0);
-	std::vector<std::pair<uint16_t, uint32_t>> tf_counters(total_terms, std::make_pair(0, 0));
-	std::vector<uint32_t> tf_idxs(total_terms, 0);
+	std::vector<uint16_t> numa_nodes(num_partitions);
+	for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+		numa_nodes[partition_id] = index_partitions[partition_id].numa_node;
+	}
+	return numa_nodes;
+}
 
-	// Initialize min_heap with first doc_id from each term
-	for (uint32_t i = 0; i < total_terms; ++i) {
-		if (doc_freqs[i] == 0 || doc_freqs[i] > query_max_df) {
-			continue;
+MemoryUsage _BM25::memory_usage() {
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
+
+	MemoryUsage usage;
+	usage.heap   = 0;
+	usage.mapped = 0;
+	usage.total  = 0;
+
+	for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+		usage.partitions.push_back(get_partition_memory_usage(&index_partitions[partition_id], partition_id));
+
+		const PartitionMemoryUsage& partition = usage.partitions.back();
+		usage.heap   += partition.total - partition.mapped;
+		usage.mapped += partition.mapped;
+		usage.total  += partition.total;
+	}
+	usage.source_file    = mapped_resident_bytes(source_data, source_size);
+	usage.postings_cache = (postings_cache != NULL) ? postings_cache->get_stats().size : 0;
+	usage.total         += usage.postings_cache;
+	return usage;
+}
+
+void _BM25::get_vocab_terms(const BM25PartitionNew* IP, uint16_t col_idx, std::vector<std::string>& terms) {
+	// terms[i] is the term with id i.
+	terms.resize(IP->II[col_idx].num_terms);
+
+	if (IP->frozen_vocabs != NULL) {
+		const FrozenVocab& vocab = IP->frozen_vocabs[col_idx];
+		for (uint32_t term_idx = 0; term_idx < vocab.num_terms; ++term_idx) {
+			terms[term_idx].assign(
+					vocab.strings + vocab.term_offsets[term_idx],
+					vocab.term_offsets[term_idx + 1] - vocab.term_offsets[term_idx]
+					);
 		}
+		return;
+	}
 
-		uint64_t doc_id = get_doc_id(*II_streams[i], stream_idxs[i], prev_doc_ids[i]);
-		min_heap.push(std::make_pair(doc_id, i));
+	for (const auto& [term, term_idx] : IP->unique_term_mappings[col_idx]) {
+		terms[term_idx] = term;
+	}
+}
 
-		// Initialize tf_counters
-		tf_counters[i].first  = II_streams[i]->term_freqs[0].value;
-		tf_counters[i].second = II_streams[i]->term_freqs[0].num_repeats;
-		tf_idxs[i] = 1;
+void _BM25::merge_partitions(
+		const std::vector<BM25PartitionNew>& sources,
+		BM25PartitionNew* merged,
+		MergeThrottle& throttle
+		) {
+	// Sources are adjacent and in order, so shifting their doc ids by the docs
+	// before them keeps every posting list sorted.
+	std::vector<uint64_t> doc_bases;
+	uint64_t num_merged_docs = 0;
+	for (const BM25PartitionNew& source : sources) {
+		doc_bases.push_back(num_merged_docs);
+		num_merged_docs += source.num_docs;
+	}
+
+	// The merged partition replaces its sources in place, on the first one's node.
+	init_bm25_partition_new(merged, num_merged_docs, search_cols.size(), sources[0].numa_node);
+	NumaAffinity affinity(merged->numa_node);
+	if (file_type != IN_MEMORY) {
+		for (size_t idx = 0; idx < sources.size(); ++idx) {
+			memcpy(
+					merged->line_offsets + doc_bases[idx], 
+					sources[idx].line_offsets, 
+					sources[idx].num_docs * sizeof(uint64_t)
+					);
+		}
 	}
 
-	BM25Result current_doc;
+	std::vector<std::string> terms;
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		InvertedIndexNew* II = &merged->II[col_idx];
+		VocabMap& vocab = merged->unique_term_mappings[col_idx];
+		init_inverted_index_new(II);
+
+		// Union the vocabs. term_maps[i][t] is the merged id of term t of source i.
+		std::vector<std::vector<uint32_t>> term_maps(sources.size());
+		for (size_t idx = 0; idx < sources.size(); ++idx) {
+			get_vocab_terms(&sources[idx], col_idx, terms);
+
+			term_maps[idx].resize(terms.size());
+			for (uint32_t term_idx = 0; term_idx < terms.size(); ++term_idx) {
+				auto [it, add] = add_vocab_term(merged, col_idx, terms[term_idx], vocab.size());
+				term_maps[idx][term_idx] = it->second;
+			}
+		}
 
-	uint64_t global_prev_doc_id = 0;
-	while (1) {
-		std::pair<uint64_t, uint16_t> doc_id_idx_pair = pop_replace_minheap(
-				min_heap, 
-				II_streams, 
-				stream_idxs, 
-				prev_doc_ids
-				);
+		// Postings of deleted docs are dropped. Their doc slots stay so doc ids,
+		// line offsets and doc store rows keep lining up.
+		II->num_terms = vocab.size();
+		II->num_docs  = num_merged_docs;
+		// Arena memory comes zeroed.
+		II->doc_freqs = (uint32_t*)merged->arena->allocate(max(1, II->num_terms) * sizeof(uint32_t));
+		for (size_t idx = 0; idx < sources.size(); ++idx) {
+			const InvertedIndexNew* source_II = &sources[idx].II[col_idx];
+			const uint64_t* deleted_docs = sources[idx].deleted_docs;
+
+			for (uint32_t term_idx = 0; term_idx < source_II->num_terms; ++term_idx) {
+				if (deleted_docs == NULL) {
+					II->doc_freqs[term_maps[idx][term_idx]] += source_II->doc_freqs[term_idx];
+					continue;
+				}
 
-		if (min_heap.size() == 0) {
-			break;
+				const tf_df_t* postings = source_II->doc_ids + source_II->term_offsets[term_idx];
+				for (uint32_t i = 0; i < source_II->doc_freqs[term_idx]; ++i) {
+					II->doc_freqs[term_maps[idx][term_idx]] += !is_doc_deleted(deleted_docs, postings[i].doc_id);
+				}
+			}
 		}
 
-		uint64_t doc_id  = doc_id_idx_pair.first;
-		uint16_t min_idx = doc_id_idx_pair.second;
-		uint16_t col_idx = min_idx / search_cols.size();
+		II->term_offsets = (uint32_t*)merged->arena->allocate(max(1, II->num_terms) * sizeof(uint32_t));
+		uint64_t num_postings = 0;
+		for (uint32_t term_idx = 0; term_idx < II->num_terms; ++term_idx) {
+			II->term_offsets[term_idx] = (uint32_t)num_postings;
+			num_postings += II->doc_freqs[term_idx];
+		}
 
-		float idf = idfs[min_idx];
-		float tf  = (float)tf_counters[min_idx].first;
+		// Next free slot in each merged posting list.
+		std::vector<uint32_t> cursors(II->term_offsets, II->term_offsets + II->num_terms);
 
-		// TODO: Add handling for when StandardEntries are empty.
+		II->doc_ids   = (tf_df_t*)merged->arena->allocate(max(1, num_postings) * sizeof(tf_df_t));
+		II->doc_sizes = (uint16_t*)merged->arena->allocate(num_merged_docs * sizeof(uint16_t));
 
-		// Score
-		if (doc_id != global_prev_doc_id) {
-			// New doc_id.
-			// Add previous doc_id to top_k_docs
-			if (current_doc.doc_id != 0) {
-				// Score with bloom filters
-				for (const auto& [i, bloom_entry] : bloom_entries) {
-					// TODO: Fix or remove.
-					if (bloom_query(bloom_entries[i]->bloom_filters[0], current_doc.doc_id)) {
-						current_doc.score += _compute_bm25(
-								current_doc.doc_id, 
-								1.0f,
-								idfs[i], 
-								col_idx,
-								partition_id
-								) * boost_factors[i / search_cols.size()];
-					}
-				}
+		double total_doc_size = 0.0;
+		for (size_t idx = 0; idx < sources.size(); ++idx) {
+			const InvertedIndexNew* source_II = &sources[idx].II[col_idx];
+			const uint64_t* deleted_docs = sources[idx].deleted_docs;
 
+			for (uint32_t term_idx = 0; term_idx < source_II->num_terms; ++term_idx) {
+				uint32_t merged_idx = term_maps[idx][term_idx];
+				const tf_df_t* postings = source_II->doc_ids + source_II->term_offsets[term_idx];
 
-				top_k_docs.push(current_doc);
-				if (top_k_docs.size() > k) {
-					top_k_docs.pop();
+				for (uint32_t i = 0; i < source_II->doc_freqs[term_idx]; ++i) {
+					tf_df_t entry = postings[i];
+					if (deleted_docs != NULL && is_doc_deleted(deleted_docs, entry.doc_id)) continue;
+
+					entry.doc_id += doc_bases[idx];
+					II->doc_ids[cursors[merged_idx]++] = entry;
 				}
 			}
 
-			current_doc.doc_id = doc_id + doc_offset;
-			current_doc.score = _compute_bm25(
+			memcpy(
+					II->doc_sizes + doc_bases[idx], 
+					source_II->doc_sizes, 
+					sources[idx].num_docs * sizeof(uint16_t)
+					);
+			total_doc_size += (double)source_II->avg_doc_size * sources[idx].num_docs;
+		}
+		II->avg_doc_size = (float)(total_doc_size / max(1, num_merged_docs));
+
+		throttle.pace(num_postings * sizeof(tf_df_t) + num_merged_docs * sizeof(uint16_t));
+	}
+}
+
+bool _BM25::merge_once(MergeThrottle& throttle) {
+	// Excludes build_doc_store, which replaces the stores a merge reads.
+	std::lock_guard<std::mutex> merge_lock(merge_mutex);
+
+	// Partitions below num_partitions only change here, so the sources stay
+	// valid after the lock is dropped. Their structs are copied because an
+	// append may move the partition table.
+	uint16_t start, end;
+	std::vector<BM25PartitionNew> sources;
+	std::vector<DocStore*> source_stores;
+	{
+		std::shared_lock<std::shared_mutex> lock(index_mutex);
+
+		std::vector<uint64_t> segment_docs;
+		for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+			segment_docs.push_back(index_partitions[partition_id].num_docs);
+		}
+		if (!find_merge(segment_docs, merge_policy, start, end)) {
+			return false;
+		}
+
+		// Deletes keep setting bits in the live bitmaps while the merge runs.
+		// It works from a copy and picks up the rest when swapping.
+		sources.assign(index_partitions + start, index_partitions + end);
+		for (BM25PartitionNew& source : sources) {
+			if (source.deleted_docs == NULL) continue;
+
+			uint64_t size = deleted_docs_words(source.num_docs) * sizeof(uint64_t);
+			uint64_t* deleted_docs = (uint64_t*)malloc(size);
+			memcpy(deleted_docs, source.deleted_docs, size);
+			source.deleted_docs = deleted_docs;
+		}
+		if (!doc_stores.empty()) {
+			source_stores.assign(doc_stores.begin() + start, doc_stores.begin() + end);
+		}
+	}
+
+	BM25PartitionNew merged;
+	merge_partitions(sources, &merged, throttle);
+
+	DocStore* merged_store = NULL;
+	if (!source_stores.empty()) {
+		merged_store = new DocStore(doc_store_cols.size());
+
+		std::vector<std::string> fields;
+		for (DocStore* store : source_stores) {
+			uint64_t store_docs = store->get_stats().num_docs;
+			for (uint64_t doc_id = 0; doc_id < store_docs; ++doc_id) {
+				store->get(doc_id, fields);
+				merged_store->add(fields);
+			}
+			throttle.pace(store->get_stats().raw_bytes);
+		}
+		merged_store->finish();
+	}
+
+	// Swap [start, end) for the merged segment. Waits for an in-flight append,
+	// which holds the id of the slot it is filling.
+	{
+		std::lock_guard<std::mutex> append_lock(append_mutex);
+		std::unique_lock<std::shared_mutex> lock(index_mutex);
+
+		// Every delete so far, including those the merge didn't see. Their
+		// postings go in the next merge.
+		uint64_t doc_base = 0;
+		for (uint16_t partition_id = start; partition_id < end; ++partition_id) {
+			BM25PartitionNew* IP = &index_partitions[partition_id];
+
+			if (IP->deleted_docs != NULL) {
+				if (merged.deleted_docs == NULL) {
+					merged.deleted_docs = (uint64_t*)calloc(
+							deleted_docs_words(merged.num_docs), 
+							sizeof(uint64_t)
+							);
+				}
+				for (uint64_t doc_id = 0; doc_id < IP->num_docs; ++doc_id) {
+					if (is_doc_deleted(IP->deleted_docs, doc_id)) {
+						merged.deleted_docs[(doc_base + doc_id) >> 6] |= 1ULL << ((doc_base + doc_id) & 63);
+					}
+				}
+				merged.num_deleted += IP->num_deleted;
+				free(IP->deleted_docs);
+			}
+			doc_base += IP->num_docs;
+		}
+
+		uint16_t num_removed = end - start - 1;
+		index_partitions[start] = merged;
+		memmove(
+				index_partitions + start + 1, 
+				index_partitions + end, 
+				(num_partitions - end) * sizeof(BM25PartitionNew)
+				);
+
+		partition_boundaries.erase(
+				partition_boundaries.begin() + start + 1, 
+				partition_boundaries.begin() + end
+				);
+
+		// Only if there is one per segment. See can_merge.
+		if (reference_file_handles.size() == num_partitions) {
+			for (uint16_t partition_id = start + 1; partition_id < end; ++partition_id) {
+				fclose(reference_file_handles[partition_id]);
+			}
+			reference_file_handles.erase(
+					reference_file_handles.begin() + start + 1, 
+					reference_file_handles.begin() + end
+					);
+		}
+
+		if (merged_store != NULL) {
+			doc_stores[start] = merged_store;
+			doc_stores.erase(doc_stores.begin() + start + 1, doc_stores.begin() + end);
+		}
+
+		num_partitions -= num_removed;
+		update_avg_doc_sizes();
+
+		// Cached results carry partition ids that just moved.
+		invalidate_query_cache();
+	}
+
+	// No query can reach the sources anymore.
+	for (BM25PartitionNew& source : sources) {
+		free_bm25_partition_new(&source);
+	}
+	for (DocStore* store : source_stores) {
+		delete store;
+	}
+
+	num_merges.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+void _BM25::start_merges(const MergePolicy& policy) {
+	if (!can_merge()) {
+		throw std::invalid_argument("Merging needs the source file of the index open for every segment.");
+	}
+	stop_merges();
+
+	merge_policy = policy;
+
+	// Keep merged segments under the largest partition and within the
+	// 28 bits of a posting doc id.
+	uint64_t max_segment_docs = (1ULL << 28) - 1;
+	if (merge_policy.max_segment_docs == 0) {
+		std::shared_lock<std::shared_mutex> lock(index_mutex);
+
+		for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+			merge_policy.max_segment_docs = max(
+					merge_policy.max_segment_docs, 
+					index_partitions[partition_id].num_docs
+					);
+		}
+	}
+	merge_policy.max_segment_docs = min(merge_policy.max_segment_docs, max_segment_docs);
+
+	stop_merging = false;
+	merge_generation = 1;
+	merge_thread = std::thread([this] {
+		MergeThrottle throttle(merge_policy, &stop_merging);
+
+		uint64_t generation = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(merge_wait_mutex);
+				merge_cv.wait(lock, [this, generation] {
+					return stop_merging.load() || merge_generation != generation;
+				});
+				if (stop_merging) break;
+				generation = merge_generation;
+			}
+
+			while (!stop_merging && merge_once(throttle)) {}
+		}
+	});
+}
+
+void _BM25::stop_merges() {
+	if (!merge_thread.joinable()) return;
+
+	{
+		std::lock_guard<std::mutex> lock(merge_wait_mutex);
+		stop_merging = true;
+	}
+	merge_cv.notify_one();
+	merge_thread.join();
+}
+
+void _BM25::request_merge() {
+	{
+		std::lock_guard<std::mutex> lock(merge_wait_mutex);
+		++merge_generation;
+	}
+	merge_cv.notify_one();
+}
+
+uint16_t _BM25::get_num_segments() {
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
+	return num_partitions;
+}
+
+bool _BM25::can_merge() {
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
+	return reference_file_handles.size() == num_partitions;
+}
+
+void _BM25::start_follow(uint32_t interval_ms) {
+	if (file_type != CSV) {
+		throw std::invalid_argument("Follow is only supported for csv files.");
+	}
+	stop_follow();
+
+	// Every batch adds a segment. Keep their number in check.
+	if (!merge_thread.joinable()) {
+		start_merges(default_merge_policy());
+	}
+
+	follow_interval_ms = max(1, interval_ms);
+	stop_following = false;
+	follow_thread = std::thread([this] { follow(); });
+}
+
+void _BM25::stop_follow() {
+	if (!follow_thread.joinable()) return;
+
+	stop_following = true;
+	follow_thread.join();
+}
+
+void _BM25::follow() {
+	const int file_fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (file_fd == -1) {
+		std::cerr << "Unable to open file: " << filename << std::endl;
+		return;
+	}
+
+	// inotify wakes on writes. Where it is unavailable, e.g. on network
+	// filesystems, fall back to checking the size every interval.
+	int watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch_fd != -1 && inotify_add_watch(watch_fd, filename.c_str(), IN_MODIFY | IN_CLOSE_WRITE) == -1) {
+		close(watch_fd);
+		watch_fd = -1;
+	}
+
+	// Sleeps in short slices so stop_follow returns quickly.
+	const int slice_ms = 10;
+	auto sleep_until = [this, slice_ms](std::chrono::steady_clock::time_point wake) {
+		while (!stop_following && std::chrono::steady_clock::now() < wake) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(slice_ms));
+		}
+	};
+
+	auto last_append = std::chrono::steady_clock::now() - std::chrono::milliseconds(follow_interval_ms);
+	bool warned_truncated = false;
+	char events[4096];
+
+	// Rows may have been written before following started.
+	bool changed = true;
+	while (!stop_following) {
+		if (!changed) {
+			if (watch_fd != -1) {
+				struct pollfd pfd = {watch_fd, POLLIN, 0};
+				if (poll(&pfd, 1, slice_ms) <= 0) continue;
+				while (read(watch_fd, events, sizeof(events)) > 0) {}
+			}
+			else {
+				sleep_until(std::chrono::steady_clock::now() + std::chrono::milliseconds(follow_interval_ms));
+			}
+		}
+		changed = false;
+
+		struct stat sb;
+		if (fstat(file_fd, &sb) == -1) continue;
+		uint64_t file_size = sb.st_size;
+
+		uint64_t indexed_bytes;
+		{
+			std::shared_lock<std::shared_mutex> lock(index_mutex);
+			indexed_bytes = partition_boundaries.back();
+		}
+		if (file_size < indexed_bytes && !warned_truncated) {
+			std::cerr << "Warning: " << filename << " shrank below the indexed rows. ";
+			std::cerr << "Following resumes once it grows past byte " << indexed_bytes << "." << std::endl;
+			warned_truncated = true;
+		}
+		if (file_size <= indexed_bytes) continue;
+		warned_truncated = false;
+
+		// Batch: rows written within one interval go into one segment.
+		sleep_until(last_append + std::chrono::milliseconds(follow_interval_ms));
+		if (stop_following) break;
+
+		{
+			std::lock_guard<std::mutex> append_lock(append_mutex);
+			append_new_rows({});
+		}
+		last_append = std::chrono::steady_clock::now();
+
+		// Writes during the batch wait or the append are past the last event.
+		changed = true;
+	}
+
+	if (watch_fd != -1) close(watch_fd);
+	close(file_fd);
+}
+
+_BM25::~_BM25() {
+	stop_follow();
+	stop_merges();
+
+	for (auto& handle : reference_file_handles) {
+		if (handle != nullptr) {
+			fclose(handle);
+		}
+	}
+
+	for (size_t partition_idx = 0; partition_idx < (size_t)num_partitions; ++partition_idx) {
+		/*
+		BM25PartitionNew* IP = &index_partitions[partition_idx];
+
+		for (size_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+			InvertedIndexNew* II = &IP->II[col_idx];
+			for (auto& [doc_id, bloom_entry] : II.bloom_filters) {
+				for (auto& [tf, filter] : bloom_entry.bloom_filters) {
+					bloom_free(filter);
+				}
+			}
+		}
+		*/
+		free_bm25_partition_new(&index_partitions[partition_idx]);
+	}
+	free(index_partitions);
+
+	if (index_data != NULL) {
+		munmap(index_data, index_size);
+	}
+	delete postings_cache;
+
+	if (source_data != NULL) {
+		munmap(source_data, source_size);
+	}
+	free_doc_stores();
+
+	delete query_cache;
+}
+
+void _BM25::set_query_cache_capacity(uint64_t capacity) {
+	// Queries read query_cache under the shared lock, without the GIL.
+	std::unique_lock<std::shared_mutex> lock(index_mutex);
+	if (query_cache == NULL) {
+		query_cache = new QueryCache(capacity);
+		return;
+	}
+	query_cache->set_capacity(capacity);
+}
+
+void _BM25::invalidate_query_cache() {
+	if (query_cache != NULL) {
+		query_cache->clear();
+	}
+}
+
+QueryStatsSummary _BM25::get_query_stats() {
+	return query_stats.get_summary();
+}
+
+void _BM25::reset_query_stats() {
+	query_stats.reset();
+}
+
+QueryCacheStats _BM25::get_query_cache_stats() {
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
+	if (query_cache == NULL) {
+		QueryCacheStats stats;
+		memset(&stats, 0, sizeof(QueryCacheStats));
+		return stats;
+	}
+	return query_cache->get_stats();
+}
+
+BlockCacheStats _BM25::get_postings_cache_stats() {
+	if (postings_cache == NULL) {
+		BlockCacheStats stats;
+		memset(&stats, 0, sizeof(BlockCacheStats));
+		return stats;
+	}
+	return postings_cache->get_stats();
+}
+
+// Postings are sorted by doc_id, but spread over doc_sizes, so most lookups
+// miss the cache. Fetching the entry a few postings ahead overlaps its miss
+// with scoring the ones before it.
+static inline void prefetch_doc_size(const InvertedIndexNew* II, const tf_df_t* postings, uint64_t i, uint64_t n) {
+	if (i + DOC_SIZE_PREFETCH_DISTANCE < n) {
+		__builtin_prefetch(&II->doc_sizes[postings[i + DOC_SIZE_PREFETCH_DISTANCE].doc_id], 0, 1);
+	}
+}
+
+BlockCursor _BM25::get_postings_cursor(const InvertedIndexNew* II, uint32_t term_idx) {
+	// Segments appended or merged since loading live in memory.
+	const char* postings = (const char*)II->doc_ids;
+	if (postings_cache == NULL || postings < index_data || postings >= index_data + index_size) {
+		return BlockCursor(NULL, 0);
+	}
+
+	const tf_df_t* postings_end = &II->doc_ids[II->term_offsets[term_idx] + II->doc_freqs[term_idx]];
+	return BlockCursor(postings_cache, (const char*)postings_end - index_data);
+}
+
+// Postings [idx, end) of II. Through an active cursor only those in the
+// block holding idx. *span_end is where the returned ones end.
+static inline const tf_df_t* get_postings(
+		const InvertedIndexNew* II,
+		BlockCursor& cursor,
+		const char* index_data,
+		uint64_t idx,
+		uint64_t end,
+		uint64_t* span_end
+		) {
+	if (!cursor.is_active()) {
+		*span_end = end;
+		return &II->doc_ids[idx];
+	}
+
+	// Postings arrays are page aligned in the file, so none straddle blocks.
+	uint64_t available;
+	const char* postings = cursor.get((const char*)&II->doc_ids[idx] - index_data, &available);
+	*span_end = idx + min(end - idx, available / sizeof(tf_df_t));
+	return (const tf_df_t*)postings;
+}
+
+inline float _BM25::_compute_bm25(
+		uint64_t doc_id,
+		float tf,
+		float idf,
+		uint16_t col_idx,
+		uint16_t partition_id
+		) {
+	BM25PartitionNew IP = index_partitions[partition_id];
+
+	float weigted_doc_size = IP.II[col_idx].doc_sizes[doc_id] / avg_doc_sizes[col_idx];
+	return idf * tf / (tf + k1 * (1 - b + b * weigted_doc_size));
+}
+
+void _BM25::add_query_term(
+		std::string& substr,
+		std::vector<std::vector<uint64_t>>& term_idxs,
+		uint16_t partition_id
+		) {
+	BM25PartitionNew* IP = &index_partitions[partition_id];
+
+	for (size_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		uint32_t term_idx = find_vocab_term(IP, col_idx, substr, hash_vocab_term(IP, col_idx, substr));
+		if (term_idx == UINT32_MAX) {
+			continue;
+		}
+
+		if (stop_words.find(substr) != stop_words.end()) {
+			continue;
+		}
+
+		term_idxs[col_idx].push_back(term_idx);
+	}
+	substr.clear();
+}
+
+
+TermType _BM25::get_query_term_type(const CompiledTerm& term, uint16_t partition_id) {
+	if (term.partition_term_ids[partition_id] == UINT32_MAX) {
+		return UNKNOWN;
+	}
+	return LOW_DF;
+}
+
+
+static inline uint64_t get_doc_id(
+		StandardEntry& IIE,
+		uint32_t& current_idx,
+		uint64_t& prev_doc_id
+		) {
+	uint64_t doc_id;
+
+	current_idx += decompress_uint64_differential_single_bytes(
+			&(IIE.doc_ids[current_idx]),
+			doc_id,
+			prev_doc_id
+			);
+
+	prev_doc_id = doc_id;
+
+	return doc_id;
+}
+
+static inline std::pair<uint64_t, uint16_t> pop_replace_minheap(
+		std::priority_queue<
+			std::pair<uint64_t, uint16_t>,
+			std::vector<std::pair<uint64_t, uint16_t>>,
+			_compare_64_16>& min_heap,
+		MAP<uint16_t, StandardEntry*>& II_streams,
+		std::vector<uint32_t>& stream_idxs,
+		std::vector<uint64_t>& prev_doc_ids
+		) {
+
+	std::pair<uint64_t, uint16_t> min = min_heap.top(); min_heap.pop();
+	uint16_t min_idx = min.second;
+
+	uint64_t doc_id = get_doc_id(*II_streams[min_idx], stream_idxs[min_idx], prev_doc_ids[min_idx]);
+	if (stream_idxs[min_idx] < II_streams[min_idx]->doc_ids.size() - 1) {
+		min_heap.push(std::make_pair(doc_id, min_idx));
+	}
+
+	return std::make_pair(min.first, min_idx);
+}
+
+
+
+/*
+std::vector<BM25Result> _BM25::_query_partition_streaming(
+		std::string& query, 
+		uint32_t k,
+		uint32_t query_max_df,
+		uint16_t partition_id,
+		std::vector<float> boost_factors
+		) {
+	printf("NOT IMPLEMENTED\n");
+	return std::vector<BM25Result>();
+
+	std::vector<std::vector<uint64_t>> term_idxs(search_cols.size());
+	BM25Partition& IP = index_partitions[partition_id];
+
+	uint64_t doc_offset = (file_type == IN_MEMORY) ? partition_boundaries[partition_id] : 0;
+
+	std::string substr = "";
+	for (const char& c : query) {
+		if (c != ' ') {
+			substr += toupper(c); 
+			continue;
+		}
+
+		add_query_term(substr, term_idxs, partition_id);	
+	}
+	if (!substr.empty()) {
+		add_query_term(substr, term_idxs, partition_id);
+	}
+
+	uint32_t total_terms = 0;
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		total_terms += term_idxs[col_idx].size();
+	}
+	if (total_terms == 0) return std::vector<BM25Result>();
+
+	MAP<uint16_t, StandardEntry*> II_streams;
+	MAP<uint16_t, BloomEntry*> bloom_entries;
+
+	std::vector<uint64_t> doc_freqs(total_terms, 0);
+	std::vector<float> idfs(total_terms, 0);
+	uint32_t cntr = 0;
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		for (const uint64_t& term_idx : term_idxs[col_idx]) {
+			doc_freqs[cntr] = IP.II[col_idx].doc_freqs[term_idx];
+			idfs[cntr] = log((IP.num_docs - doc_freqs[cntr] + 0.5) / (doc_freqs[cntr] + 0.5));
+
+			auto it = IP.II[col_idx].bloom_filters.find(term_idx);
+			if (it != IP.II[col_idx].bloom_filters.end()) {
+				bloom_entries[cntr] = &it->second;
+				continue;
+			}
+
+			II_streams[cntr++] = &IP.II[col_idx].inverted_index_compressed[term_idx];
+		}
+	}
+
+	std::priority_queue<
+		BM25Result,
+		std::vector<BM25Result>,
+		_compare_bm25_result> top_k_docs;
+
+	// Define minheap of size total_terms to keep track of current smallest doc_id and its index
+	std::priority_queue<
+		std::pair<uint64_t, uint16_t>,
+		std::vector<std::pair<uint64_t, uint16_t>>,
+		_compare_64_16> min_heap;
+
+	std::vector<uint64_t> prev_doc_ids(total_terms, 0);
+	std::vector<uint32_t> stream_idxs(total_terms, 0);
+	std::vector<std::pair<uint16_t, uint32_t>> tf_counters(total_terms, std::make_pair(0, 0));
+	std::vector<uint32_t> tf_idxs(total_terms, 0);
+
+	// Initialize min_heap with first doc_id from each term
+	for (uint32_t i = 0; i < total_terms; ++i) {
+		if (doc_freqs[i] == 0 || doc_freqs[i] > query_max_df) {
+			continue;
+		}
+
+		uint64_t doc_id = get_doc_id(*II_streams[i], stream_idxs[i], prev_doc_ids[i]);
+		min_heap.push(std::make_pair(doc_id, i));
+
+		// Initialize tf_counters
+		tf_counters[i].first  = II_streams[i]->term_freqs[0].value;
+		tf_counters[i].second = II_streams[i]->term_freqs[0].num_repeats;
+		tf_idxs[i] = 1;
+	}
+
+	BM25Result current_doc;
+
+	uint64_t global_prev_doc_id = 0;
+	while (1) {
+		std::pair<uint64_t, uint16_t> doc_id_idx_pair = pop_replace_minheap(
+				min_heap, 
+				II_streams, 
+				stream_idxs, 
+				prev_doc_ids
+				);
+
+		if (min_heap.size() == 0) {
+			break;
+		}
+
+		uint64_t doc_id  = doc_id_idx_pair.first;
+		uint16_t min_idx = doc_id_idx_pair.second;
+		uint16_t col_idx = min_idx / search_cols.size();
+
+		float idf = idfs[min_idx];
+		float tf  = (float)tf_counters[min_idx].first;
+
+		// TODO: Add handling for when StandardEntries are empty.
+
+		// Score
+		if (doc_id != global_prev_doc_id) {
+			// New doc_id.
+			// Add previous doc_id to top_k_docs
+			if (current_doc.doc_id != 0) {
+				// Score with bloom filters
+				for (const auto& [i, bloom_entry] : bloom_entries) {
+					// TODO: Fix or remove.
+					if (bloom_query(bloom_entries[i]->bloom_filters[0], current_doc.doc_id)) {
+						current_doc.score += _compute_bm25(
+								current_doc.doc_id, 
+								1.0f,
+								idfs[i], 
+								col_idx,
+								partition_id
+								) * boost_factors[i / search_cols.size()];
+					}
+				}
+
+
+				top_k_docs.push(current_doc);
+				if (top_k_docs.size() > k) {
+					top_k_docs.pop();
+				}
+			}
+
+			current_doc.doc_id = doc_id + doc_offset;
+			current_doc.score = _compute_bm25(
 					doc_id, 
 					tf, 
 					idf, 
@@ -3503,457 +5246,1115 @@ std::vector<BM25Result> _BM25::_query_partition_streaming(
 					) * boost_factors[col_idx];
 		}
 
-		--tf_counters[min_idx].second;
-		if (tf_counters[min_idx].second == 0) {
-			// Get next RLE pair.
-			if (tf_idxs[min_idx] < doc_freqs[min_idx]) {
-				++tf_idxs[min_idx];
-				tf_counters[min_idx].first  = II_streams[min_idx]->term_freqs[tf_idxs[min_idx]].value;
-				tf_counters[min_idx].second = II_streams[min_idx]->term_freqs[tf_idxs[min_idx]].num_repeats;
+		--tf_counters[min_idx].second;
+		if (tf_counters[min_idx].second == 0) {
+			// Get next RLE pair.
+			if (tf_idxs[min_idx] < doc_freqs[min_idx]) {
+				++tf_idxs[min_idx];
+				tf_counters[min_idx].first  = II_streams[min_idx]->term_freqs[tf_idxs[min_idx]].value;
+				tf_counters[min_idx].second = II_streams[min_idx]->term_freqs[tf_idxs[min_idx]].num_repeats;
+			}
+		}
+
+		global_prev_doc_id = doc_id;
+	}
+
+	std::vector<BM25Result> result(top_k_docs.size());
+	int idx = top_k_docs.size() - 1;
+	while (!top_k_docs.empty()) {
+		result[idx] = top_k_docs.top();
+		top_k_docs.pop();
+		--idx;
+	}
+
+	return result;
+}
+*/
+
+static inline uint64_t elapsed_ns(const std::chrono::high_resolution_clock::time_point& start) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::high_resolution_clock::now() - start
+			).count();
+}
+
+std::vector<std::vector<std::pair<std::string, std::string>>> _BM25::get_topk_internal(
+		std::string& query,
+		uint32_t top_k,
+		uint32_t query_max_df,
+		std::vector<float> boost_factors,
+		const std::vector<std::string>& column_names,
+		uint64_t deadline_us,
+		bool* approximate
+		) {
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	QueryDeadline deadline = get_query_deadline(deadline_us);
+
+	QueryStats stats;
+	init_query_stats(&stats);
+	validate_boost_factors(boost_factors);
+
+	CompiledQuery compiled = compile_query(query);
+	stats.phase_ns[PHASE_TOKENIZE] = elapsed_ns(start);
+
+	// Empty columns fetches whole rows.
+	std::vector<uint16_t> projection = get_column_projection(column_names);
+
+	std::vector<std::vector<std::pair<std::string, std::string>>> result = _get_topk_internal(
+			compiled, 
+			top_k, 
+			query_max_df, 
+			boost_factors,
+			column_names.empty() ? NULL : &projection,
+			&stats,
+			&deadline
+			);
+
+	stats.total_ns = elapsed_ns(start);
+	query_stats.record(stats);
+
+	if (approximate != NULL) {
+		*approximate = stats.approximate;
+	}
+	return result;
+}
+
+static inline bool query_expired(const QueryDeadline* deadline) {
+	if (deadline == NULL) return false;
+
+	// cancel_queries() bumps the epoch.
+	if (deadline->current_epoch->load(std::memory_order_relaxed) != deadline->epoch) return true;
+
+	return deadline->has_deadline && std::chrono::steady_clock::now() >= deadline->deadline;
+}
+
+// Raise the shared threshold to score if it is higher. Never lowers it.
+static inline void publish_threshold(std::atomic<float>* shared_threshold, float score) {
+	float current = shared_threshold->load(std::memory_order_relaxed);
+	while (score > current) {
+		if (shared_threshold->compare_exchange_weak(current, score, std::memory_order_relaxed)) {
+			break;
+		}
+	}
+}
+
+// deleted_docs is indexed by partition doc id, doc_scores by doc id + doc_offset.
+static std::vector<BM25Result> get_partition_topk(
+		const MAP<uint64_t, float>& doc_scores,
+		uint32_t k,
+		uint16_t partition_id,
+		std::atomic<float>* shared_threshold,
+		const uint64_t* deleted_docs,
+		uint64_t doc_offset
+		) {
+	std::vector<BM25Result> result;
+	if (k == 0 || doc_scores.size() == 0) {
+		return result;
+	}
+
+	// Another partition already holds k docs scoring at least this much.
+	float threshold = (shared_threshold != NULL) ? shared_threshold->load(std::memory_order_relaxed) : -FLT_MAX;
+
+	if (k < TOPK_LARGE_K || doc_scores.size() <= k) {
+		TopKHeap heap;
+		init_topk_heap(&heap, min(k, (uint32_t)doc_scores.size()));
+
+		for (const auto& pair : doc_scores) {
+			if (pair.second < threshold) continue;
+			if (deleted_docs != NULL && is_doc_deleted(deleted_docs, pair.first - doc_offset)) continue;
+
+			BM25Result doc;
+			doc.doc_id = pair.first;
+			doc.score  = pair.second;
+			doc.partition_id = partition_id;
+			topk_heap_push(&heap, doc);
+		}
+
+		if (shared_threshold != NULL && k > 0 && heap.size == k) {
+			publish_threshold(shared_threshold, topk_heap_threshold(&heap));
+		}
+		topk_heap_extract_sorted(&heap, result);
+		free_topk_heap(&heap);
+		return result;
+	}
+
+	// Large k. Flatten the scores so the selection can run over contiguous arrays.
+	std::vector<uint64_t> doc_ids;
+	std::vector<float>    scores;
+	doc_ids.reserve(doc_scores.size());
+	scores.reserve(doc_scores.size());
+	for (const auto& pair : doc_scores) {
+		if (deleted_docs != NULL && is_doc_deleted(deleted_docs, pair.first - doc_offset)) continue;
+
+		doc_ids.push_back(pair.first);
+		scores.push_back(pair.second);
+	}
+
+	topk_select(doc_ids.data(), scores.data(), scores.size(), k, partition_id, threshold, result);
+
+	if (shared_threshold != NULL && k > 0 && result.size() == k) {
+		publish_threshold(shared_threshold, result.back().score);
+	}
+	return result;
+}
+
+std::vector<BM25Result> _BM25::_query_partition_bloom_multi(
+		const CompiledQuery& query,
+		uint32_t k,
+		uint32_t query_max_df,
+		uint16_t partition_id,
+		const std::vector<float>& boost_factors,
+		std::atomic<float>* shared_threshold,
+		QueryStats* stats,
+		const QueryDeadline* deadline
+		) {
+
+	BM25PartitionNew* IP = &index_partitions[partition_id];
+
+	uint64_t doc_offset = (file_type == IN_MEMORY) ? partition_boundaries[partition_id] : 0;
+
+	const std::vector<std::vector<CompiledTerm>>& terms = query.terms;
+	assert(terms.size() == search_cols.size());
+
+	std::vector<std::vector<TermType>> term_types(search_cols.size());
+	uint16_t num_low_df_terms = 0;
+	for (size_t col_idx = 0; col_idx < terms.size(); ++col_idx) {
+		for (const CompiledTerm& term : terms[col_idx]) {
+			TermType term_type = get_query_term_type(term, partition_id);
+			term_types[col_idx].push_back(term_type);
+
+			if (term_type == LOW_DF) {
+				++num_low_df_terms;
+			}
+		}
+	}
+	if (num_low_df_terms == 0) return std::vector<BM25Result>();
+
+	QueryStats partition_stats;
+	init_query_stats(&partition_stats);
+	partition_stats.partitions_touched = 1;
+
+	// Score low_df terms.
+	MAP<uint64_t, float> doc_scores;
+
+	// A term adds at most idf * boost to any doc. Scoring terms by decreasing bound lets
+	// docs first seen once the remaining bounds sum below the shared threshold be skipped.
+	typedef struct {
+		uint16_t col_idx;
+		uint64_t term_idx;
+		uint64_t df_partition;
+		float    idf;
+		float    upper_bound;
+	} LowDFTerm;
+
+	std::vector<LowDFTerm> low_df_terms;
+	for (size_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		for (size_t idx = 0; idx < terms[col_idx].size(); ++idx) {
+			if (term_types[col_idx][idx] != LOW_DF) continue;
+			const CompiledTerm& compiled_term = terms[col_idx][idx];
+			uint64_t term_idx = compiled_term.partition_term_ids[partition_id];
+
+			uint64_t df = compiled_term.df;
+			uint64_t df_partition = IP->II[col_idx].doc_freqs[term_idx];
+
+			if (df == 0 || df > query_max_df || df_partition == 0) continue;
+
+			LowDFTerm term;
+			term.col_idx      = col_idx;
+			term.term_idx     = term_idx;
+			term.df_partition = df_partition;
+			term.idf          = compiled_term.idf;
+			term.upper_bound  = max(0.0f, term.idf * boost_factors[col_idx]);
+			low_df_terms.push_back(term);
+		}
+	}
+	std::stable_sort(
+			low_df_terms.begin(), 
+			low_df_terms.end(), 
+			[](const LowDFTerm& a, const LowDFTerm& b) {
+				return a.upper_bound > b.upper_bound;
+			});
+
+	std::vector<float> remaining_upper_bound(low_df_terms.size() + 1, 0.0f);
+	for (int64_t i = (int64_t)low_df_terms.size() - 1; i >= 0; --i) {
+		remaining_upper_bound[i] = remaining_upper_bound[i + 1] + low_df_terms[i].upper_bound;
+	}
+
+	// Highest impact terms go first, so a query cut short by its deadline
+	// keeps the contributions that matter most.
+	bool expired = false;
+	for (size_t term_num = 0; term_num < low_df_terms.size() && !expired; ++term_num) {
+		const LowDFTerm& term = low_df_terms[term_num];
+		InvertedIndexNew* II  = &IP->II[term.col_idx];
+
+		bool skip_new_docs = (shared_threshold != NULL) && 
+			(remaining_upper_bound[term_num] < shared_threshold->load(std::memory_order_relaxed));
+
+		// Loaded with a postings cache, only the blocks of this term's postings are read.
+		BlockCursor cursor = get_postings_cursor(II, term.term_idx);
+
+		for (uint64_t block_start = 0; block_start < term.df_partition; block_start += DEADLINE_CHECK_BLOCK_SIZE) {
+			if (query_expired(deadline)) {
+				expired = true;
+				break;
+			}
+			uint64_t block_end = min(block_start + DEADLINE_CHECK_BLOCK_SIZE, term.df_partition);
+
+			partition_stats.postings_scanned += block_end - block_start;
+			partition_stats.bytes_decoded    += (block_end - block_start) * sizeof(tf_df_t);
+
+			uint64_t postings_end = II->term_offsets[term.term_idx] + block_end;
+			for (uint64_t idx = II->term_offsets[term.term_idx] + block_start, span_end; idx < postings_end; idx = span_end) {
+				const tf_df_t* postings = get_postings(II, cursor, index_data, idx, postings_end, &span_end);
+				uint64_t num_postings = span_end - idx;
+
+				for (uint64_t i = 0; i < num_postings; ++i) {
+					float    tf 	= (float)postings[i].tf;
+					uint64_t doc_id = (uint64_t)postings[i].doc_id;
+					prefetch_doc_size(II, postings, i, num_postings);
+
+					// if (doc_id == IP->num_docs) continue;
+					assert(doc_id < IP->num_docs);
+
+					auto it = doc_scores.find(doc_id + doc_offset);
+					if (it == doc_scores.end() && skip_new_docs) continue;
+
+					float bm25_score = _compute_bm25(
+							doc_id, 
+							tf, 
+							term.idf, 
+							term.col_idx, 
+							partition_id
+							) * boost_factors[term.col_idx];
+
+					if (it == doc_scores.end()) {
+						doc_scores[doc_id + doc_offset] = bm25_score;
+					}
+					else {
+						it->second += bm25_score;
+					}
+				}
+			}
+		}
+	}
+
+	partition_stats.candidates  = doc_scores.size();
+	partition_stats.approximate = expired;
+	if (stats != NULL) {
+		add_query_stats(stats, &partition_stats);
+	}
+
+	return get_partition_topk(
+			doc_scores, 
+			k, 
+			partition_id, 
+			shared_threshold, 
+			IP->deleted_docs, 
+			doc_offset
+			);
+}
+
+std::vector<std::vector<BM25Result>> _BM25::_query_partition_shared_scan(
+		const std::vector<CompiledQuery>& queries,
+		size_t query_start,
+		size_t query_end,
+		uint32_t k,
+		uint32_t query_max_df,
+		uint16_t partition_id,
+		const std::vector<float>& boost_factors,
+		std::atomic<float>* shared_thresholds,
+		QueryStats* stats
+		) {
+	BM25PartitionNew* IP = &index_partitions[partition_id];
+
+	uint64_t doc_offset = (file_type == IN_MEMORY) ? partition_boundaries[partition_id] : 0;
+
+	const size_t num_queries = query_end - query_start;
+	std::vector<std::vector<BM25Result>> results(num_queries);
+
+	// Group the block's queries by term. Each posting list is then walked once
+	// and its scores fanned out to every query containing the term.
+	typedef struct {
+		float idf;
+		std::vector<std::pair<uint32_t, float>> queries;
+	} SharedTerm;
+
+	std::vector<MAP<uint64_t, SharedTerm>> shared_terms(search_cols.size());
+
+	for (size_t query_idx = 0; query_idx < num_queries; ++query_idx) {
+		const CompiledQuery& query = queries[query_start + query_idx];
+
+		std::vector<std::vector<TermType>> term_types(search_cols.size());
+		for (size_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+			for (const CompiledTerm& term : query.terms[col_idx]) {
+				term_types[col_idx].push_back(get_query_term_type(term, partition_id));
+			}
+		}
+
+		for (size_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+			for (size_t idx = 0; idx < query.terms[col_idx].size(); ++idx) {
+				if (term_types[col_idx][idx] != LOW_DF) continue;
+
+				const CompiledTerm& compiled_term = query.terms[col_idx][idx];
+				if (compiled_term.df == 0 || compiled_term.df > query_max_df) continue;
+
+				SharedTerm& term = shared_terms[col_idx][compiled_term.partition_term_ids[partition_id]];
+				term.idf = compiled_term.idf;
+				stats[query_idx].partitions_touched = 1;
+
+				// Repeated query terms score once per occurrence.
+				if (!term.queries.empty() && term.queries.back().first == (uint32_t)query_idx) {
+					term.queries.back().second += 1.0f;
+				} else {
+					term.queries.emplace_back((uint32_t)query_idx, 1.0f);
+				}
+			}
+		}
+	}
+
+	std::vector<MAP<uint64_t, float>> doc_scores(num_queries);
+
+	for (size_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		InvertedIndexNew* II = &IP->II[col_idx];
+
+		for (const auto& [term_idx, term] : shared_terms[col_idx]) {
+			uint64_t df_partition = II->doc_freqs[term_idx];
+			if (df_partition == 0) continue;
+
+			float idf = term.idf;
+
+			// Each query is charged the full scan, i.e. what it would cost on its own.
+			for (const auto& [query_idx, weight] : term.queries) {
+				stats[query_idx].postings_scanned += df_partition;
+				stats[query_idx].bytes_decoded    += df_partition * sizeof(tf_df_t);
+			}
+
+			BlockCursor cursor = get_postings_cursor(II, term_idx);
+
+			uint64_t postings_end = II->term_offsets[term_idx] + df_partition;
+			for (uint64_t idx = II->term_offsets[term_idx], span_end; idx < postings_end; idx = span_end) {
+				const tf_df_t* postings = get_postings(II, cursor, index_data, idx, postings_end, &span_end);
+				uint64_t num_postings = span_end - idx;
+
+				for (uint64_t i = 0; i < num_postings; ++i) {
+					float    tf 	= (float)postings[i].tf;
+					uint64_t doc_id = (uint64_t)postings[i].doc_id;
+					prefetch_doc_size(II, postings, i, num_postings);
+
+					assert(doc_id < IP->num_docs);
+
+					float bm25_score = _compute_bm25(
+							doc_id, 
+							tf, 
+							idf, 
+							col_idx, 
+							partition_id
+							) * boost_factors[col_idx];
+
+					doc_id += doc_offset;
+					for (const auto& [query_idx, weight] : term.queries) {
+						doc_scores[query_idx][doc_id] += bm25_score * weight;
+					}
+				}
+			}
+		}
+	}
+
+	for (size_t query_idx = 0; query_idx < num_queries; ++query_idx) {
+		if (doc_scores[query_idx].size() == 0) continue;
+
+		stats[query_idx].candidates += doc_scores[query_idx].size();
+		results[query_idx] = get_partition_topk(
+				doc_scores[query_idx], 
+				k, 
+				partition_id, 
+				&shared_thresholds[query_start + query_idx],
+				IP->deleted_docs,
+				doc_offset
+				);
+	}
+
+	return results;
+}
+
+std::vector<BM25Result> _BM25::query(
+		std::string& query,
+		uint32_t top_k,
+		uint32_t query_max_df,
+		std::vector<float> boost_factors,
+		uint64_t deadline_us,
+		bool* approximate
+		) {
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	QueryDeadline deadline = get_query_deadline(deadline_us);
+
+	QueryStats stats;
+	init_query_stats(&stats);
+	validate_boost_factors(boost_factors);
+
+	CompiledQuery compiled = compile_query(query);
+	stats.phase_ns[PHASE_TOKENIZE] = elapsed_ns(start);
+
+	std::vector<BM25Result> result = _query_multi_cached(
+			compiled, 
+			top_k, 
+			query_max_df, 
+			boost_factors, 
+			&stats, 
+			&deadline
+			);
+
+	stats.total_ns = elapsed_ns(start);
+	query_stats.record(stats);
+
+	if (approximate != NULL) {
+		*approximate = stats.approximate;
+	}
+	return result;
+}
+
+
+// Uppercased, space separated terms. Empty terms never match the vocab and are dropped.
+static std::vector<std::string> tokenize_query(const std::string& query) {
+	std::vector<std::string> terms;
+	std::string substr = "";
+
+	for (const char& c : query) {
+		if (c != ' ') {
+			substr += toupper(c);
+			continue;
+		}
+
+		if (!substr.empty()) {
+			terms.push_back(substr);
+			substr.clear();
+		}
+	}
+
+	if (!substr.empty()) {
+		terms.push_back(substr);
+	}
+	return terms;
+}
+
+void _BM25::resolve_query_term(CompiledTerm& term, uint16_t col_idx) {
+	// Loaded partitions share one hasher and built ones another. A loaded index
+	// with appended segments has both, so hash the term once per kind.
+	term.hash = hash_vocab_term(&index_partitions[0], col_idx, term.term);
+	term.df   = 0;
+	term.partition_term_ids.resize(num_partitions, UINT32_MAX);
+
+	bool     is_frozen = (index_partitions[0].frozen_vocabs != NULL);
+	uint64_t other_hash = 0;
+	bool     has_other_hash = false;
+
+	bool is_stop_word = (stop_words.find(term.term) != stop_words.end());
+
+	for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+		BM25PartitionNew* IP = &index_partitions[partition_id];
+
+		uint64_t hash = term.hash;
+		if ((IP->frozen_vocabs != NULL) != is_frozen) {
+			if (!has_other_hash) {
+				other_hash     = hash_vocab_term(IP, col_idx, term.term);
+				has_other_hash = true;
+			}
+			hash = other_hash;
+		}
+
+		uint32_t term_idx = find_vocab_term(IP, col_idx, term.term, hash);
+		if (term_idx == UINT32_MAX) continue;
+
+		term.df += IP->II[col_idx].doc_freqs[term_idx];
+		if (!is_stop_word) {
+			term.partition_term_ids[partition_id] = term_idx;
+		}
+	}
+
+	term.idf = log((num_docs - term.df + 0.5f) / (term.df + 0.5f));
+}
+
+CompiledQuery _BM25::compile_query(const std::string& query) {
+	// Same text searched in every column. Tokenize it once.
+	std::vector<std::string> tokens = tokenize_query(query);
+
+	CompiledQuery compiled;
+	compiled.terms.resize(search_cols.size());
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		compiled.terms[col_idx].resize(tokens.size());
+		for (size_t idx = 0; idx < tokens.size(); ++idx) {
+			compiled.terms[col_idx][idx].term = tokens[idx];
+			resolve_query_term(compiled.terms[col_idx][idx], col_idx);
+		}
+	}
+	return compiled;
+}
+
+CompiledQuery _BM25::compile_query(const std::vector<std::string>& query) {
+	if (query.size() != search_cols.size()) {
+		std::cout << "Error: Query must have one entry per search field." << std::endl;
+		std::cout << "Number of search fields: " << search_cols.size() << std::endl;
+		std::cout << "Number of query fields: " << query.size() << std::endl;
+		std::exit(1);
+	}
+
+	CompiledQuery compiled;
+	compiled.terms.resize(search_cols.size());
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		std::vector<std::string> tokens = tokenize_query(query[col_idx]);
+
+		compiled.terms[col_idx].resize(tokens.size());
+		for (size_t idx = 0; idx < tokens.size(); ++idx) {
+			compiled.terms[col_idx][idx].term = std::move(tokens[idx]);
+			resolve_query_term(compiled.terms[col_idx][idx], col_idx);
+		}
+	}
+	return compiled;
+}
+
+void _BM25::validate_boost_factors(std::vector<float>& boost_factors) {
+	if (boost_factors.size() == 0) {
+		boost_factors.resize(search_cols.size(), 1.0f);
+	}
+
+	if (boost_factors.size() != search_cols.size()) {
+		std::cout << "Error: Boost factors must be the same size as the number of search fields." << std::endl;
+		std::cout << "Number of search fields: " << search_cols.size() << std::endl;
+		std::cout << "Number of boost factors: " << boost_factors.size() << std::endl;
+		std::exit(1);
+	}
+}
+
+static std::vector<BM25Result> merge_partition_results(
+		const std::vector<BM25Result>* partition_results,
+		size_t num_results,
+		uint32_t k
+		) {
+	// Partition results are sorted by descending score. Merge the runs.
+	return topk_merge_sorted_runs(partition_results, num_results, k);
+}
+
+QueryDeadline _BM25::get_query_deadline(uint64_t deadline_us) {
+	QueryDeadline deadline;
+	deadline.has_deadline  = (deadline_us > 0);
+	deadline.deadline      = std::chrono::steady_clock::now() + std::chrono::microseconds(deadline_us);
+	deadline.epoch         = query_epoch.load(std::memory_order_relaxed);
+	deadline.current_epoch = &query_epoch;
+	return deadline;
+}
+
+void _BM25::cancel_queries() {
+	// Every query started before this call sees a stale epoch and stops.
+	query_epoch.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::vector<BM25Result> _BM25::query_multi(
+		std::vector<std::string>& query,
+		uint32_t k,
+		uint32_t query_max_df,
+		std::vector<float> boost_factors,
+		uint64_t deadline_us,
+		bool* approximate
+		) {
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	QueryDeadline deadline = get_query_deadline(deadline_us);
+
+	QueryStats stats;
+	init_query_stats(&stats);
+	validate_boost_factors(boost_factors);
+
+	CompiledQuery compiled = compile_query(query);
+	stats.phase_ns[PHASE_TOKENIZE] = elapsed_ns(start);
+
+	std::vector<BM25Result> result = _query_multi_cached(
+			compiled, 
+			k, 
+			query_max_df, 
+			boost_factors, 
+			&stats, 
+			&deadline
+			);
+
+	stats.total_ns = elapsed_ns(start);
+	query_stats.record(stats);
+
+	if (approximate != NULL) {
+		*approximate = stats.approximate;
+	}
+	return result;
+}
+
+std::vector<BM25Result> _BM25::_query_multi_cached(
+		const CompiledQuery& query,
+		uint32_t k,
+		uint32_t query_max_df,
+		const std::vector<float>& boost_factors,
+		QueryStats* stats,
+		const QueryDeadline* deadline
+		) {
+	if (query_cache == NULL) {
+		return _query_multi(query, k, query_max_df, boost_factors, stats, deadline);
+	}
+
+	QueryCacheEntry entry;
+	std::string cache_key = get_query_cache_key(query, k, query_max_df, boost_factors);
+	if (query_cache->get(cache_key, entry)) {
+		return entry.results;
+	}
+
+	QueryStats local_stats;
+	if (stats == NULL) {
+		init_query_stats(&local_stats);
+		stats = &local_stats;
+	}
+
+	entry.results  = _query_multi(query, k, query_max_df, boost_factors, stats, deadline);
+	entry.has_rows = false;
+
+	// Partial results must not be served to later, unhurried queries.
+	if (!stats->approximate) {
+		query_cache->put(cache_key, entry);
+	}
+
+	return entry.results;
+}
+
+std::vector<BM25Result> _BM25::_query_multi(
+		const CompiledQuery& query,
+		uint32_t k,
+		uint32_t query_max_df,
+		const std::vector<float>& boost_factors,
+		QueryStats* stats,
+		const QueryDeadline* deadline
+		) {
+	if (k == 0) {
+		return std::vector<BM25Result>();
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	std::vector<std::thread> threads;
+	std::vector<std::vector<BM25Result>> results(num_partitions);
+
+	std::vector<QueryStats> partition_stats(num_partitions);
+	for (QueryStats& _stats : partition_stats) {
+		init_query_stats(&_stats);
+	}
+
+	// k-th best score published by any finished partition. Used for pruning.
+	std::atomic<float> shared_threshold(-FLT_MAX);
+
+	// _query_partition on each thread
+	for (uint16_t i = 0; i < num_partitions; ++i) {
+		threads.push_back(std::thread(
+			[this, &query, k, query_max_df, i, &results, &boost_factors, &shared_threshold, &partition_stats, deadline] {
+				// Score on the partition's node, so postings are read from local memory.
+				NumaAffinity affinity(index_partitions[i].numa_node);
+				results[i] = _query_partition_bloom_multi(
+						query, 
+						k, 
+						query_max_df, 
+						i, 
+						boost_factors,
+						&shared_threshold,
+						&partition_stats[i],
+						deadline
+						);
 			}
-		}
+		));
+	}
 
-		global_prev_doc_id = doc_id;
+	for (auto& thread : threads) {
+		thread.join();
 	}
+	uint64_t score_ns = elapsed_ns(start);
 
-	std::vector<BM25Result> result(top_k_docs.size());
-	int idx = top_k_docs.size() - 1;
-	while (!top_k_docs.empty()) {
-		result[idx] = top_k_docs.top();
-		top_k_docs.pop();
-		--idx;
+	auto merge_start = std::chrono::high_resolution_clock::now();
+	std::vector<BM25Result> result = merge_partition_results(
+			results.data(), 
+			results.size(), 
+			k
+			);
+
+	if (stats != NULL) {
+		for (const QueryStats& _stats : partition_stats) {
+			add_query_stats(stats, &_stats);
+		}
+		stats->phase_ns[PHASE_SCORE] = score_ns;
+		stats->phase_ns[PHASE_MERGE] = elapsed_ns(merge_start);
 	}
 
 	return result;
 }
-*/
 
-std::vector<std::vector<std::pair<std::string, std::string>>> _BM25::get_topk_internal(
+
+QueryExplanation _BM25::explain(
 		std::string& query,
-		uint32_t top_k,
+		uint32_t k,
 		uint32_t query_max_df,
 		std::vector<float> boost_factors
 		) {
-	std::vector<std::string> copied_query(search_cols.size(), query);
-	return get_topk_internal_multi(
-			copied_query, 
-			top_k, 
-			query_max_df, 
-			boost_factors
-			);
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
+
+	validate_boost_factors(boost_factors);
+	return _explain(compile_query(query), k, query_max_df, boost_factors);
 }
 
-std::vector<BM25Result> _BM25::_query_partition_bloom_multi(
+QueryExplanation _BM25::explain_multi(
 		std::vector<std::string>& query,
 		uint32_t k,
 		uint32_t query_max_df,
-		uint16_t partition_id,
-		std::vector<float> boost_factors,
-		std::vector<std::vector<uint64_t>> doc_freqs
+		std::vector<float> boost_factors
 		) {
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
 
-	std::vector<MAP<uint64_t, BloomEntry>> bloom_entries(search_cols.size());
-
-	BM25PartitionNew* IP = &index_partitions[partition_id];
-
-	uint64_t doc_offset = (file_type == IN_MEMORY) ? partition_boundaries[partition_id] : 0;
-
-	std::vector<std::vector<uint64_t>> term_idxs(search_cols.size());
-	std::vector<std::vector<TermType>> term_types(search_cols.size());
-	for (size_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-		std::string& q = query[col_idx];
-		std::string substr = "";
+	validate_boost_factors(boost_factors);
+	return _explain(compile_query(query), k, query_max_df, boost_factors);
+}
 
-		for (const char& c : q) {
-			if (c != ' ') {
-				substr += toupper(c);
-				continue;
-			}
+QueryExplanation _BM25::_explain(
+		const CompiledQuery& query,
+		uint32_t k,
+		uint32_t query_max_df,
+		const std::vector<float>& boost_factors
+		) {
+	QueryExplanation explanation;
 
-			TermType term_type = add_query_term_bloom(
-					substr, 
-					term_idxs,
-					bloom_entries,
-					partition_id,
-					col_idx
-					);	
-			term_types[col_idx].push_back(term_type);
-		}
+	// Rank exactly as query_multi does, bypassing the cache.
+	explanation.results = _query_multi(query, k, query_max_df, boost_factors);
 
-		if (!substr.empty()) {
-			TermType term_type = add_query_term_bloom(
-					substr, 
-					term_idxs,
-					bloom_entries,
-					partition_id,
-					col_idx
-					);	
-			term_types[col_idx].push_back(term_type);
-		}
+	// Result index of each returned doc, per partition.
+	std::vector<MAP<uint64_t, uint32_t>> result_idxs(num_partitions);
+	for (uint32_t idx = 0; idx < explanation.results.size(); ++idx) {
+		const BM25Result& result = explanation.results[idx];
+		result_idxs[result.partition_id][result.doc_id] = idx;
 	}
-	assert(term_idxs.size() == doc_freqs.size());
 
-	uint16_t num_low_df_terms  = 0;
-	uint16_t num_high_df_terms = 0;
-	for (size_t col_idx = 0; col_idx < term_idxs.size(); ++col_idx) {
-		assert(term_idxs[col_idx].size() == doc_freqs[col_idx].size());
+	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
+		for (const CompiledTerm& term : query.terms[col_idx]) {
+			TermExplanation term_explanation;
+			term_explanation.term           = term.term;
+			term_explanation.col_idx        = col_idx;
+			term_explanation.df             = term.df;
+			term_explanation.idf            = term.idf;
+			term_explanation.is_stop_word   = (stop_words.find(term.term) != stop_words.end());
+			term_explanation.exceeds_max_df = (term.df > query_max_df);
+			term_explanation.walk_ns        = 0;
+			term_explanation.partition_posting_lengths.resize(num_partitions, 0);
+			term_explanation.doc_contributions.resize(explanation.results.size(), 0.0f);
+
+			auto start = std::chrono::high_resolution_clock::now();
+
+			for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+				if (get_query_term_type(term, partition_id) == UNKNOWN) continue;
+
+				BM25PartitionNew* IP = &index_partitions[partition_id];
+				InvertedIndexNew* II = &IP->II[col_idx];
+
+				uint32_t term_idx = term.partition_term_ids[partition_id];
+				uint64_t df_partition = II->doc_freqs[term_idx];
+				term_explanation.partition_posting_lengths[partition_id] = df_partition;
+
+				// Same cutoff as scoring. The term adds nothing to any doc.
+				if (term.df == 0 || term.df > query_max_df) continue;
+
+				uint64_t doc_offset = (file_type == IN_MEMORY) ? partition_boundaries[partition_id] : 0;
+				const MAP<uint64_t, uint32_t>& partition_result_idxs = result_idxs[partition_id];
+
+				BlockCursor cursor = get_postings_cursor(II, term_idx);
+
+				uint64_t postings_end = II->term_offsets[term_idx] + df_partition;
+				for (uint64_t idx = II->term_offsets[term_idx], span_end; idx < postings_end; idx = span_end) {
+					const tf_df_t* postings = get_postings(II, cursor, index_data, idx, postings_end, &span_end);
+
+					for (uint64_t i = 0; i < span_end - idx; ++i) {
+						float    tf 	= (float)postings[i].tf;
+						uint64_t doc_id = (uint64_t)postings[i].doc_id;
+
+						float bm25_score = _compute_bm25(
+								doc_id, 
+								tf, 
+								term.idf, 
+								col_idx, 
+								partition_id
+								) * boost_factors[col_idx];
 
-		for (size_t term_idx = 0; term_idx < term_idxs[col_idx].size(); ++term_idx) {
-			TermType term_type = term_types[col_idx][term_idx];
-			if (term_type == LOW_DF) {
-				++num_low_df_terms;
-			} else if (term_type == HIGH_DF) {
-				++num_high_df_terms;
+						auto it = partition_result_idxs.find(doc_id + doc_offset);
+						if (it != partition_result_idxs.end()) {
+							term_explanation.doc_contributions[it->second] += bm25_score;
+						}
+					}
+				}
 			}
+			term_explanation.walk_ns = elapsed_ns(start);
+
+			explanation.terms.push_back(term_explanation);
 		}
 	}
-	if (num_low_df_terms + num_high_df_terms == 0) return std::vector<BM25Result>();
-
-	// Score low_df terms first.
-	MAP<uint64_t, float> doc_scores;
 
-	for (size_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-		InvertedIndexNew* II = &IP->II[col_idx];
+	return explanation;
+}
 
-		for (size_t idx = 0; idx < term_idxs[col_idx].size(); ++idx) {
-			if (term_types[col_idx][idx] != LOW_DF) continue;
-			uint64_t term_idx = term_idxs[col_idx][idx];
 
-			uint64_t df = doc_freqs[col_idx][idx];
-			uint64_t df_partition = IP->II[col_idx].doc_freqs[term_idx];
+BM25BatchResult _BM25::query_batch(
+		std::vector<std::string>& queries,
+		uint32_t k,
+		uint32_t query_max_df,
+		std::vector<float> boost_factors,
+		bool shared_scan
+		) {
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
 
-			if (df == 0 || df > query_max_df || df_partition == 0) continue;
+	validate_boost_factors(boost_factors);
 
-			float idf = log((num_docs - df + 0.5f) / (df + 0.5f));
+	const size_t num_queries = queries.size();
+	const size_t num_threads = max(1, std::thread::hardware_concurrency());
 
-			for (uint64_t i = 0; i < df_partition; ++i) {
+	BM25BatchResult batch;
+	batch.query_offsets.resize(num_queries + 1, 0);
+	if (num_queries == 0) return batch;
 
-				size_t   idx 	= II->term_offsets[term_idx] + i;
-				float    tf 	= (float)II->doc_ids[idx].tf;
-				uint64_t doc_id = (uint64_t)II->doc_ids[idx].doc_id;
+	// Per query stats. Phase times are the CPU time spent on that query across tasks.
+	std::vector<QueryStats> stats(num_queries);
+	for (QueryStats& _stats : stats) {
+		init_query_stats(&_stats);
+	}
 
-				// if (doc_id == IP->num_docs) continue;
-				assert(doc_id < IP->num_docs);
+	// Compile all queries up front so partition tasks only score.
+	std::vector<CompiledQuery> compiled_queries(num_queries);
+	parallel_for(num_queries, num_threads, [&](size_t query_idx) {
+		auto start = std::chrono::high_resolution_clock::now();
+		compiled_queries[query_idx] = compile_query(queries[query_idx]);
+		stats[query_idx].phase_ns[PHASE_TOKENIZE] = elapsed_ns(start);
+	});
 
-				float bm25_score = _compute_bm25(
-						doc_id, 
-						tf, 
-						idf, 
-						col_idx, 
-						partition_id
-						) * boost_factors[col_idx];
+	std::unique_ptr<std::atomic<float>[]> shared_thresholds(new std::atomic<float>[num_queries]);
+	for (size_t query_idx = 0; query_idx < num_queries; ++query_idx) {
+		shared_thresholds[query_idx].store(-FLT_MAX, std::memory_order_relaxed);
+	}
 
-				doc_id += doc_offset;
-				if (doc_scores.find(doc_id) == doc_scores.end()) {
-					doc_scores[doc_id] = bm25_score;
-				}
-				else {
-					doc_scores[doc_id] += bm25_score;
-				}
-			}
-		}
+	std::vector<std::vector<BM25Result>> partition_results(num_queries * num_partitions);
+	std::vector<QueryStats> partition_stats(num_queries * num_partitions);
+	for (QueryStats& _stats : partition_stats) {
+		init_query_stats(&_stats);
 	}
 
-	// Now score high_df terms
-	if (num_high_df_terms > 0) {
-		if (doc_scores.size() == 0) {
-			// Sort high_df_term_idxs by df.
-			// Get top-k docs for lowest df term. Then use bloom scoring for the rest.
-			std::vector<uint32_t> df_values;
-			uint32_t min_df = UINT32_MAX;
-			uint16_t min_df_col_idx  = UINT16_MAX;
-			uint16_t min_df_idx 	 = UINT16_MAX;
+	if (shared_scan) {
+		// One task per (query block, partition) pair. Queries in a block share posting scans.
+		const size_t num_blocks = (num_queries + SHARED_SCAN_BLOCK_SIZE - 1) / SHARED_SCAN_BLOCK_SIZE;
+		parallel_for(num_blocks * num_partitions, num_threads, [&](size_t task_idx) {
+			size_t   block_idx    = task_idx / num_partitions;
+			uint16_t partition_id = (uint16_t)(task_idx % num_partitions);
 
-			for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-				for (uint64_t idx = 0; idx < doc_freqs[col_idx].size(); ++idx) {
-					TermType term_type = term_types[col_idx][idx];
+			size_t query_start = block_idx * SHARED_SCAN_BLOCK_SIZE;
+			size_t query_end   = min(query_start + SHARED_SCAN_BLOCK_SIZE, num_queries);
 
-					if (term_type != HIGH_DF) continue;
+			auto start = std::chrono::high_resolution_clock::now();
 
-						uint32_t df = doc_freqs[col_idx][idx];
-						if (df < min_df) {
-							min_df_col_idx = col_idx;
-							min_df_idx 	   = idx;
-							min_df 		   = df;
-						}
-						df_values.push_back(df);
-				}
+			std::vector<QueryStats> block_stats(query_end - query_start);
+			for (QueryStats& _stats : block_stats) {
+				init_query_stats(&_stats);
 			}
 
-			assert(min_df_col_idx  != UINT16_MAX);
-			assert(min_df_idx 	   != UINT16_MAX);
-
-			// First score the term with the lowest df.
-			float idf = log((num_docs - min_df + 0.5) / (min_df + 0.5));
-			BloomEntry& bloom_entry = bloom_entries[min_df_col_idx][min_df_idx];
-			for (uint64_t i = 0; i < bloom_entry.topk_doc_ids.size(); ++i) {
-				uint64_t doc_id  = bloom_entry.topk_doc_ids[i];
-				float tf 		 = (float)bloom_entry.topk_term_freqs[i];
-				float bm25_score = _compute_bm25(
-						doc_id, 
-						tf, 
-						idf, 
-						min_df_col_idx,
-						partition_id
-						) * boost_factors[min_df_col_idx];
-
-				doc_id += doc_offset;
-				if (doc_scores.find(doc_id) == doc_scores.end()) {
-					doc_scores[doc_id] = bm25_score;
-				}
-				else {
-					doc_scores[doc_id] += bm25_score;
-				}
-			}
+			std::vector<std::vector<BM25Result>> block_results = _query_partition_shared_scan(
+					compiled_queries,
+					query_start,
+					query_end,
+					k,
+					query_max_df,
+					partition_id,
+					boost_factors,
+					shared_thresholds.get(),
+					block_stats.data()
+					);
 
-			// Now score the rest using bloom filters.
-			for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-				for (uint16_t idx = 0; idx < term_idxs[col_idx].size(); ++idx) {
-					if (term_types[col_idx][idx] != HIGH_DF) continue;
-					if (col_idx == min_df_col_idx && idx == min_df_idx) continue;
-
-					const uint64_t& term_idx = term_idxs[col_idx][idx];
-					BloomEntry& bloom_entry  = bloom_entries[col_idx][term_idx];
-
-					float df  = doc_freqs[col_idx][idx];
-					float idf = log((num_docs - df + 0.5) / (df + 0.5));
-
-					for (auto& [doc_id, score] : doc_scores) {
-						for (const auto& [tf, bf] : bloom_entry.bloom_filters) {
-							if (bloom_query(bf, doc_id)) {
-								score += _compute_bm25(
-										doc_id, 
-										(float)tf,
-										idf, 
-										col_idx,
-										partition_id
-										) * boost_factors[col_idx];
-								break;
-							}
-						}
-					}
-				}
-			}
-		} else {
+			// Scan time is shared, so split it evenly across the block's queries.
+			uint64_t query_ns = elapsed_ns(start) / (query_end - query_start);
+			for (size_t query_idx = query_start; query_idx < query_end; ++query_idx) {
+				size_t result_idx = query_idx * num_partitions + partition_id;
 
-			for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-				for (uint16_t idx = 0; idx < term_idxs[col_idx].size(); ++idx) {
-					if (term_types[col_idx][idx] != HIGH_DF) continue;
-
-					const uint64_t& term_idx = term_idxs[col_idx][idx];
-					BloomEntry& bloom_entry  = bloom_entries[col_idx][term_idx];
-
-					float df  = doc_freqs[col_idx][idx];
-					float idf = log((num_docs - df + 0.5) / (df + 0.5));
-
-					for (auto& [doc_id, score] : doc_scores) {
-						for (const auto& [tf, bf] : bloom_entry.bloom_filters) {
-							if (bloom_query(bf, doc_id)) {
-								score += _compute_bm25(
-										doc_id, 
-										(float)tf,
-										idf, 
-										col_idx,
-										partition_id
-										) * boost_factors[col_idx];
-								break;
-							}
-						}
-					}
-				}
+				partition_results[result_idx] = std::move(block_results[query_idx - query_start]);
+				partition_stats[result_idx]   = block_stats[query_idx - query_start];
+				partition_stats[result_idx].phase_ns[PHASE_SCORE] = query_ns;
 			}
-		}
-	}
-
-	if (doc_scores.size() == 0) {
-		return std::vector<BM25Result>();
+		});
+	} else {
+		// One task per (query, partition) pair.
+		parallel_for(num_queries * num_partitions, num_threads, [&](size_t task_idx) {
+			size_t   query_idx    = task_idx / num_partitions;
+			uint16_t partition_id = (uint16_t)(task_idx % num_partitions);
+
+			auto start = std::chrono::high_resolution_clock::now();
+			partition_results[task_idx] = _query_partition_bloom_multi(
+					compiled_queries[query_idx],
+					k,
+					query_max_df,
+					partition_id,
+					boost_factors,
+					&shared_thresholds[query_idx],
+					&partition_stats[task_idx]
+					);
+			partition_stats[task_idx].phase_ns[PHASE_SCORE] = elapsed_ns(start);
+		});
 	}
 
-	std::priority_queue<
-		BM25Result,
-		std::vector<BM25Result>,
-		_compare_bm25_result> top_k_docs;
-
-	for (const auto& pair : doc_scores) {
-		BM25Result result;
-		result.doc_id = pair.first;
-		result.score  = pair.second;
-		result.partition_id = partition_id;
+	std::vector<std::vector<BM25Result>> query_results(num_queries);
+	parallel_for(num_queries, num_threads, [&](size_t query_idx) {
+		auto start = std::chrono::high_resolution_clock::now();
+		query_results[query_idx] = merge_partition_results(
+				&partition_results[query_idx * num_partitions],
+				num_partitions,
+				k
+				);
+		stats[query_idx].phase_ns[PHASE_MERGE] = elapsed_ns(start);
+	});
+
+	for (size_t query_idx = 0; query_idx < num_queries; ++query_idx) {
+		QueryStats& _stats = stats[query_idx];
+		for (uint16_t partition_id = 0; partition_id < num_partitions; ++partition_id) {
+			const QueryStats& task_stats = partition_stats[query_idx * num_partitions + partition_id];
+			add_query_stats(&_stats, &task_stats);
+			_stats.phase_ns[PHASE_SCORE] += task_stats.phase_ns[PHASE_SCORE];
+		}
 
-		if (top_k_docs.size() < k) {
-			top_k_docs.push(result);
-		} else {
-			if (result.score > top_k_docs.top().score) {
-				top_k_docs.pop();
-				top_k_docs.push(result);
-			}
+		for (int phase = 0; phase < NUM_QUERY_PHASES; ++phase) {
+			_stats.total_ns += _stats.phase_ns[phase];
 		}
+		query_stats.record(_stats);
 	}
 
-	std::vector<BM25Result> result(top_k_docs.size());
-	int idx = top_k_docs.size() - 1;
-	while (!top_k_docs.empty()) {
-		result[idx] = top_k_docs.top();
-		top_k_docs.pop();
-		--idx;
+	for (size_t query_idx = 0; query_idx < num_queries; ++query_idx) {
+		batch.query_offsets[query_idx + 1] = batch.query_offsets[query_idx] + query_results[query_idx].size();
 	}
 
-	return result;
-}
+	uint64_t total_results = batch.query_offsets[num_queries];
+	batch.doc_ids.resize(total_results);
+	batch.scores.resize(total_results);
+	batch.partition_ids.resize(total_results);
 
-std::vector<BM25Result> _BM25::query(
-		std::string& query,
-		uint32_t top_k,
-		uint32_t query_max_df,
-		std::vector<float> boost_factors
-		) {
-	std::vector<std::string> copied_query(search_cols.size(), query);
-	return query_multi(
-			copied_query, 
-			top_k, 
-			query_max_df, 
-			boost_factors
-			);
+	for (size_t query_idx = 0; query_idx < num_queries; ++query_idx) {
+		uint64_t offset = batch.query_offsets[query_idx];
+		for (const BM25Result& result : query_results[query_idx]) {
+			batch.doc_ids[offset]       = result.doc_id;
+			batch.scores[offset]        = result.score;
+			batch.partition_ids[offset] = result.partition_id;
+			++offset;
+		}
+	}
+
+	return batch;
 }
 
 
-std::vector<BM25Result> _BM25::query_multi(
+std::vector<std::vector<std::pair<std::string, std::string>>> _BM25::get_topk_internal_multi(
 		std::vector<std::string>& query,
-		uint32_t k,
+		uint32_t top_k,
 		uint32_t query_max_df,
-		std::vector<float> boost_factors
+		std::vector<float> boost_factors,
+		const std::vector<std::string>& column_names,
+		uint64_t deadline_us,
+		bool* approximate
 		) {
-	auto start = std::chrono::high_resolution_clock::now();
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
 
-	std::vector<std::vector<uint64_t>> doc_freqs(search_cols.size());
-	for (uint16_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-		std::string& q = query[col_idx];
-		std::string substr = "";
+	auto start = std::chrono::high_resolution_clock::now();
+	QueryDeadline deadline = get_query_deadline(deadline_us);
 
-		for (const char& c : q) {
-			if (c != ' ') {
-				substr += toupper(c);
-				continue;
-			} else {
-				uint64_t df_sum = get_doc_freqs_sum(substr, col_idx);
-				doc_freqs[col_idx].push_back(df_sum);
-				substr.clear();
-			}
-		}
+	QueryStats stats;
+	init_query_stats(&stats);
+	validate_boost_factors(boost_factors);
 
-		if (!substr.empty()) {
-			uint64_t df_sum = get_doc_freqs_sum(substr, col_idx);
-			doc_freqs[col_idx].push_back(df_sum);
-		}
-	}
+	CompiledQuery compiled = compile_query(query);
+	stats.phase_ns[PHASE_TOKENIZE] = elapsed_ns(start);
 
-	if (boost_factors.size() == 0) {
-		boost_factors.resize(search_cols.size());
-		memset(
-				&boost_factors[0],
-				1.0f,
-				search_cols.size() * sizeof(float)
-			  );
-	}
+	// Empty columns fetches whole rows.
+	std::vector<uint16_t> projection = get_column_projection(column_names);
 
-	if (boost_factors.size() != search_cols.size()) {
-		std::cout << "Error: Boost factors must be the same size as the number of search fields." << std::endl;
-		std::cout << "Number of search fields: " << search_cols.size() << std::endl;
-		std::cout << "Number of boost factors: " << boost_factors.size() << std::endl;
-		std::exit(1);
-	}
+	std::vector<std::vector<std::pair<std::string, std::string>>> result = _get_topk_internal(
+			compiled, 
+			top_k, 
+			query_max_df, 
+			boost_factors,
+			column_names.empty() ? NULL : &projection,
+			&stats,
+			&deadline
+			);
 
-	std::vector<std::thread> threads;
-	std::vector<std::vector<BM25Result>> results(num_partitions);
+	stats.total_ns = elapsed_ns(start);
+	query_stats.record(stats);
 
-	// _query_partition on each thread
-	for (uint16_t i = 0; i < num_partitions; ++i) {
-		threads.push_back(std::thread(
-			[this, &query, k, query_max_df, i, &results, boost_factors, doc_freqs] {
-				results[i] = _query_partition_bloom_multi(
-						query, 
-						k, 
-						query_max_df, 
-						i, 
-						boost_factors,
-						doc_freqs
-						);
-			}
-		));
+	if (approximate != NULL) {
+		*approximate = stats.approximate;
 	}
+	return result;
+}
 
-	for (auto& thread : threads) {
-		thread.join();
-	}
+std::vector<std::vector<std::pair<std::string, std::string>>> _BM25::_get_topk_internal(
+		const CompiledQuery& _query,
+		uint32_t top_k,
+		uint32_t query_max_df,
+		const std::vector<float>& boost_factors,
+		const std::vector<uint16_t>* projection,
+		QueryStats* stats,
+		const QueryDeadline* deadline
+		) {
 
-	if (results.size() == 0) {
-		return std::vector<BM25Result>();
+	std::vector<std::vector<std::pair<std::string, std::string>>> result;
+
+	QueryStats local_stats;
+	if (stats == NULL) {
+		init_query_stats(&local_stats);
+		stats = &local_stats;
 	}
 
-	uint64_t total_matching_docs = 0;
+	std::vector<BM25Result> top_k_docs;
 
-	// Join results. Keep global max heap of size k
-	std::priority_queue<
-		BM25Result,
-		std::vector<BM25Result>,
-		_compare_bm25_result> top_k_docs;
+	// Full rows are cached alongside the BM25Results they were fetched for.
+	// Projected rows reuse cached results but are not cached themselves.
+	std::string cache_key;
+	bool cache_hit = false;
+	if (query_cache != NULL) {
+		QueryCacheEntry entry;
+		cache_key = get_query_cache_key(_query, top_k, query_max_df, boost_factors);
+		cache_hit = query_cache->get(cache_key, entry);
 
-	for (const auto& partition_results : results) {
-		total_matching_docs += partition_results.size();
-		for (const auto& pair : partition_results) {
-			top_k_docs.push(pair);
-			if (top_k_docs.size() > k) {
-				top_k_docs.pop();
-			}
+		if (cache_hit && entry.has_rows && projection == NULL) {
+			return entry.rows;
 		}
-	}
-	
-	std::vector<BM25Result> result(top_k_docs.size());
-	int idx = top_k_docs.size() - 1;
-	while (!top_k_docs.empty()) {
-		result[idx] = top_k_docs.top();
-		top_k_docs.pop();
-		--idx;
+		top_k_docs = entry.results;
 	}
 
-	if (DEBUG) {
-		auto end = std::chrono::high_resolution_clock::now();
-		std::chrono::duration<double, std::milli> elapsed_ms = end - start;
-		for (const auto& q : query) {
-			std::cout << "QUERY: " << q;
-		}
-		std::cout << std::endl;
-		std::cout << "Total matching docs: " << total_matching_docs << "    ";
-		std::cout << elapsed_ms.count() << "ms" << std::endl;
-		fflush(stdout);
+	if (!cache_hit) {
+		top_k_docs = _query_multi(_query, top_k, query_max_df, boost_factors, stats, deadline);
 	}
-
-	return result;
-}
-
-
-std::vector<std::vector<std::pair<std::string, std::string>>> _BM25::get_topk_internal_multi(
-		std::vector<std::string>& _query,
-		uint32_t top_k,
-		uint32_t query_max_df,
-		std::vector<float> boost_factors
-		) {
-
-	std::vector<std::vector<std::pair<std::string, std::string>>> result;
-	std::vector<BM25Result> top_k_docs = query_multi(_query, top_k, query_max_df, boost_factors);
 	result.reserve(top_k_docs.size());
 
+	auto fetch_start = std::chrono::high_resolution_clock::now();
+
 	std::vector<std::pair<std::string, std::string>> row;
 	for (size_t i = 0; i < top_k_docs.size(); ++i) {
+		// A document store, when built, replaces the source file.
+		if (!doc_stores.empty()) {
+			row = get_stored_line(top_k_docs[i].doc_id, top_k_docs[i].partition_id, projection);
+			row.push_back(std::make_pair("score", std::to_string(top_k_docs[i].score)));
+			result.push_back(row);
+			continue;
+		}
+
 		switch (file_type) {
 			case CSV:
-				row = get_csv_line(top_k_docs[i].doc_id, top_k_docs[i].partition_id);
+				row = get_csv_line(top_k_docs[i].doc_id, top_k_docs[i].partition_id, projection);
 				break;
 			case JSON:
-				row = get_json_line(top_k_docs[i].doc_id, top_k_docs[i].partition_id);
+				row = get_json_line(top_k_docs[i].doc_id, top_k_docs[i].partition_id, projection);
 				break;
 			case IN_MEMORY:
-				std::cout << "Error: In-memory data not supported for this function." << std::endl;
+				std::cout << "Error: In-memory indexes need a document store to fetch rows." << std::endl;
 				std::exit(1);
 				break;
 			default:
@@ -3964,5 +6365,92 @@ std::vector<std::vector<std::pair<std::string, std::string>>> _BM25::get_topk_in
 		row.push_back(std::make_pair("score", std::to_string(top_k_docs[i].score)));
 		result.push_back(row);
 	}
+
+	stats->phase_ns[PHASE_FETCH] = elapsed_ns(fetch_start);
+
+	// Partial results must not be served to later, unhurried queries.
+	if (stats->approximate) {
+		return result;
+	}
+
+	if (query_cache != NULL && projection == NULL) {
+		QueryCacheEntry entry;
+		entry.results  = top_k_docs;
+		entry.rows     = result;
+		entry.has_rows = true;
+		query_cache->put(cache_key, entry);
+	}
+	else if (query_cache != NULL && !cache_hit) {
+		QueryCacheEntry entry;
+		entry.results  = top_k_docs;
+		entry.has_rows = false;
+		query_cache->put(cache_key, entry);
+	}
+	return result;
+}
+
+BM25SpanResult _BM25::get_topk_spans(
+		std::vector<std::string>& query,
+		uint32_t top_k,
+		uint32_t query_max_df,
+		std::vector<float> boost_factors,
+		const std::vector<std::string>& column_names
+		) {
+	std::shared_lock<std::shared_mutex> lock(index_mutex);
+
+	if (file_type != CSV) {
+		std::cout << "Error: Field spans are only supported for csv files." << std::endl;
+		std::exit(1);
+	}
+	auto start = std::chrono::high_resolution_clock::now();
+
+	QueryStats stats;
+	init_query_stats(&stats);
+	validate_boost_factors(boost_factors);
+
+	CompiledQuery compiled = compile_query(query);
+	stats.phase_ns[PHASE_TOKENIZE] = elapsed_ns(start);
+
+	std::vector<uint16_t> projection = get_column_projection(column_names);
+	if (projection.empty()) {
+		for (uint16_t col_idx = 0; col_idx < columns.size(); ++col_idx) {
+			projection.push_back(col_idx);
+		}
+	}
+
+	uint16_t num_fields = 0;
+	for (const uint16_t& col_idx : projection) {
+		num_fields = max(num_fields, col_idx + 1);
+	}
+
+	BM25SpanResult result;
+	result.num_columns = projection.size();
+	result.results = _query_multi_cached(compiled, top_k, query_max_df, boost_factors, &stats);
+
+	auto fetch_start = std::chrono::high_resolution_clock::now();
+
+	result.offsets.reserve(result.results.size() * projection.size());
+	result.lengths.reserve(result.results.size() * projection.size());
+
+	// Spans point into the mapped source file. Nothing is copied or unquoted.
+	std::vector<FieldSpan> spans;
+	for (const BM25Result& doc : result.results) {
+		get_csv_field_spans(doc.doc_id, doc.partition_id, num_fields, spans);
+
+		for (const uint16_t& col_idx : projection) {
+			if (col_idx < spans.size()) {
+				result.offsets.push_back(spans[col_idx].offset);
+				result.lengths.push_back(spans[col_idx].length);
+			}
+			else {
+				result.offsets.push_back(0);
+				result.lengths.push_back(0);
+			}
+		}
+	}
+	stats.phase_ns[PHASE_FETCH] = elapsed_ns(fetch_start);
+
+	stats.total_ns = elapsed_ns(start);
+	query_stats.record(stats);
 	return result;
 }
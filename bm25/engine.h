@@ -2,14 +2,29 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
 #include <cstdint>
 #include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
 
 #include <parallel_hashmap/phmap.h>
 #include <parallel_hashmap/btree.h>
 // #include "robin_hood.h"
 
 #include "bloom.h"
+#include "query_stats.h"
+#include "doc_store.h"
+#include "index_file.h"
+#include "merge_policy.h"
+#include "memory_usage.h"
+#include "arena.h"
+#include "numa.h"
+#include "external_build.h"
+#include "block_cache.h"
 
 #define MAP phmap::flat_hash_map
 // #define MAP phmap::btree_map
@@ -23,6 +38,12 @@
 
 #define SEED 42
 #define TOKEN_STREAM_CAPACITY 1'048'576
+#define SHARED_SCAN_BLOCK_SIZE 512
+#define DEADLINE_CHECK_BLOCK_SIZE 4096
+#define FOLLOW_INTERVAL_MS 250
+
+// Postings ahead of the one being scored whose doc_sizes entry is prefetched.
+#define DOC_SIZE_PREFETCH_DISTANCE 16
 
 
 enum SupportedFileTypes {
@@ -31,10 +52,20 @@ enum SupportedFileTypes {
 	IN_MEMORY
 };
 
+// UNKNOWN for terms missing from a partition's vocab. Every other term is
+// scored from its postings.
 enum TermType {
 	UNKNOWN,
-	LOW_DF,
-	HIGH_DF
+	LOW_DF
+};
+
+// How a loaded index file is faulted in.
+// NONE pages it in on first use, POPULATE reads it all in at load, LOCK also
+// keeps it resident under memory pressure.
+enum IndexWarmup {
+	WARMUP_NONE,
+	WARMUP_POPULATE,
+	WARMUP_LOCK
 };
 
 
@@ -68,7 +99,8 @@ typedef struct {
 	uint32_t  num_terms;
 } TokenStream;
 
-void init_token_stream(TokenStream* token_stream, const std::string& filename);
+// Buffers come from arena, usually one dropped once the partition is built.
+void init_token_stream(TokenStream* token_stream, const std::string& filename, Arena* arena);
 void add_token(
 		TokenStream* token_stream,
 		uint32_t term_id,
@@ -99,25 +131,98 @@ typedef struct {
 	float     avg_doc_size;
 } InvertedIndexNew;
 
+// Arrays of a built partition live in its arena and go with it.
 void init_inverted_index_new(InvertedIndexNew* II);
 void read_token_stream(
 		InvertedIndexNew* II,
-		TokenStream* token_stream
+		TokenStream* token_stream,
+		Arena* arena
 		);
-void free_inverted_index_new(InvertedIndexNew* II);
-uint64_t calc_inverted_index_size(const InvertedIndexNew* II);
+
+// Term -> term id. Terms are stored in the partition arena. Bucket arrays
+// are counted into the partition's vocab_bytes.
+typedef MAP<
+	std::string_view,
+	uint32_t,
+	phmap::priv::hash_default_hash<std::string_view>,
+	phmap::priv::hash_default_eq<std::string_view>,
+	CountingAllocator<std::pair<const std::string_view, uint32_t>>
+	> VocabMap;
 
 typedef struct {
 	InvertedIndexNew* II;
-	MAP<std::string, uint32_t>* unique_term_mappings;
+	VocabMap* unique_term_mappings;
 	uint64_t* line_offsets;
 
+	// Heap bytes held by unique_term_mappings[col_idx], strings excluded.
+	uint64_t* vocab_bytes;
+
+	// Owns line_offsets, the inverted index arrays and the vocab strings of a
+	// built partition. Freeing the partition unmaps it in one go.
+	Arena* arena;
+
+	// Set when loaded from an index file. Replaces unique_term_mappings.
+	FrozenVocab* frozen_vocabs;
+
+	// Bit i is set once doc i is deleted. NULL until the first delete.
+	// Always owned, also for loaded partitions.
+	uint64_t* deleted_docs;
+	uint64_t  num_deleted;
+
 	uint64_t num_docs;
+
+	// NUMA node the arena places the partition on and its build and query
+	// threads run on.
+	uint16_t numa_node;
 } BM25PartitionNew;
 
-void init_bm25_partition_new(BM25PartitionNew* IP, uint64_t num_docs, uint16_t num_cols);
+void init_bm25_partition_new(BM25PartitionNew* IP, uint64_t num_docs, uint16_t num_cols, uint16_t numa_node);
 void free_bm25_partition_new(BM25PartitionNew* IP);
 
+// Resident bytes of one search column of a partition. Arena arrays count
+// their size, heap ones what malloc handed out, slack and chunk headers
+// included. Arrays of a loaded partition count their pages resident in the
+// index file mapping.
+typedef struct {
+	uint64_t postings;
+	uint64_t doc_sizes;
+	uint64_t term_offsets;
+	uint64_t doc_freqs;
+	uint64_t vocab_buckets;
+	uint64_t vocab_strings;
+	uint64_t total;
+} ColumnMemoryUsage;
+
+typedef struct {
+	// One per search column.
+	std::vector<ColumnMemoryUsage> columns;
+	uint64_t line_offsets;
+	uint64_t deleted_docs;
+	uint64_t doc_store;
+
+	// Arena bytes mapped but not handed out to any array.
+	uint64_t arena_unused;
+	uint64_t total;
+
+	// Part of total in the index file mapping. The rest is heap.
+	uint64_t mapped;
+} PartitionMemoryUsage;
+
+typedef struct {
+	std::vector<PartitionMemoryUsage> partitions;
+
+	// Split of the partition totals.
+	uint64_t heap;
+	uint64_t mapped;
+
+	// Resident pages of the source file mapping. Page cache, not in total.
+	uint64_t source_file;
+
+	// Blocks held by the postings cache of a loaded index. In total.
+	uint64_t postings_cache;
+	uint64_t total;
+} MemoryUsage;
+
 ////////////////////////////////////////
 
 
@@ -139,6 +244,93 @@ struct _compare_bm25_result {
 	}
 };
 
+// Flattened results of a query batch.
+// Results for query i live in [query_offsets[i], query_offsets[i + 1]).
+typedef struct {
+	std::vector<uint64_t> doc_ids;
+	std::vector<float>    scores;
+	std::vector<uint16_t> partition_ids;
+	std::vector<uint64_t> query_offsets;
+} BM25BatchResult;
+
+// Byte range of one raw csv field in the mapped source file.
+typedef struct {
+	uint64_t offset;
+	uint32_t length;
+} FieldSpan;
+
+// Zero-copy top-k results. Spans are row-major by result then projected column,
+// i.e. field j of result i is at offsets[i * num_columns + j]. Fields are raw,
+// so quoted fields still carry their quotes.
+typedef struct {
+	std::vector<BM25Result> results;
+	std::vector<uint64_t>   offsets;
+	std::vector<uint32_t>   lengths;
+	uint16_t                num_columns;
+} BM25SpanResult;
+
+// A normalized query term resolved against every partition's vocab.
+typedef struct {
+	std::string term;
+	uint64_t    hash;
+	uint64_t    df;
+	float       idf;
+
+	// Term id in each partition. UINT32_MAX if absent or a stop word.
+	std::vector<uint32_t> partition_term_ids;
+} CompiledTerm;
+
+// Query tokenized and resolved once per call. Partition tasks only read it.
+typedef struct {
+	// terms[col_idx] in query order.
+	std::vector<std::vector<CompiledTerm>> terms;
+} CompiledQuery;
+
+// Bounds a query's runtime. Scoring stops once the deadline passes or
+// the engine's query epoch moves on (see cancel_queries).
+typedef struct {
+	bool has_deadline;
+	std::chrono::steady_clock::time_point deadline;
+
+	uint64_t epoch;
+	const std::atomic<uint64_t>* current_epoch;
+} QueryDeadline;
+
+// Cost and score breakdown of one query term in one column.
+typedef struct {
+	std::string term;
+	uint16_t    col_idx;
+	uint64_t    df;
+	float       idf;
+	bool        is_stop_word;
+	bool        exceeds_max_df;
+
+	// Posting list length in each partition.
+	std::vector<uint64_t> partition_posting_lengths;
+
+	// Time to walk the term's postings across all partitions, here, after
+	// ranking. Every posting, so an upper bound on what ranking spent on the
+	// term, which may skip docs that can't reach the top k.
+	uint64_t walk_ns;
+
+	// Score added to each returned doc. Aligned with QueryExplanation::results.
+	std::vector<float> doc_contributions;
+} TermExplanation;
+
+typedef struct {
+	std::vector<BM25Result>      results;
+	std::vector<TermExplanation> terms;
+} QueryExplanation;
+
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t size;
+	uint64_t capacity;
+} QueryCacheStats;
+
+class QueryCache;
+
 typedef struct {
 	uint8_t num_repeats;
 	uint8_t value;
@@ -215,10 +407,64 @@ class _BM25 {
 		std::vector<int16_t> search_col_idxs;
 		uint16_t header_bytes;
 
+		// Byte offset where each partition starts and, last, where indexed rows end.
+		// Row offsets for in-memory indexes.
 		std::vector<uint64_t> partition_boundaries;
 
+		// Average doc size of each search column over every partition.
+		std::vector<float> avg_doc_sizes;
+
 		std::vector<FILE*> reference_file_handles;
 
+		// Optional. NULL until a capacity is set.
+		QueryCache* query_cache = NULL;
+
+		// Read only mapping of the source file used to fetch rows.
+		char*    source_data = NULL;
+		uint64_t source_size = 0;
+
+		// Optional. One store per partition, empty until build_doc_store is called.
+		// Holds columns[doc_store_cols[i]] as field i.
+		std::vector<DocStore*> doc_stores;
+		std::vector<uint16_t>  doc_store_cols;
+
+		// Mapping of the index file when loaded from disk. Partition arrays point into it.
+		char*    index_data = NULL;
+		uint64_t index_size = 0;
+
+		// Optional. Postings of the index file are read through it instead of
+		// the mapping, everything else stays resident. See load_from_disk.
+		BlockCache* postings_cache = NULL;
+
+		// Opaque to the engine. Saved and loaded with the index.
+		std::string user_metadata;
+		QueryStatsRecorder query_stats;
+		std::atomic<uint64_t> query_epoch{0};
+
+		// Queries hold it shared. Publishing an appended segment holds it exclusively.
+		std::shared_mutex index_mutex;
+
+		// One append at a time.
+		std::mutex append_mutex;
+		bool show_progress = true;
+
+		// Background merging of adjacent segments. See start_merges.
+		// merge_mutex is held for a whole merge. The worker sleeps on merge_cv
+		// until an append bumps merge_generation.
+		MergePolicy merge_policy;
+		std::thread merge_thread;
+		std::mutex  merge_mutex;
+		std::mutex  merge_wait_mutex;
+		std::condition_variable merge_cv;
+		uint64_t    merge_generation = 0;
+		std::atomic<bool>     stop_merging{false};
+		std::atomic<uint64_t> num_merges{0};
+
+		// Tail-follow of the csv. See start_follow.
+		std::thread follow_thread;
+		uint32_t    follow_interval_ms = FOLLOW_INTERVAL_MS;
+		std::atomic<bool> stop_following{false};
+
 		std::vector<std::string> progress_bars;
 		std::mutex progress_mutex;
 		int init_cursor_row;
@@ -233,11 +479,26 @@ class _BM25 {
 				float  k1,
 				float  b,
 				uint16_t num_partitions,
-				const std::vector<std::string>& _stop_words = {}
+				const std::vector<std::string>& _stop_words = {},
+				uint16_t num_threads = 0
 				);
 
-		_BM25(std::string db_dir) {
-			load_from_disk(db_dir);
+		// Builds the index of a csv out of core, within config.memory_budget,
+		// writes it to config.index_path and loads it from there.
+		_BM25(
+				std::string filename,
+				std::vector<std::string> search_cols,
+				float  bloom_df_threshold,
+				double bloom_fpr,
+				float  k1,
+				float  b,
+				uint16_t num_partitions,
+				const std::vector<std::string>& _stop_words,
+				const ExternalBuildConfig& config
+				);
+
+		_BM25(std::string index_path, IndexWarmup warmup = WARMUP_NONE, uint64_t postings_cache_bytes = 0) {
+			load_from_disk(index_path, warmup, postings_cache_bytes);
 		}
 
 		_BM25(
@@ -250,37 +511,86 @@ class _BM25 {
 				const std::vector<std::string>& _stop_words = {}
 				);
 
-		~_BM25() {
-			for (auto& handle : reference_file_handles) {
-				if (handle != nullptr) {
-					fclose(handle);
-				}
-			}
-
-			for (size_t partition_idx = 0; partition_idx < (size_t)num_partitions; ++partition_idx) {
-				/*
-				BM25PartitionNew* IP = &index_partitions[partition_idx];
-
-				for (size_t col_idx = 0; col_idx < search_cols.size(); ++col_idx) {
-					InvertedIndexNew* II = &IP->II[col_idx];
-					for (auto& [doc_id, bloom_entry] : II.bloom_filters) {
-						for (auto& [tf, filter] : bloom_entry.bloom_filters) {
-							bloom_free(filter);
-						}
-					}
-				}
-				*/
-				free_bm25_partition_new(&index_partitions[partition_idx]);
-			}
-			free(index_partitions);
-		}
+		~_BM25();
 		void init_terminal();
 		void proccess_csv_header();
 
-		void save_index_partition(std::string db_dir, uint16_t partition_id);
-		void load_index_partition(std::string db_dir, uint16_t partition_id);
-		void save_to_disk(const std::string& db_dir);
-		void load_from_disk(const std::string& db_dir);
+		void update_avg_doc_sizes();
+		uint64_t append(uint64_t start_byte, const std::vector<uint64_t>& deleted_doc_ids = {});
+		uint64_t append_new_rows(const std::vector<uint64_t>& deleted_doc_ids);
+
+		// Byte offset in the source file the next append starts from.
+		uint64_t get_indexed_bytes();
+
+		void start_follow(uint32_t interval_ms);
+		void stop_follow();
+		void follow();
+
+		void check_doc_ids(const std::vector<uint64_t>& doc_ids);
+		void mark_deleted(const std::vector<uint64_t>& doc_ids);
+		void delete_docs(const std::vector<uint64_t>& doc_ids);
+		uint64_t update(const std::vector<uint64_t>& doc_ids, uint64_t start_byte);
+		uint64_t get_num_docs();
+		uint64_t get_num_deleted();
+
+		// Global doc ids (row numbers) of every deleted doc, ascending.
+		std::vector<uint64_t> get_deleted_doc_ids();
+		PartitionMemoryUsage get_partition_memory_usage(const BM25PartitionNew* IP, uint16_t partition_id);
+		MemoryUsage memory_usage();
+
+		// NUMA node of each partition, by partition id.
+		std::vector<uint16_t> get_partition_numa_nodes();
+
+		void get_vocab_terms(const BM25PartitionNew* IP, uint16_t col_idx, std::vector<std::string>& terms);
+		void merge_partitions(
+				const std::vector<BM25PartitionNew>& sources,
+				BM25PartitionNew* merged,
+				MergeThrottle& throttle
+				);
+		bool merge_once(MergeThrottle& throttle);
+		void start_merges(const MergePolicy& policy);
+		void stop_merges();
+		void request_merge();
+		uint16_t get_num_segments();
+
+		// A merge closes the source file handles of the segments it removes,
+		// so needs one per segment. In-memory indexes and indexes loaded
+		// without their source file have none.
+		bool can_merge();
+
+		void save_index_partition(IndexFileWriter& writer, uint16_t partition_id);
+		void load_index_partition(
+				IndexFileReader& reader,
+				uint16_t partition_id,
+				std::vector<std::pair<const void*, uint64_t>>* resident_arrays = NULL
+				);
+		void save_index_header(IndexFileWriter& writer);
+		void save_doc_stores(IndexFileWriter& writer);
+		void save_to_disk(const std::string& path);
+		// With postings_cache_bytes, postings stay on disk and are read into a
+		// block cache of that size. Warmup then applies to the rest of the index.
+		void load_from_disk(
+				const std::string& path,
+				IndexWarmup warmup = WARMUP_NONE,
+				uint64_t postings_cache_bytes = 0
+				);
+		BlockCursor get_postings_cursor(const InvertedIndexNew* II, uint32_t term_idx);
+
+		void build_external(const ExternalBuildConfig& config);
+		void build_external_partition(
+				ExternalPartition* partition,
+				uint16_t partition_id,
+				uint64_t chunk_budget,
+				uint64_t io_buffer_size,
+				const std::string& tmp_dir
+				);
+		void write_external_partition(
+				IndexFileWriter& writer,
+				ExternalPartition* partition,
+				uint64_t memory_budget,
+				uint64_t io_buffer_size,
+				const std::string& tmp_dir
+				);
 
 		uint32_t process_doc_partition_json(
 				const char* doc,
@@ -349,8 +659,40 @@ class _BM25 {
 				uint64_t end_idx, 
 				uint16_t partition_id
 				);
-		std::vector<std::pair<std::string, std::string>> get_csv_line(uint32_t line_num, uint16_t partition_id);
-		std::vector<std::pair<std::string, std::string>> get_json_line(uint32_t line_num, uint16_t partition_id);
+		void map_source_file();
+		std::pair<uint64_t, uint64_t> get_line_span(uint32_t line_num, uint16_t partition_id);
+		void get_csv_field_spans(
+				uint32_t line_num,
+				uint16_t partition_id,
+				uint16_t num_fields,
+				std::vector<FieldSpan>& spans
+				);
+		std::string decode_csv_field(const FieldSpan& span);
+		std::vector<std::pair<std::string, std::string>> get_csv_line(
+				uint32_t line_num,
+				uint16_t partition_id,
+				const std::vector<uint16_t>* projection = NULL
+				);
+		std::vector<std::pair<std::string, std::string>> get_json_line(
+				uint32_t line_num,
+				uint16_t partition_id,
+				const std::vector<uint16_t>* projection = NULL
+				);
+		std::vector<std::pair<std::string, std::string>> _get_json_line(uint32_t line_num, uint16_t partition_id);
+		std::vector<std::pair<std::string, std::string>> get_stored_line(
+				uint64_t doc_id,
+				uint16_t partition_id,
+				const std::vector<uint16_t>* projection = NULL
+				);
+
+		void build_doc_store(const std::vector<std::string>& column_names = {});
+		void build_doc_store_in_memory(
+				const std::vector<std::vector<std::string>>& documents,
+				const std::vector<std::string>& column_names
+				);
+		DocStore* build_partition_doc_store(uint16_t partition_id, const std::vector<uint16_t>& projection);
+		void free_doc_stores();
+		DocStoreStats get_doc_store_stats();
 
 		void init_dbs();
 		uint64_t get_doc_freqs_sum(
@@ -373,13 +715,10 @@ class _BM25 {
 				std::vector<std::vector<uint64_t>>& term_idxs,
 				uint16_t partition_id
 				);
-		TermType add_query_term_bloom(
-				std::string& substr,
-				std::vector<std::vector<uint64_t>>& term_idxs,
-				std::vector<MAP<uint64_t, BloomEntry>>& bloom_entries,
-				uint16_t partition_id,
-				uint16_t col_idx
-				);
+		TermType get_query_term_type(const CompiledTerm& term, uint16_t partition_id);
+		void resolve_query_term(CompiledTerm& term, uint16_t col_idx);
+		CompiledQuery compile_query(const std::string& query);
+		CompiledQuery compile_query(const std::vector<std::string>& query);
 
 		std::vector<BM25Result> _query_partition_streaming(
 				std::string& query,
@@ -393,35 +732,128 @@ class _BM25 {
 				std::string& query,
 				uint32_t top_k,
 				uint32_t query_max_df,
-				std::vector<float> boost_factors
+				std::vector<float> boost_factors,
+				uint64_t deadline_us = 0,
+				bool* approximate = NULL
 				);
 		std::vector<std::vector<std::pair<std::string, std::string>>> get_topk_internal(
 				std::string& _query,
 				uint32_t top_k,
 				uint32_t query_max_df,
-				std::vector<float> boost_factors
+				std::vector<float> boost_factors,
+				const std::vector<std::string>& column_names = {},
+				uint64_t deadline_us = 0,
+				bool* approximate = NULL
 				);
 
 		std::vector<BM25Result> _query_partition_bloom_multi(
-				std::vector<std::string>& query,
+				const CompiledQuery& query,
 				uint32_t k,
 				uint32_t query_max_df,
 				uint16_t partition_id,
-				std::vector<float> boost_factors,
-				std::vector<std::vector<uint64_t>> doc_freqs
+				const std::vector<float>& boost_factors,
+				std::atomic<float>* shared_threshold = NULL,
+				QueryStats* stats = NULL,
+				const QueryDeadline* deadline = NULL
 				);
 		std::vector<BM25Result> query_multi(
+				std::vector<std::string>& query,
+				uint32_t top_k,
+				uint32_t query_max_df,
+				std::vector<float> boost_factors,
+				uint64_t deadline_us = 0,
+				bool* approximate = NULL
+				);
+		QueryDeadline get_query_deadline(uint64_t deadline_us);
+		void cancel_queries();
+		std::vector<std::vector<BM25Result>> _query_partition_shared_scan(
+				const std::vector<CompiledQuery>& queries,
+				size_t query_start,
+				size_t query_end,
+				uint32_t k,
+				uint32_t query_max_df,
+				uint16_t partition_id,
+				const std::vector<float>& boost_factors,
+				std::atomic<float>* shared_thresholds,
+				QueryStats* stats
+				);
+		std::vector<BM25Result> _query_multi(
+				const CompiledQuery& query,
+				uint32_t top_k,
+				uint32_t query_max_df,
+				const std::vector<float>& boost_factors,
+				QueryStats* stats = NULL,
+				const QueryDeadline* deadline = NULL
+				);
+		std::vector<BM25Result> _query_multi_cached(
+				const CompiledQuery& query,
+				uint32_t top_k,
+				uint32_t query_max_df,
+				const std::vector<float>& boost_factors,
+				QueryStats* stats = NULL,
+				const QueryDeadline* deadline = NULL
+				);
+		QueryExplanation explain(
+				std::string& query,
+				uint32_t top_k,
+				uint32_t query_max_df,
+				std::vector<float> boost_factors
+				);
+		QueryExplanation explain_multi(
 				std::vector<std::string>& query,
 				uint32_t top_k,
 				uint32_t query_max_df,
 				std::vector<float> boost_factors
 				);
+		QueryExplanation _explain(
+				const CompiledQuery& query,
+				uint32_t top_k,
+				uint32_t query_max_df,
+				const std::vector<float>& boost_factors
+				);
+		BM25BatchResult query_batch(
+				std::vector<std::string>& queries,
+				uint32_t top_k,
+				uint32_t query_max_df,
+				std::vector<float> boost_factors,
+				bool shared_scan = false
+				);
+		void validate_boost_factors(std::vector<float>& boost_factors);
 		std::vector<std::vector<std::pair<std::string, std::string>>> get_topk_internal_multi(
 				std::vector<std::string>& query,
 				uint32_t top_k,
 				uint32_t query_max_df,
-				std::vector<float> boost_factors
+				std::vector<float> boost_factors,
+				const std::vector<std::string>& column_names = {},
+				uint64_t deadline_us = 0,
+				bool* approximate = NULL
+				);
+		std::vector<std::vector<std::pair<std::string, std::string>>> _get_topk_internal(
+				const CompiledQuery& query,
+				uint32_t top_k,
+				uint32_t query_max_df,
+				const std::vector<float>& boost_factors,
+				const std::vector<uint16_t>* projection = NULL,
+				QueryStats* stats = NULL,
+				const QueryDeadline* deadline = NULL
+				);
+		BM25SpanResult get_topk_spans(
+				std::vector<std::string>& query,
+				uint32_t top_k,
+				uint32_t query_max_df,
+				std::vector<float> boost_factors,
+				const std::vector<std::string>& column_names = {}
 				);
+		// Throws std::invalid_argument for a column the index doesn't have.
+		std::vector<uint16_t> get_column_projection(const std::vector<std::string>& column_names);
+
+		void set_query_cache_capacity(uint64_t capacity);
+		void invalidate_query_cache();
+		QueryCacheStats get_query_cache_stats();
+		BlockCacheStats get_postings_cache_stats();
+
+		QueryStatsSummary get_query_stats();
+		void reset_query_stats();
 
 		void update_progress(int line_num, int num_lines, uint16_t partition_id);
 		void finalize_progress_bar();
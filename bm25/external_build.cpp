@@ -0,0 +1,347 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <algorithm>
+
+#include "external_build.h"
+
+
+ScratchFile::ScratchFile(const std::string& dir, uint64_t buffer_size) :
+	buffer(buffer_size),
+	buffered(0),
+	flushed(0) {
+	std::string path = dir + "/bm25_build_XXXXXX";
+	fd = mkstemp(&path[0]);
+	if (fd == -1) {
+		std::cerr << "Error creating scratch file in " << dir << std::endl;
+		std::exit(1);
+	}
+
+	// Space is freed once the file is closed, also if the build is killed.
+	unlink(path.c_str());
+}
+
+ScratchFile::~ScratchFile() {
+	close(fd);
+}
+
+static void write_all(int fd, const char* data, uint64_t size) {
+	uint64_t written = 0;
+	while (written < size) {
+		ssize_t n = ::write(fd, data + written, size - written);
+		if (n <= 0) {
+			std::cerr << "Error writing scratch file." << std::endl;
+			std::exit(1);
+		}
+		written += n;
+	}
+}
+
+void ScratchFile::flush() {
+	write_all(fd, buffer.data(), buffered);
+	flushed += buffered;
+	buffered = 0;
+}
+
+void ScratchFile::write(const void* data, uint64_t size) {
+	if (buffered + size > buffer.size()) {
+		flush();
+	}
+
+	// Too large to buffer, e.g. postings of a frequent term.
+	if (size > buffer.size()) {
+		write_all(fd, (const char*)data, size);
+		flushed += size;
+		return;
+	}
+
+	memcpy(buffer.data() + buffered, data, size);
+	buffered += size;
+}
+
+uint64_t ScratchFile::size() const {
+	return flushed + buffered;
+}
+
+void ScratchFile::finish() {
+	flush();
+	std::vector<char>().swap(buffer);
+}
+
+uint64_t ScratchFile::pread(void* data, uint64_t size, uint64_t offset) {
+	if (buffered > 0) flush();
+
+	uint64_t read = 0;
+	while (read < size) {
+		ssize_t n = ::pread(fd, (char*)data + read, size - read, offset + read);
+		if (n < 0) {
+			std::cerr << "Error reading scratch file." << std::endl;
+			std::exit(1);
+		}
+		if (n == 0) break;
+		read += n;
+	}
+	return read;
+}
+
+void ScratchFile::copy_to(IndexFileWriter& writer, uint64_t offset, uint64_t size) {
+	std::vector<char> chunk(std::min(size, (uint64_t)EXTERNAL_BUILD_IO_BUFFER_SIZE));
+	while (size > 0) {
+		uint64_t n = pread(chunk.data(), std::min(size, (uint64_t)chunk.size()), offset);
+		if (n == 0) {
+			std::cerr << "Error: Scratch file is truncated." << std::endl;
+			std::exit(1);
+		}
+		writer.append_array(chunk.data(), n);
+		offset += n;
+		size   -= n;
+	}
+}
+
+
+CsvRowScanner::CsvRowScanner(int fd, uint64_t row_start, uint64_t file_size) :
+	fd(fd),
+	file_size(file_size),
+	buffer(EXTERNAL_BUILD_IO_BUFFER_SIZE),
+	buffer_start(row_start),
+	buffer_end(row_start),
+	pos(row_start),
+	quoted(false) {}
+
+uint64_t CsvRowScanner::next_row() {
+	// Like determine_partition_boundaries_csv_rfc_4180, stop short of the last byte.
+	const uint64_t scan_end = (file_size > 0) ? file_size - 1 : 0;
+
+	while (pos < scan_end) {
+		if (pos == buffer_end) {
+			ssize_t n = ::pread(fd, buffer.data(), std::min((uint64_t)buffer.size(), scan_end - pos), pos);
+			if (n <= 0) {
+				std::cerr << "Error reading file." << std::endl;
+				std::exit(1);
+			}
+			buffer_start = pos;
+			buffer_end   = pos + n;
+		}
+
+		// An escaped quote toggles twice.
+		for (const char* data = buffer.data() - buffer_start; pos < buffer_end; ++pos) {
+			if (data[pos] == '"') {
+				quoted = !quoted;
+			}
+			else if (data[pos] == '\n' && !quoted) {
+				return ++pos;
+			}
+		}
+	}
+
+	pos = file_size;
+	return file_size;
+}
+
+
+void write_run_term(ScratchFile& file, std::string_view term, const void* postings, uint32_t doc_freq) {
+	uint32_t term_size = term.size();
+	file.write(&term_size, sizeof(uint32_t));
+	file.write(term.data(), term.size());
+	file.write(&doc_freq, sizeof(uint32_t));
+	file.write(postings, doc_freq * sizeof(uint32_t));
+}
+
+
+RunReader::RunReader(ScratchFile* file, uint64_t offset, uint64_t end, uint64_t buffer_size) :
+	file(file),
+	offset(offset),
+	end(end),
+	buffer(buffer_size),
+	buffer_pos(0),
+	buffer_len(0),
+	hash(0),
+	doc_freq(0),
+	postings_left(0) {}
+
+void RunReader::read(void* data, uint64_t size) {
+	char* dst = (char*)data;
+	while (size > 0) {
+		if (buffer_pos == buffer_len) {
+			buffer_len = file->pread(buffer.data(), std::min((uint64_t)buffer.size(), end - offset), offset);
+			buffer_pos = 0;
+			offset    += buffer_len;
+			if (buffer_len == 0) {
+				std::cerr << "Error: Run is truncated." << std::endl;
+				std::exit(1);
+			}
+		}
+
+		uint64_t n = std::min(size, buffer_len - buffer_pos);
+		memcpy(dst, buffer.data() + buffer_pos, n);
+		buffer_pos += n;
+		dst        += n;
+		size       -= n;
+	}
+}
+
+bool RunReader::next_term() {
+	uint32_t skipped[256];
+	while (read_postings(skipped, 256) > 0) {}
+
+	if (offset == end && buffer_pos == buffer_len) return false;
+
+	uint32_t term_size;
+	read(&term_size, sizeof(uint32_t));
+	term.resize(term_size);
+	read(&term[0], term_size);
+	read(&doc_freq, sizeof(uint32_t));
+
+	hash = fnv1a_hash(term.data(), term.size());
+	postings_left = doc_freq;
+	return true;
+}
+
+uint32_t RunReader::read_postings(void* postings, uint32_t max_postings) {
+	uint32_t n = std::min(max_postings, postings_left);
+	read(postings, n * sizeof(uint32_t));
+	postings_left -= n;
+	return n;
+}
+
+
+typedef struct {
+	uint64_t hash;
+	uint64_t term_id;
+} SlotEntry;
+
+void write_frozen_vocab_slots(
+		ScratchFile& hashes,
+		uint64_t num_terms,
+		IndexFileWriter& writer,
+		const std::string& tmp_dir,
+		uint64_t memory_limit
+		) {
+	if (num_terms == 0) return;
+
+	const uint64_t num_slots = frozen_vocab_num_slots(num_terms);
+	const uint64_t mask = num_slots - 1;
+
+	// Bucket b holds the terms whose home slot has b as its top bits, so
+	// buckets in turn, each sorted by home, are every term in home order.
+	uint64_t num_buckets = 1;
+	while (
+			num_buckets < num_slots &&
+			num_buckets < EXTERNAL_BUILD_MAX_BUCKETS &&
+			num_terms * sizeof(SlotEntry) / num_buckets > memory_limit
+			) {
+		num_buckets <<= 1;
+	}
+	const int bucket_shift = __builtin_ctzll(num_slots) - __builtin_ctzll(num_buckets);
+
+	uint64_t bucket_buffer_size = std::clamp(
+			memory_limit / num_buckets,
+			(uint64_t)EXTERNAL_BUILD_MIN_IO_BUFFER,
+			(uint64_t)EXTERNAL_BUILD_IO_BUFFER_SIZE
+			);
+	std::vector<ScratchFile*> buckets;
+	for (uint64_t bucket = 0; bucket < num_buckets; ++bucket) {
+		buckets.push_back(new ScratchFile(tmp_dir, bucket_buffer_size));
+	}
+
+	std::vector<uint64_t> chunk(EXTERNAL_BUILD_IO_BUFFER_SIZE / sizeof(uint64_t));
+	for (uint64_t term_id = 0; term_id < num_terms; term_id += chunk.size()) {
+		uint64_t n = std::min((uint64_t)chunk.size(), num_terms - term_id);
+		hashes.pread(chunk.data(), n * sizeof(uint64_t), term_id * sizeof(uint64_t));
+
+		for (uint64_t idx = 0; idx < n; ++idx) {
+			SlotEntry entry = {chunk[idx], term_id + idx};
+			buckets[(entry.hash & mask) >> bucket_shift]->write(&entry, sizeof(SlotEntry));
+		}
+	}
+	std::vector<uint64_t>().swap(chunk);
+	for (ScratchFile* bucket : buckets) bucket->finish();
+
+	// Calls fn on every term in (home, term id) order until it returns false.
+	auto for_each_sorted = [&](auto fn) {
+		std::vector<SlotEntry> entries;
+		for (ScratchFile* bucket : buckets) {
+			entries.resize(bucket->size() / sizeof(SlotEntry));
+			bucket->pread(entries.data(), bucket->size(), 0);
+			std::sort(entries.begin(), entries.end(), [mask](const SlotEntry& a, const SlotEntry& b) {
+				uint64_t home_a = a.hash & mask;
+				uint64_t home_b = b.hash & mask;
+				return (home_a != home_b) ? home_a < home_b : a.term_id < b.term_id;
+			});
+
+			for (const SlotEntry& entry : entries) {
+				if (!fn(entry)) return;
+			}
+		}
+	};
+
+	// Placing terms in home order, each at its home or the first free slot
+	// after, is linear probing. The last terms can run past the last slot.
+	// Those wrap around into slots 0, 1, ..., placed there first, which may
+	// push the terms before them on, so repeat until none run over.
+	uint64_t num_wrapped = 0;
+	while (true) {
+		const uint64_t num_placed = num_terms - num_wrapped;
+		uint64_t next_pos = num_wrapped;
+		uint64_t idx = 0;
+		uint64_t wrapped = 0;
+		for_each_sorted([&](const SlotEntry& entry) {
+			if (idx == num_placed) return false;
+
+			next_pos = std::max(entry.hash & mask, next_pos) + 1;
+			if (next_pos > num_slots) {
+				// Homes ascend, so every later term wraps as well.
+				wrapped = num_placed - idx;
+				return false;
+			}
+			++idx;
+			return true;
+		});
+
+		if (wrapped == 0) break;
+		num_wrapped += wrapped;
+	}
+
+	std::vector<uint64_t> slots;
+	slots.reserve(EXTERNAL_BUILD_IO_BUFFER_SIZE / sizeof(uint64_t));
+	auto emit = [&](uint64_t slot) {
+		slots.push_back(slot);
+		if (slots.size() == slots.capacity()) {
+			writer.append_array(slots.data(), slots.size() * sizeof(uint64_t));
+			slots.clear();
+		}
+	};
+	auto make_slot = [](const SlotEntry& entry) {
+		return ((entry.hash >> 32) << 32) | (entry.term_id + 1);
+	};
+
+	if (num_wrapped > 0) {
+		std::vector<SlotEntry> wrapped;
+		uint64_t idx = 0;
+		for_each_sorted([&](const SlotEntry& entry) {
+			if (idx++ >= num_terms - num_wrapped) wrapped.push_back(entry);
+			return true;
+		});
+		for (const SlotEntry& entry : wrapped) emit(make_slot(entry));
+	}
+
+	uint64_t next_pos = num_wrapped;
+	uint64_t idx = 0;
+	for_each_sorted([&](const SlotEntry& entry) {
+		if (idx++ == num_terms - num_wrapped) return false;
+
+		uint64_t pos = std::max(entry.hash & mask, next_pos);
+		for (; next_pos < pos; ++next_pos) emit(0);
+
+		emit(make_slot(entry));
+		next_pos = pos + 1;
+		return true;
+	});
+	for (; next_pos < num_slots; ++next_pos) emit(0);
+
+	writer.append_array(slots.data(), slots.size() * sizeof(uint64_t));
+
+	for (ScratchFile* bucket : buckets) delete bucket;
+}
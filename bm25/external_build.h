@@ -0,0 +1,172 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "index_file.h"
+
+// Out-of-core builds index a csv a chunk of rows at a time. Each chunk is
+// built like a small partition, written out as a sorted run and freed. Runs
+// of a partition are then k-way merged straight into the index file, which
+// the build ends by loading. Nothing proportional to the input is held.
+#define EXTERNAL_BUILD_IO_BUFFER_SIZE (1024 * 1024)
+#define EXTERNAL_BUILD_MIN_IO_BUFFER  (16 * 1024)
+#define EXTERNAL_BUILD_ROW_SAMPLE     65536
+#define EXTERNAL_BUILD_MAX_BUCKETS    256
+
+
+typedef struct {
+	// Index file to write. Loaded once built.
+	std::string index_path;
+
+	// Directory for runs and other scratch files. The index file's if empty.
+	std::string tmp_dir;
+
+	// Bytes the build may hold at once. Split evenly over the threads, each
+	// sizing its chunks from what earlier chunks took.
+	uint64_t memory_budget;
+
+	// Partitions tokenized at once. 0 = one per partition, as the budget allows.
+	uint16_t num_threads;
+
+	// Opaque to the engine. Saved in the index file.
+	std::string user_metadata;
+} ExternalBuildConfig;
+
+
+// Unlinked file in dir, gone once closed. Appended to through a buffer of
+// buffer_size bytes, read back with pread.
+class ScratchFile {
+	public:
+		ScratchFile(const std::string& dir, uint64_t buffer_size);
+		~ScratchFile();
+
+		ScratchFile(const ScratchFile&) = delete;
+		ScratchFile& operator=(const ScratchFile&) = delete;
+
+		void write(const void* data, uint64_t size);
+		uint64_t size() const;
+
+		// Flushes and drops the write buffer. Writing after this is unbuffered.
+		void finish();
+
+		// Fewer than size bytes only at the end of the file.
+		uint64_t pread(void* data, uint64_t size, uint64_t offset);
+
+		// Appends [offset, offset + size) to the array being written.
+		void copy_to(IndexFileWriter& writer, uint64_t offset, uint64_t size);
+
+	private:
+		void flush();
+
+		int               fd;
+		std::vector<char> buffer;
+		uint64_t          buffered;
+		uint64_t          flushed;
+};
+
+
+// Start offsets of csv rows, split the way the in-memory build splits them.
+// Newlines inside quoted fields don't end a row, and a newline ending the
+// file doesn't start one.
+class CsvRowScanner {
+	public:
+		// row_start must start a row.
+		CsvRowScanner(int fd, uint64_t row_start, uint64_t file_size);
+
+		// Start of the next row, or file_size past the last one.
+		uint64_t next_row();
+
+	private:
+		int               fd;
+		uint64_t          file_size;
+		std::vector<char> buffer;
+		uint64_t          buffer_start;
+		uint64_t          buffer_end;
+		uint64_t          pos;
+		bool              quoted;
+};
+
+
+// Run record: [u32 term size][term][u32 doc_freq][doc_freq 4 byte postings].
+// Terms of a run are ordered by (fnv1a_hash, term).
+void write_run_term(ScratchFile& file, std::string_view term, const void* postings, uint32_t doc_freq);
+
+// Reads the run [offset, end) of file term by term.
+class RunReader {
+	public:
+		RunReader(ScratchFile* file, uint64_t offset, uint64_t end, uint64_t buffer_size);
+
+		// Moves to the next term, skipping postings not read. false past the last.
+		bool next_term();
+
+		// Postings of the current term, in pieces of at most max_postings.
+		// 0 once all are read.
+		uint32_t read_postings(void* postings, uint32_t max_postings);
+
+		const std::string& get_term() const { return term; }
+		uint64_t get_hash() const { return hash; }
+		uint32_t get_doc_freq() const { return doc_freq; }
+
+	private:
+		void read(void* data, uint64_t size);
+
+		ScratchFile*      file;
+		uint64_t          offset;
+		uint64_t          end;
+		std::vector<char> buffer;
+		uint64_t          buffer_pos;
+		uint64_t          buffer_len;
+
+		std::string term;
+		uint64_t    hash;
+		uint32_t    doc_freq;
+		uint32_t    postings_left;
+};
+
+
+// Slots of a frozen vocab (see build_frozen_vocab) over num_terms terms whose
+// fnv1a hashes are in hashes in term id order. Appended to the array being
+// written. Terms are bucketed by home slot into scratch files in tmp_dir,
+// each sorted in at most about memory_limit bytes, so the table is never in
+// memory.
+void write_frozen_vocab_slots(
+		ScratchFile& hashes,
+		uint64_t num_terms,
+		IndexFileWriter& writer,
+		const std::string& tmp_dir,
+		uint64_t memory_limit
+		);
+
+
+// Where a chunk of a partition went in the partition's scratch files.
+typedef struct {
+	uint64_t num_docs;
+
+	// Partition doc id of the chunk's first row.
+	uint64_t doc_base;
+
+	// Run of column i is [run_offsets[i], run_offsets[i + 1]) of runs.
+	std::vector<uint64_t> run_offsets;
+
+	// Doc sizes of column i start at doc_sizes_offsets[i] of doc_sizes.
+	std::vector<uint64_t> doc_sizes_offsets;
+} ExternalChunk;
+
+typedef struct {
+	uint64_t num_docs;
+	uint64_t start_byte;
+	uint64_t end_byte;
+
+	ScratchFile* runs;
+	ScratchFile* doc_sizes;
+	ScratchFile* line_offsets;
+
+	std::vector<ExternalChunk> chunks;
+
+	// Per column. Exact as long as it stays below 2^53.
+	std::vector<double> doc_size_sums;
+} ExternalPartition;
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "index_file.h"
+
+
+uint64_t fnv1a_hash(const char* data, size_t size) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t idx = 0; idx < size; ++idx) {
+		hash ^= (uint8_t)data[idx];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+uint32_t frozen_vocab_find(const FrozenVocab* vocab, const std::string& term, uint64_t hash) {
+	if (vocab->num_slots == 0) return UINT32_MAX;
+
+	const uint64_t mask = vocab->num_slots - 1;
+	const uint64_t tag  = hash >> 32;
+
+	for (uint64_t idx = hash & mask;; idx = (idx + 1) & mask) {
+		uint64_t slot = vocab->slots[idx];
+		if (slot == 0) return UINT32_MAX;
+		if ((slot >> 32) != tag) continue;
+
+		uint32_t term_id = (uint32_t)slot - 1;
+		uint64_t start   = vocab->term_offsets[term_id];
+		uint64_t length  = vocab->term_offsets[term_id + 1] - start;
+		if (length == term.size() && memcmp(vocab->strings + start, term.data(), length) == 0) {
+			return term_id;
+		}
+	}
+}
+
+uint64_t frozen_vocab_num_slots(uint64_t num_terms) {
+	if (num_terms == 0) return 0;
+
+	uint64_t num_slots = 2;
+	while (num_slots < 2 * num_terms) num_slots <<= 1;
+	return num_slots;
+}
+
+void build_frozen_vocab(
+		const std::vector<std::string>& terms,
+		std::vector<uint64_t>& slots,
+		std::vector<uint64_t>& term_offsets,
+		std::string& strings
+		) {
+	uint64_t num_slots = frozen_vocab_num_slots(terms.size());
+	slots.assign(num_slots, 0);
+
+	term_offsets.clear();
+	term_offsets.reserve(terms.size() + 1);
+	strings.clear();
+
+	for (uint32_t term_id = 0; term_id < terms.size(); ++term_id) {
+		const std::string& term = terms[term_id];
+		term_offsets.push_back(strings.size());
+		strings += term;
+
+		uint64_t hash = fnv1a_hash(term.data(), term.size());
+		uint64_t idx  = hash & (num_slots - 1);
+		while (slots[idx] != 0) {
+			idx = (idx + 1) & (num_slots - 1);
+		}
+		slots[idx] = ((hash >> 32) << 32) | ((uint64_t)term_id + 1);
+	}
+	term_offsets.push_back(strings.size());
+}
+
+
+IndexFileWriter::IndexFileWriter(const std::string& path) : path(path), array_start(0), array_entry(0) {
+	// Never truncate the live file. Readers may have it mapped. The temp
+	// file is unique so concurrent writers to one path don't share it,
+	// and sits next to path so the rename stays on one filesystem.
+	tmp_path = path + ".XXXXXX";
+	int fd = mkstemp(&tmp_path[0]);
+	if (fd == -1) {
+		std::cerr << "Error opening index file for writing: " << path << std::endl;
+		std::exit(1);
+	}
+
+	// mkstemp creates it owner only.
+	fchmod(fd, 0644);
+	file = fdopen(fd, "wb");
+	if (file == NULL) {
+		close(fd);
+		unlink(tmp_path.c_str());
+		std::cerr << "Error opening index file for writing: " << path << std::endl;
+		std::exit(1);
+	}
+
+	// Header page. Filled in by finish.
+	offset = INDEX_FILE_ALIGNMENT;
+	if (fseek(file, offset, SEEK_SET) != 0) {
+		std::cerr << "Error seeking index file: " << path << std::endl;
+		std::exit(1);
+	}
+}
+
+void IndexFileWriter::write_u8(uint8_t value) {
+	metadata.append((const char*)&value, sizeof(value));
+}
+
+void IndexFileWriter::write_u16(uint16_t value) {
+	metadata.append((const char*)&value, sizeof(value));
+}
+
+void IndexFileWriter::write_u32(uint32_t value) {
+	metadata.append((const char*)&value, sizeof(value));
+}
+
+void IndexFileWriter::write_u64(uint64_t value) {
+	metadata.append((const char*)&value, sizeof(value));
+}
+
+void IndexFileWriter::write_float(float value) {
+	metadata.append((const char*)&value, sizeof(value));
+}
+
+void IndexFileWriter::write_double(double value) {
+	metadata.append((const char*)&value, sizeof(value));
+}
+
+void IndexFileWriter::write_string(const std::string& value) {
+	write_u64(value.size());
+	metadata.append(value);
+}
+
+void IndexFileWriter::write_array(const void* data, uint64_t size) {
+	begin_array();
+	append_array(data, size);
+	end_array();
+}
+
+void IndexFileWriter::begin_array() {
+	array_start = offset;
+	array_entry = metadata.size();
+	write_u64(0);
+	write_u64(0);
+}
+
+void IndexFileWriter::append_array(const void* data, uint64_t size) {
+	if (size == 0) return;
+
+	if (fwrite(data, 1, size, file) != size) {
+		std::cerr << "Error writing index file: " << path << std::endl;
+		std::exit(1);
+	}
+	offset += size;
+}
+
+void IndexFileWriter::end_array() {
+	uint64_t size = offset - array_start;
+	uint64_t start = (size == 0) ? 0 : array_start;
+	memcpy(&metadata[array_entry], &start, sizeof(uint64_t));
+	memcpy(&metadata[array_entry + sizeof(uint64_t)], &size, sizeof(uint64_t));
+	if (size == 0) return;
+
+	// Pad to the next page.
+	uint64_t padding = (INDEX_FILE_ALIGNMENT - offset % INDEX_FILE_ALIGNMENT) % INDEX_FILE_ALIGNMENT;
+	static const char zeros[INDEX_FILE_ALIGNMENT] = {0};
+	fwrite(zeros, 1, padding, file);
+	offset += padding;
+}
+
+uint64_t IndexFileWriter::reserve_u32() {
+	uint64_t position = metadata.size();
+	write_u32(0);
+	return position;
+}
+
+void IndexFileWriter::patch_u32(uint64_t position, uint32_t value) {
+	memcpy(&metadata[position], &value, sizeof(uint32_t));
+}
+
+void IndexFileWriter::finish() {
+	IndexFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_FILE_MAGIC, sizeof(INDEX_FILE_MAGIC));
+	header.version         = INDEX_FILE_VERSION;
+	header.alignment       = INDEX_FILE_ALIGNMENT;
+	header.metadata_offset = offset;
+	header.metadata_size   = metadata.size();
+	header.file_size       = offset + metadata.size();
+
+	bool ok = (fwrite(metadata.data(), 1, metadata.size(), file) == metadata.size());
+	ok &= (fseek(file, 0, SEEK_SET) == 0);
+	ok &= (fwrite(&header, sizeof(header), 1, file) == 1);
+	ok &= (fclose(file) == 0);
+	ok = ok && (rename(tmp_path.c_str(), path.c_str()) == 0);
+	if (!ok) {
+		unlink(tmp_path.c_str());
+		std::cerr << "Error writing index file: " << path << std::endl;
+		std::exit(1);
+	}
+	file = NULL;
+}
+
+
+IndexFileReader::IndexFileReader(const char* data, uint64_t size) : data(data), size(size) {
+	IndexFileHeader header;
+	if (size < sizeof(header)) {
+		std::cerr << "Error: Index file is truncated." << std::endl;
+		std::exit(1);
+	}
+	memcpy(&header, data, sizeof(header));
+
+	if (memcmp(header.magic, INDEX_FILE_MAGIC, sizeof(INDEX_FILE_MAGIC)) != 0) {
+		std::cerr << "Error: Not an index file." << std::endl;
+		std::exit(1);
+	}
+	if (header.version != INDEX_FILE_VERSION) {
+		std::cerr << "Error: Index file version " << header.version;
+		std::cerr << " is not supported. Expected " << INDEX_FILE_VERSION << "." << std::endl;
+		std::exit(1);
+	}
+	if (header.file_size != size || header.metadata_offset + header.metadata_size > size) {
+		std::cerr << "Error: Index file is truncated." << std::endl;
+		std::exit(1);
+	}
+
+	cursor       = header.metadata_offset;
+	metadata_end = header.metadata_offset + header.metadata_size;
+}
+
+void IndexFileReader::read(void* value, uint64_t _size) {
+	if (cursor + _size > metadata_end) {
+		std::cerr << "Error: Index file metadata is corrupt." << std::endl;
+		std::exit(1);
+	}
+	memcpy(value, data + cursor, _size);
+	cursor += _size;
+}
+
+uint8_t IndexFileReader::read_u8() {
+	uint8_t value;
+	read(&value, sizeof(value));
+	return value;
+}
+
+uint16_t IndexFileReader::read_u16() {
+	uint16_t value;
+	read(&value, sizeof(value));
+	return value;
+}
+
+uint32_t IndexFileReader::read_u32() {
+	uint32_t value;
+	read(&value, sizeof(value));
+	return value;
+}
+
+uint64_t IndexFileReader::read_u64() {
+	uint64_t value;
+	read(&value, sizeof(value));
+	return value;
+}
+
+float IndexFileReader::read_float() {
+	float value;
+	read(&value, sizeof(value));
+	return value;
+}
+
+double IndexFileReader::read_double() {
+	double value;
+	read(&value, sizeof(value));
+	return value;
+}
+
+std::string IndexFileReader::read_string() {
+	uint64_t length = read_u64();
+	if (cursor + length > metadata_end) {
+		std::cerr << "Error: Index file metadata is corrupt." << std::endl;
+		std::exit(1);
+	}
+	std::string value(data + cursor, length);
+	cursor += length;
+	return value;
+}
+
+const void* IndexFileReader::read_array(uint64_t* _size) {
+	uint64_t offset = read_u64();
+	uint64_t length = read_u64();
+	if (_size != NULL) *_size = length;
+	if (length == 0) return NULL;
+
+	if (offset % INDEX_FILE_ALIGNMENT != 0 || offset + length > size) {
+		std::cerr << "Error: Index file array out of bounds." << std::endl;
+		std::exit(1);
+	}
+	return data + offset;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+// Single file index layout:
+//   [IndexFileHeader][pad to page] [array][pad] [array][pad] ... [metadata]
+// Arrays are page aligned so a loaded index points straight into the mapping.
+// Metadata is a flat little endian record of scalars, strings and array refs,
+// read back in the same order it was written.
+// Files are written to a temporary path and renamed into place, so a process
+// that has the old file mapped keeps a consistent view.
+#define INDEX_FILE_MAGIC     "BM25IDX"
+#define INDEX_FILE_VERSION   2
+#define INDEX_FILE_ALIGNMENT 4096
+
+
+typedef struct {
+	char     magic[8];
+	uint32_t version;
+	uint32_t alignment;
+	uint64_t file_size;
+	uint64_t metadata_offset;
+	uint64_t metadata_size;
+} IndexFileHeader;
+
+// Read only open addressing vocab stored in the index file. Replaces the
+// term -> term_id hash map of a loaded partition.
+typedef struct {
+	// (hash >> 32) << 32 | (term_id + 1). 0 marks an empty slot.
+	const uint64_t* slots;
+
+	// Term i is strings[term_offsets[i], term_offsets[i + 1]).
+	const uint64_t* term_offsets;
+	const char*     strings;
+
+	// Power of two. At most half full.
+	uint64_t num_slots;
+	uint32_t num_terms;
+} FrozenVocab;
+
+uint64_t fnv1a_hash(const char* data, size_t size);
+uint32_t frozen_vocab_find(const FrozenVocab* vocab, const std::string& term, uint64_t hash);
+
+// Power of two at least twice num_terms. 0 for no terms.
+uint64_t frozen_vocab_num_slots(uint64_t num_terms);
+
+// terms[i] is the term with id i.
+void build_frozen_vocab(
+		const std::vector<std::string>& terms,
+		std::vector<uint64_t>& slots,
+		std::vector<uint64_t>& term_offsets,
+		std::string& strings
+		);
+
+
+class IndexFileWriter {
+	public:
+		IndexFileWriter(const std::string& path);
+
+		void write_u8(uint8_t value);
+		void write_u16(uint16_t value);
+		void write_u32(uint32_t value);
+		void write_u64(uint64_t value);
+		void write_float(float value);
+		void write_double(double value);
+		void write_string(const std::string& value);
+
+		// Writes size bytes page aligned and records their location in the metadata.
+		void write_array(const void* data, uint64_t size);
+
+		// Same as write_array, for arrays written a piece at a time. Nothing else
+		// may be written between begin_array and end_array.
+		void begin_array();
+		void append_array(const void* data, uint64_t size);
+		void end_array();
+
+		// Writes a placeholder for a value only known later, and where it is.
+		uint64_t reserve_u32();
+		void     patch_u32(uint64_t position, uint32_t value);
+
+		// Appends the metadata, fills in the header and renames the file into place.
+		void finish();
+
+	private:
+		FILE*       file;
+		std::string path;
+		std::string tmp_path;
+		uint64_t    offset;
+		std::string metadata;
+
+		// Array being written by begin_array, and its entry in metadata.
+		uint64_t    array_start;
+		uint64_t    array_entry;
+};
+
+class IndexFileReader {
+	public:
+		// Validates the header of a mapped index file.
+		IndexFileReader(const char* data, uint64_t size);
+
+		uint8_t     read_u8();
+		uint16_t    read_u16();
+		uint32_t    read_u32();
+		uint64_t    read_u64();
+		float       read_float();
+		double      read_double();
+		std::string read_string();
+
+		// Pointer into the mapping. NULL for empty arrays.
+		const void* read_array(uint64_t* size = NULL);
+
+	private:
+		void read(void* value, uint64_t size);
+
+		const char* data;
+		uint64_t    size;
+		uint64_t    cursor;
+		uint64_t    metadata_end;
+};
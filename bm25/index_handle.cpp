@@ -0,0 +1,133 @@
+#include <iostream>
+
+#include "index_handle.h"
+
+
+IndexHandle::IndexHandle() : rebuilding(false), stop_reclaim(false) {}
+
+IndexHandle::~IndexHandle() {
+	wait();
+	publish(NULL);
+
+	if (reclaim_thread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(reclaim_mutex);
+			stop_reclaim = true;
+		}
+		reclaim_cv.notify_one();
+		reclaim_thread.join();
+	}
+}
+
+std::shared_ptr<_BM25> IndexHandle::acquire() const {
+	return std::atomic_load(&current);
+}
+
+void IndexHandle::publish(_BM25* bm25) {
+	std::shared_ptr<_BM25> next;
+	if (bm25 != NULL) {
+		// The last snapshot to go hands the index to the reclaim thread.
+		next = std::shared_ptr<_BM25>(bm25, [this](_BM25* old) { retire(old); });
+	}
+	std::atomic_store(&current, next);
+}
+
+void IndexHandle::retire(_BM25* bm25) {
+	std::lock_guard<std::mutex> lock(reclaim_mutex);
+
+	retired.push_back(bm25);
+	if (!reclaim_thread.joinable()) {
+		reclaim_thread = std::thread([this] { reclaim(); });
+	}
+	reclaim_cv.notify_one();
+}
+
+void IndexHandle::reclaim() {
+	std::unique_lock<std::mutex> lock(reclaim_mutex);
+
+	while (true) {
+		reclaim_cv.wait(lock, [this] { return stop_reclaim || !retired.empty(); });
+
+		// Free outside the lock. Unmapping a large index takes a while.
+		while (!retired.empty()) {
+			std::vector<_BM25*> batch;
+			batch.swap(retired);
+
+			lock.unlock();
+			for (_BM25* bm25 : batch) {
+				delete bm25;
+			}
+			lock.lock();
+		}
+		if (stop_reclaim) break;
+	}
+}
+
+void IndexHandle::rebuild(const std::string& filename, uint16_t num_partitions, uint16_t num_threads) {
+	std::lock_guard<std::mutex> lock(rebuild_mutex);
+	if (rebuild_thread.joinable()) {
+		rebuild_thread.join();
+	}
+
+	std::shared_ptr<_BM25> old = acquire();
+	if (old == nullptr) {
+		std::cerr << "Error: Nothing to rebuild. Index a file first." << std::endl;
+		std::exit(1);
+	}
+
+	rebuilding = true;
+	rebuild_thread = std::thread([this, old, filename, num_partitions, num_threads] {
+		std::vector<std::string> stop_words(old->stop_words.begin(), old->stop_words.end());
+
+		_BM25* bm25 = new _BM25(
+				filename,
+				old->search_cols,
+				old->bloom_df_threshold,
+				old->bloom_fpr,
+				old->k1,
+				old->b,
+				num_partitions,
+				stop_words,
+				num_threads
+				);
+
+		// Ready it fully before it takes traffic.
+		if (!old->doc_store_cols.empty()) {
+			std::vector<std::string> column_names;
+			for (uint16_t col_idx : old->doc_store_cols) {
+				column_names.push_back(old->columns[col_idx]);
+			}
+			bm25->build_doc_store(column_names);
+		}
+		if (old->query_cache != NULL) {
+			bm25->set_query_cache_capacity(old->get_query_cache_stats().capacity);
+		}
+		if (old->merge_thread.joinable()) {
+			bm25->start_merges(old->merge_policy);
+		}
+		if (old->follow_thread.joinable()) {
+			bm25->start_follow(old->follow_interval_ms);
+		}
+
+		// Row numbers are the same in both, the file only grows. Taken last,
+		// so deletes and updates made during the build carry over too.
+		std::vector<uint64_t> deleted_doc_ids = old->get_deleted_doc_ids();
+		if (!deleted_doc_ids.empty()) {
+			bm25->delete_docs(deleted_doc_ids);
+		}
+
+		publish(bm25);
+		rebuilding = false;
+	});
+}
+
+bool IndexHandle::is_rebuilding() const {
+	return rebuilding;
+}
+
+void IndexHandle::wait() {
+	std::lock_guard<std::mutex> lock(rebuild_mutex);
+	if (rebuild_thread.joinable()) {
+		rebuild_thread.join();
+	}
+}
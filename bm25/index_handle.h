@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "engine.h"
+
+
+// The index queries run against, swappable while serving.
+// Readers take a snapshot with acquire and keep using it even if a new index
+// is published meanwhile. Publishing is one atomic pointer swap. An index is
+// freed on the reclaim thread once its last snapshot is released, so no query
+// pays for tearing it down. Snapshots must not outlive the handle.
+class IndexHandle {
+	public:
+		IndexHandle();
+		~IndexHandle();
+
+		std::shared_ptr<_BM25> acquire() const;
+
+		// Takes ownership of bm25. NULL clears the handle.
+		void publish(_BM25* bm25);
+
+		// Rebuild the current index from filename on a background thread using at
+		// most num_threads threads (0 = one per partition), then publish it.
+		// Settings, the doc store columns, query cache capacity, merging and
+		// following carry over.
+		void rebuild(const std::string& filename, uint16_t num_partitions, uint16_t num_threads);
+
+		bool is_rebuilding() const;
+
+		// Block until a running rebuild has published.
+		void wait();
+
+	private:
+		void retire(_BM25* bm25);
+		void reclaim();
+
+		std::shared_ptr<_BM25> current;
+
+		std::thread       rebuild_thread;
+		std::mutex        rebuild_mutex;
+		std::atomic<bool> rebuilding;
+
+		// Indexes whose last snapshot was released, waiting to be freed.
+		std::vector<_BM25*>     retired;
+		std::thread             reclaim_thread;
+		std::mutex              reclaim_mutex;
+		std::condition_variable reclaim_cv;
+		bool                    stop_reclaim;
+};
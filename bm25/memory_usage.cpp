@@ -0,0 +1,40 @@
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "memory_usage.h"
+
+
+uint64_t heap_bytes(const void* ptr) {
+	if (ptr == NULL) return 0;
+	return malloc_usable_size((void*)ptr) + sizeof(size_t);
+}
+
+uint64_t mapped_resident_bytes(const void* addr, uint64_t size) {
+	if (addr == NULL || size == 0) return 0;
+
+	const uint64_t page_size = sysconf(_SC_PAGESIZE);
+	uint64_t start = (uint64_t)addr;
+	uint64_t end   = start + size;
+	uint64_t first_page = start & ~(page_size - 1);
+	uint64_t num_pages  = (end - first_page + page_size - 1) / page_size;
+
+	std::vector<unsigned char> pages(num_pages);
+	if (mincore((void*)first_page, end - first_page, pages.data()) != 0) {
+		return 0;
+	}
+
+	// Count only the part of the first and last page the range covers.
+	uint64_t resident = 0;
+	for (uint64_t idx = 0; idx < num_pages; ++idx) {
+		if (!(pages[idx] & 1)) continue;
+
+		uint64_t page_start = first_page + idx * page_size;
+		uint64_t page_end   = page_start + page_size;
+		resident += std::min(page_end, end) - std::max(page_start, start);
+	}
+	return resident;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <new>
+#include <string>
+#include <type_traits>
+
+
+// Bytes malloc handed out for ptr, slack and chunk header included. 0 for NULL.
+uint64_t heap_bytes(const void* ptr);
+
+// Heap bytes of a string's buffer. 0 while it fits inside the string itself.
+inline uint64_t string_heap_bytes(const std::string& str) {
+	const char* data   = str.data();
+	const char* object = (const char*)&str;
+	if (data >= object && data < object + sizeof(std::string)) return 0;
+	return heap_bytes(data);
+}
+
+// Bytes of [addr, addr + size) in resident pages of a file mapping.
+uint64_t mapped_resident_bytes(const void* addr, uint64_t size);
+
+
+// Allocator that adds the heap bytes of every allocation to *bytes and takes
+// them off again on free. Containers built with one report their exact heap
+// footprint, bucket arrays, load factor slack and all.
+// The counter isn't atomic. A container must only grow on one thread at a time.
+template <typename T>
+class CountingAllocator {
+	public:
+		typedef T value_type;
+		typedef std::true_type propagate_on_container_copy_assignment;
+		typedef std::true_type propagate_on_container_move_assignment;
+		typedef std::true_type propagate_on_container_swap;
+
+		CountingAllocator() : bytes(NULL) {}
+		CountingAllocator(uint64_t* bytes) : bytes(bytes) {}
+
+		template <typename U>
+		CountingAllocator(const CountingAllocator<U>& other) : bytes(other.bytes) {}
+
+		T* allocate(size_t n) {
+			T* ptr = (T*)malloc(n * sizeof(T));
+			if (ptr == NULL) throw std::bad_alloc();
+
+			if (bytes != NULL) *bytes += heap_bytes(ptr);
+			return ptr;
+		}
+
+		void deallocate(T* ptr, size_t) {
+			if (bytes != NULL) *bytes -= heap_bytes(ptr);
+			free(ptr);
+		}
+
+		// NULL counts nothing.
+		uint64_t* bytes;
+};
+
+template <typename T, typename U>
+inline bool operator==(const CountingAllocator<T>& a, const CountingAllocator<U>& b) {
+	return a.bytes == b.bytes;
+}
+
+template <typename T, typename U>
+inline bool operator!=(const CountingAllocator<T>& a, const CountingAllocator<U>& b) {
+	return a.bytes != b.bytes;
+}
@@ -0,0 +1,95 @@
+#include <thread>
+#include <algorithm>
+
+#include "merge_policy.h"
+
+
+MergePolicy default_merge_policy() {
+	MergePolicy policy;
+	policy.merge_factor      = MERGE_FACTOR;
+	policy.min_segment_docs  = MERGE_MIN_SEGMENT_DOCS;
+	policy.max_segment_docs  = 0;
+	policy.cpu_budget        = MERGE_CPU_BUDGET;
+	policy.max_bytes_per_sec = 0;
+	return policy;
+}
+
+static inline uint32_t get_tier(uint64_t num_docs, const MergePolicy& policy) {
+	uint32_t tier = 0;
+	for (uint64_t size = policy.min_segment_docs; num_docs > size && tier < 64; size *= policy.merge_factor) {
+		++tier;
+	}
+	return tier;
+}
+
+bool find_merge(
+		const std::vector<uint64_t>& segment_docs,
+		const MergePolicy& policy,
+		uint16_t& start,
+		uint16_t& end
+		) {
+	if (policy.merge_factor < 2) return false;
+
+	bool     found     = false;
+	uint32_t best_tier = UINT32_MAX;
+
+	// Walk runs of adjacent segments in the same tier. Segments already at the
+	// size cap never merge and end a run.
+	size_t run_start = 0;
+	while (run_start < segment_docs.size()) {
+		uint32_t tier    = get_tier(segment_docs[run_start], policy);
+		size_t   run_end = run_start;
+		while (run_end < segment_docs.size() && get_tier(segment_docs[run_end], policy) == tier) {
+			++run_end;
+		}
+
+		// Take the first merge_factor segments of the run that fit under the cap.
+		uint64_t merged_docs = 0;
+		size_t   idx = run_start;
+		for (; idx < run_end && idx - run_start < policy.merge_factor; ++idx) {
+			if (merged_docs + segment_docs[idx] > policy.max_segment_docs) break;
+			merged_docs += segment_docs[idx];
+		}
+
+		if (idx - run_start == policy.merge_factor && tier < best_tier) {
+			found     = true;
+			best_tier = tier;
+			start     = (uint16_t)run_start;
+			end       = (uint16_t)idx;
+		}
+		run_start = run_end;
+	}
+	return found;
+}
+
+
+MergeThrottle::MergeThrottle(const MergePolicy& policy, const std::atomic<bool>* stop) :
+	cpu_budget(policy.cpu_budget),
+	max_bytes_per_sec(policy.max_bytes_per_sec),
+	stop(stop),
+	resumed(std::chrono::steady_clock::now()) {}
+
+void MergeThrottle::pace(uint64_t bytes) {
+	auto now = std::chrono::steady_clock::now();
+	double busy_s = std::chrono::duration<double>(now - resumed).count();
+
+	double sleep_s = 0.0;
+	if (cpu_budget > 0.0f && cpu_budget < 1.0f) {
+		sleep_s = busy_s * (1.0 - cpu_budget) / cpu_budget;
+	}
+	if (max_bytes_per_sec > 0) {
+		double io_s = (double)bytes / max_bytes_per_sec - busy_s;
+		if (io_s > sleep_s) sleep_s = io_s;
+	}
+
+	// Sleep in slices so a stop request isn't held up by a long pause.
+	const std::chrono::steady_clock::duration slice = std::chrono::milliseconds(10);
+	auto wake = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(sleep_s)
+			);
+	for (auto t = now; t < wake; t = std::chrono::steady_clock::now()) {
+		if (stop != NULL && stop->load(std::memory_order_relaxed)) break;
+		std::this_thread::sleep_for(std::min(slice, wake - t));
+	}
+	resumed = std::chrono::steady_clock::now();
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#define MERGE_FACTOR           10
+#define MERGE_MIN_SEGMENT_DOCS 1000
+#define MERGE_CPU_BUDGET       0.25f
+
+
+typedef struct {
+	// Segments within a factor of merge_factor in size share a tier.
+	// A tier merges once it has merge_factor adjacent segments.
+	uint32_t merge_factor;
+
+	// Segments up to this many docs all count as the smallest tier.
+	uint64_t min_segment_docs;
+
+	// Merges never produce a segment above this many docs. 0 caps them at the
+	// largest partition when merging starts, which keeps the partitions of the
+	// initial build, and the query parallelism they give, as they are.
+	uint64_t max_segment_docs;
+
+	// Fraction of one core a merge may keep busy. 1 disables cpu throttling.
+	float cpu_budget;
+
+	// Postings bytes merged per second. 0 disables io throttling.
+	uint64_t max_bytes_per_sec;
+} MergePolicy;
+
+MergePolicy default_merge_policy();
+
+// Picks the run of adjacent segments [start, end) to merge next, smallest tier first.
+// Returns false if no tier is full.
+bool find_merge(
+		const std::vector<uint64_t>& segment_docs,
+		const MergePolicy& policy,
+		uint16_t& start,
+		uint16_t& end
+		);
+
+// Paces a merge to its cpu and io budget. Call pace after each unit of work.
+class MergeThrottle {
+	public:
+		MergeThrottle(const MergePolicy& policy, const std::atomic<bool>* stop = NULL);
+
+		// Sleeps until the time since the last call, and bytes, fit the budget.
+		void pace(uint64_t bytes);
+
+	private:
+		float    cpu_budget;
+		uint64_t max_bytes_per_sec;
+		const std::atomic<bool>* stop;
+
+		std::chrono::steady_clock::time_point resumed;
+};
@@ -0,0 +1,128 @@
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "numa.h"
+
+
+#define NUMA_MAX_NODES 1024
+
+typedef struct {
+	std::vector<uint16_t>  nodes;
+	std::vector<cpu_set_t> node_cpus;
+} NumaTopology;
+
+// Parses a sysfs list such as "0-3,8,10-11" into set.
+static void parse_id_list(const std::string& list, cpu_set_t* set) {
+	CPU_ZERO(set);
+
+	std::stringstream stream(list);
+	std::string range;
+	while (std::getline(stream, range, ',')) {
+		if (range.empty()) continue;
+
+		size_t dash = range.find('-');
+		int first = std::stoi(range.substr(0, dash));
+		int last  = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+		for (int id = first; id <= last && id < CPU_SETSIZE; ++id) {
+			CPU_SET(id, set);
+		}
+	}
+}
+
+static bool read_sysfs_line(const std::string& path, std::string& line) {
+	std::ifstream file(path);
+	return file.is_open() && std::getline(file, line);
+}
+
+static NumaTopology read_numa_topology(const std::string& sysfs_dir) {
+	NumaTopology topology;
+
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0) {
+		CPU_ZERO(&allowed);
+		for (int id = 0; id < CPU_SETSIZE; ++id) CPU_SET(id, &allowed);
+	}
+
+	std::string online;
+	if (read_sysfs_line(sysfs_dir + "/online", online)) {
+		cpu_set_t node_ids;
+		parse_id_list(online, &node_ids);
+
+		for (int node = 0; node < NUMA_MAX_NODES && node < CPU_SETSIZE; ++node) {
+			if (!CPU_ISSET(node, &node_ids)) continue;
+
+			std::string cpu_list;
+			if (!read_sysfs_line(sysfs_dir + "/node" + std::to_string(node) + "/cpulist", cpu_list)) {
+				continue;
+			}
+
+			// Memory only nodes, and nodes this process can't run on, get no partitions.
+			cpu_set_t cpus;
+			parse_id_list(cpu_list, &cpus);
+			CPU_AND(&cpus, &cpus, &allowed);
+			if (CPU_COUNT(&cpus) == 0) continue;
+
+			topology.nodes.push_back((uint16_t)node);
+			topology.node_cpus.push_back(cpus);
+		}
+	}
+
+	if (topology.nodes.empty()) {
+		topology.nodes.push_back(0);
+		topology.node_cpus.push_back(allowed);
+	}
+	return topology;
+}
+
+static const NumaTopology& get_numa_topology() {
+	static const NumaTopology topology = read_numa_topology("/sys/devices/system/node");
+	return topology;
+}
+
+uint16_t get_num_numa_nodes() {
+	return (uint16_t)get_numa_topology().nodes.size();
+}
+
+const std::vector<uint16_t>& get_numa_nodes() {
+	return get_numa_topology().nodes;
+}
+
+uint16_t numa_node_for_partition(uint16_t partition_id) {
+	const NumaTopology& topology = get_numa_topology();
+	return topology.nodes[partition_id % topology.nodes.size()];
+}
+
+void bind_to_numa_node(void* addr, uint64_t size, uint16_t node) {
+	if (get_num_numa_nodes() < 2 || addr == NULL || size == 0 || node >= NUMA_MAX_NODES) return;
+
+	unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+	mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+
+	// Best effort. Pages land wherever first touch puts them if this fails.
+	syscall(SYS_mbind, addr, size, MPOL_PREFERRED, mask, NUMA_MAX_NODES + 1, 0);
+}
+
+
+NumaAffinity::NumaAffinity(uint16_t node) : pinned(false) {
+	const NumaTopology& topology = get_numa_topology();
+	if (topology.nodes.size() < 2) return;
+
+	for (size_t idx = 0; idx < topology.nodes.size(); ++idx) {
+		if (topology.nodes[idx] != node) continue;
+
+		if (sched_getaffinity(0, sizeof(cpu_set_t), &previous) != 0) return;
+		pinned = (sched_setaffinity(0, sizeof(cpu_set_t), &topology.node_cpus[idx]) == 0);
+		return;
+	}
+}
+
+NumaAffinity::~NumaAffinity() {
+	if (pinned) {
+		sched_setaffinity(0, sizeof(cpu_set_t), &previous);
+	}
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <sched.h>
+
+#include <vector>
+
+
+// NUMA topology, read once from /sys/devices/system/node. Only nodes with
+// CPUs this process may run on count. A machine without NUMA, or without
+// sysfs, is one node 0 holding every allowed CPU.
+uint16_t get_num_numa_nodes();
+
+// Node ids, e.g. {0, 1}. Not necessarily contiguous.
+const std::vector<uint16_t>& get_numa_nodes();
+
+// Node a partition is placed on. Partitions go round robin over the nodes, so
+// each socket holds and scores an even share of the index.
+uint16_t numa_node_for_partition(uint16_t partition_id);
+
+// Prefer node for the pages of [addr, addr + size) faulted in from now on.
+// Falls back to other nodes when node runs out, like first touch would.
+// Does nothing on a single node.
+void bind_to_numa_node(void* addr, uint64_t size, uint16_t node);
+
+
+// Restricts the calling thread to the CPUs of node while in scope, so what it
+// allocates and touches lands on node. Restores the previous affinity after.
+// Does nothing on a single node.
+class NumaAffinity {
+	public:
+		NumaAffinity(uint16_t node);
+		~NumaAffinity();
+
+		NumaAffinity(const NumaAffinity&) = delete;
+		NumaAffinity& operator=(const NumaAffinity&) = delete;
+
+	private:
+		cpu_set_t previous;
+		bool      pinned;
+};
@@ -0,0 +1,95 @@
+#include <ctype.h>
+#include <string.h>
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "query_cache.h"
+
+
+bool QueryCache::get(const std::string& key, QueryCacheEntry& entry) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto it = entries.find(key);
+	if (it == entries.end()) {
+		misses.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	// Move to front of LRU list.
+	lru.splice(lru.begin(), lru, it->second);
+	entry = it->second->second;
+
+	hits.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+void QueryCache::put(const std::string& key, const QueryCacheEntry& entry) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (capacity == 0) return;
+
+	auto it = entries.find(key);
+	if (it != entries.end()) {
+		it->second->second = entry;
+		lru.splice(lru.begin(), lru, it->second);
+		return;
+	}
+
+	lru.emplace_front(key, entry);
+	entries[key] = lru.begin();
+	evict();
+}
+
+void QueryCache::evict() {
+	while (lru.size() > capacity) {
+		entries.erase(lru.back().first);
+		lru.pop_back();
+	}
+}
+
+void QueryCache::clear() {
+	std::lock_guard<std::mutex> lock(mutex);
+	lru.clear();
+	entries.clear();
+}
+
+void QueryCache::set_capacity(uint64_t _capacity) {
+	std::lock_guard<std::mutex> lock(mutex);
+	capacity = _capacity;
+	evict();
+}
+
+QueryCacheStats QueryCache::get_stats() {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	QueryCacheStats stats;
+	stats.hits     = hits.load(std::memory_order_relaxed);
+	stats.misses   = misses.load(std::memory_order_relaxed);
+	stats.size     = lru.size();
+	stats.capacity = capacity;
+	return stats;
+}
+
+std::string get_query_cache_key(
+		const CompiledQuery& query,
+		uint32_t k,
+		uint32_t query_max_df,
+		const std::vector<float>& boost_factors
+		) {
+	// Normalized terms of each column separated by single spaces.
+	std::string key;
+	for (const auto& col_terms : query.terms) {
+		for (size_t term_idx = 0; term_idx < col_terms.size(); ++term_idx) {
+			if (term_idx > 0) key += ' ';
+			key += col_terms[term_idx].term;
+		}
+		key += '\x1f';
+	}
+
+	key.append((const char*)&k, sizeof(k));
+	key.append((const char*)&query_max_df, sizeof(query_max_df));
+	key.append((const char*)boost_factors.data(), boost_factors.size() * sizeof(float));
+	return key;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "engine.h"
+
+
+typedef struct {
+	std::vector<BM25Result> results;
+	std::vector<std::vector<std::pair<std::string, std::string>>> rows;
+	bool has_rows;
+} QueryCacheEntry;
+
+// Bounded LRU cache of query results keyed by a normalized query string.
+class QueryCache {
+	public:
+		QueryCache(uint64_t capacity) : capacity(capacity), hits(0), misses(0) {}
+
+		bool get(const std::string& key, QueryCacheEntry& entry);
+		void put(const std::string& key, const QueryCacheEntry& entry);
+		void clear();
+		void set_capacity(uint64_t capacity);
+		QueryCacheStats get_stats();
+
+	private:
+		typedef std::list<std::pair<std::string, QueryCacheEntry>> LRUList;
+
+		void evict();
+
+		uint64_t capacity;
+		LRUList  lru;
+		MAP<std::string, LRUList::iterator> entries;
+		std::mutex mutex;
+
+		std::atomic<uint64_t> hits;
+		std::atomic<uint64_t> misses;
+};
+
+std::string get_query_cache_key(
+		const CompiledQuery& query,
+		uint32_t k,
+		uint32_t query_max_df,
+		const std::vector<float>& boost_factors
+		);
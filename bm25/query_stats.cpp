@@ -0,0 +1,141 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <vector>
+
+#include "query_stats.h"
+
+
+static thread_local QueryStats last_query_stats = {};
+
+void init_query_stats(QueryStats* stats) {
+	memset(stats, 0, sizeof(QueryStats));
+}
+
+void add_query_stats(QueryStats* dst, const QueryStats* src) {
+	dst->postings_scanned   += src->postings_scanned;
+	dst->bytes_decoded      += src->bytes_decoded;
+	dst->candidates         += src->candidates;
+	dst->partitions_touched += src->partitions_touched;
+	dst->approximate        |= src->approximate;
+}
+
+QueryStats get_last_query_stats() {
+	return last_query_stats;
+}
+
+static inline uint32_t get_bucket_idx(uint64_t ns) {
+	if (ns < LATENCY_SUB_BUCKETS) return (uint32_t)ns;
+
+	// Top LATENCY_SUB_BUCKET_BITS + 1 bits of the value pick the bucket.
+	uint32_t exponent  = 63 - __builtin_clzll(ns);
+	uint32_t sub_idx   = (uint32_t)(ns >> (exponent - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+	return (exponent - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS + sub_idx;
+}
+
+static inline uint64_t get_bucket_upper_bound(uint32_t bucket_idx) {
+	if (bucket_idx < LATENCY_SUB_BUCKETS) return bucket_idx;
+
+	uint32_t exponent = bucket_idx / LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKET_BITS - 1;
+	uint64_t sub_idx  = bucket_idx % LATENCY_SUB_BUCKETS;
+	uint64_t shift    = exponent - LATENCY_SUB_BUCKET_BITS;
+	return ((LATENCY_SUB_BUCKETS + sub_idx + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+	buckets[get_bucket_idx(ns)].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+	total_ns.fetch_add(ns, std::memory_order_relaxed);
+
+	uint64_t current = max_ns.load(std::memory_order_relaxed);
+	while (ns > current) {
+		if (max_ns.compare_exchange_weak(current, ns, std::memory_order_relaxed)) break;
+	}
+}
+
+uint64_t LatencyHistogram::get_percentile(double percentile) const {
+	uint64_t total = count.load(std::memory_order_relaxed);
+	if (total == 0) return 0;
+
+	uint64_t rank = (uint64_t)(percentile / 100.0 * total);
+	if (rank >= total) rank = total - 1;
+
+	uint64_t seen = 0;
+	for (uint32_t idx = 0; idx < LATENCY_NUM_BUCKETS; ++idx) {
+		seen += buckets[idx].load(std::memory_order_relaxed);
+		if (seen > rank) {
+			uint64_t upper = get_bucket_upper_bound(idx);
+			uint64_t max_seen = max_ns.load(std::memory_order_relaxed);
+			return (upper < max_seen) ? upper : max_seen;
+		}
+	}
+	return max_ns.load(std::memory_order_relaxed);
+}
+
+LatencySummary LatencyHistogram::get_summary() const {
+	LatencySummary summary;
+	summary.count    = count.load(std::memory_order_relaxed);
+	summary.total_ns = total_ns.load(std::memory_order_relaxed);
+	summary.max_ns   = max_ns.load(std::memory_order_relaxed);
+	summary.p50_ns   = get_percentile(50.0);
+	summary.p90_ns   = get_percentile(90.0);
+	summary.p99_ns   = get_percentile(99.0);
+	summary.p999_ns  = get_percentile(99.9);
+	return summary;
+}
+
+void LatencyHistogram::reset() {
+	for (uint32_t idx = 0; idx < LATENCY_NUM_BUCKETS; ++idx) {
+		buckets[idx].store(0, std::memory_order_relaxed);
+	}
+	count.store(0, std::memory_order_relaxed);
+	total_ns.store(0, std::memory_order_relaxed);
+	max_ns.store(0, std::memory_order_relaxed);
+}
+
+void QueryStatsRecorder::record(const QueryStats& stats) {
+	num_queries.fetch_add(1, std::memory_order_relaxed);
+	postings_scanned.fetch_add(stats.postings_scanned, std::memory_order_relaxed);
+	bytes_decoded.fetch_add(stats.bytes_decoded, std::memory_order_relaxed);
+	candidates.fetch_add(stats.candidates, std::memory_order_relaxed);
+	partitions_touched.fetch_add(stats.partitions_touched, std::memory_order_relaxed);
+
+	// Skipped phases (e.g. scoring on a cache hit) are not recorded.
+	for (int phase = 0; phase < NUM_QUERY_PHASES; ++phase) {
+		if (stats.phase_ns[phase] > 0) {
+			phase_latency[phase].record(stats.phase_ns[phase]);
+		}
+	}
+	total_latency.record(stats.total_ns);
+
+	last_query_stats = stats;
+}
+
+QueryStatsSummary QueryStatsRecorder::get_summary() const {
+	QueryStatsSummary summary;
+	summary.num_queries        = num_queries.load(std::memory_order_relaxed);
+	summary.postings_scanned   = postings_scanned.load(std::memory_order_relaxed);
+	summary.bytes_decoded      = bytes_decoded.load(std::memory_order_relaxed);
+	summary.candidates         = candidates.load(std::memory_order_relaxed);
+	summary.partitions_touched = partitions_touched.load(std::memory_order_relaxed);
+
+	for (int phase = 0; phase < NUM_QUERY_PHASES; ++phase) {
+		summary.phase_latency.push_back(phase_latency[phase].get_summary());
+	}
+	summary.total_latency = total_latency.get_summary();
+	return summary;
+}
+
+void QueryStatsRecorder::reset() {
+	num_queries.store(0, std::memory_order_relaxed);
+	postings_scanned.store(0, std::memory_order_relaxed);
+	bytes_decoded.store(0, std::memory_order_relaxed);
+	candidates.store(0, std::memory_order_relaxed);
+	partitions_touched.store(0, std::memory_order_relaxed);
+
+	for (int phase = 0; phase < NUM_QUERY_PHASES; ++phase) {
+		phase_latency[phase].reset();
+	}
+	total_latency.reset();
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+// Log-linear buckets, 2^LATENCY_SUB_BUCKET_BITS per power of two (~6% precision).
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_SUB_BUCKETS     (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_NUM_BUCKETS     ((64 - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+
+enum QueryPhase {
+	PHASE_TOKENIZE,
+	PHASE_SCORE,
+	PHASE_MERGE,
+	PHASE_FETCH,
+	NUM_QUERY_PHASES
+};
+
+// Work done by a single query. Partition tasks fill their own and the caller sums them.
+typedef struct {
+	uint64_t postings_scanned;
+	uint64_t bytes_decoded;
+	uint64_t candidates;
+	uint64_t partitions_touched;
+
+	uint64_t phase_ns[NUM_QUERY_PHASES];
+	uint64_t total_ns;
+
+	// Stopped early by its deadline or cancel_queries(). Results are partial.
+	bool approximate;
+} QueryStats;
+
+typedef struct {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t p50_ns;
+	uint64_t p90_ns;
+	uint64_t p99_ns;
+	uint64_t p999_ns;
+} LatencySummary;
+
+typedef struct {
+	uint64_t num_queries;
+	uint64_t postings_scanned;
+	uint64_t bytes_decoded;
+	uint64_t candidates;
+	uint64_t partitions_touched;
+
+	// Indexed by QueryPhase.
+	std::vector<LatencySummary> phase_latency;
+	LatencySummary total_latency;
+} QueryStatsSummary;
+
+void init_query_stats(QueryStats* stats);
+
+// Adds the work counters of src to dst. Phase times are left alone.
+// dst is approximate if either is.
+void add_query_stats(QueryStats* dst, const QueryStats* src);
+
+// Lock-free HDR style histogram of nanosecond latencies.
+class LatencyHistogram {
+	public:
+		LatencyHistogram() { reset(); }
+
+		void record(uint64_t ns);
+		uint64_t get_percentile(double percentile) const;
+		LatencySummary get_summary() const;
+		void reset();
+
+	private:
+		std::atomic<uint64_t> buckets[LATENCY_NUM_BUCKETS];
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> total_ns;
+		std::atomic<uint64_t> max_ns;
+};
+
+// Always-on totals and per phase latency histograms across all queries.
+class QueryStatsRecorder {
+	public:
+		QueryStatsRecorder() { reset(); }
+
+		void record(const QueryStats& stats);
+		QueryStatsSummary get_summary() const;
+		void reset();
+
+	private:
+		std::atomic<uint64_t> num_queries;
+		std::atomic<uint64_t> postings_scanned;
+		std::atomic<uint64_t> bytes_decoded;
+		std::atomic<uint64_t> candidates;
+		std::atomic<uint64_t> partitions_touched;
+
+		LatencyHistogram phase_latency[NUM_QUERY_PHASES];
+		LatencyHistogram total_latency;
+};
+
+// Stats of the last query recorded on the calling thread.
+QueryStats get_last_query_stats();
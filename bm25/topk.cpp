@@ -0,0 +1,224 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <float.h>
+
+#include <vector>
+#include <algorithm>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "topk.h"
+
+
+void init_topk_heap(TopKHeap* heap, uint32_t capacity) {
+	// No slots for k = 0. Pushes are dropped and there is no threshold.
+	heap->data     = (capacity > 0) ? (BM25Result*)malloc(capacity * sizeof(BM25Result)) : NULL;
+	heap->size     = 0;
+	heap->capacity = capacity;
+}
+
+void free_topk_heap(TopKHeap* heap) {
+	free(heap->data);
+	heap->data = NULL;
+}
+
+static inline void sift_down(BM25Result* data, uint32_t size, uint32_t idx) {
+	BM25Result item = data[idx];
+	while (true) {
+		uint32_t child = 2 * idx + 1;
+		if (child >= size) break;
+
+		// Pick the smaller child. data[size] is past the heap, so check bounds first.
+		if (child + 1 < size && data[child + 1].score < data[child].score) ++child;
+		if (data[child].score >= item.score) break;
+
+		data[idx] = data[child];
+		idx = child;
+	}
+	data[idx] = item;
+}
+
+static inline void sift_up(BM25Result* data, uint32_t idx) {
+	BM25Result item = data[idx];
+	while (idx > 0) {
+		uint32_t parent = (idx - 1) / 2;
+		if (data[parent].score <= item.score) break;
+
+		data[idx] = data[parent];
+		idx = parent;
+	}
+	data[idx] = item;
+}
+
+void topk_heap_push(TopKHeap* heap, const BM25Result& result) {
+	if (heap->size < heap->capacity) {
+		heap->data[heap->size] = result;
+		sift_up(heap->data, heap->size++);
+		return;
+	}
+
+	if (heap->capacity == 0 || result.score <= heap->data[0].score) return;
+
+	heap->data[0] = result;
+	sift_down(heap->data, heap->size, 0);
+}
+
+float topk_heap_threshold(const TopKHeap* heap) {
+	if (heap->size == 0) return -FLT_MAX;
+	return heap->data[0].score;
+}
+
+void topk_heap_extract_sorted(TopKHeap* heap, std::vector<BM25Result>& out) {
+	// In place heap sort. Each pop moves the current minimum to the back.
+	for (uint32_t end = heap->size; end > 1; --end) {
+		std::swap(heap->data[0], heap->data[end - 1]);
+		sift_down(heap->data, end - 1, 0);
+	}
+
+	out.assign(heap->data, heap->data + heap->size);
+	heap->size = 0;
+}
+
+size_t topk_filter_scores(
+		const float* scores,
+		size_t n,
+		float threshold,
+		uint32_t* out_idxs
+		) {
+	size_t num_found = 0;
+	size_t i = 0;
+
+#ifdef __AVX2__
+	const __m256 thresholds = _mm256_set1_ps(threshold);
+	for (; i + 8 <= n; i += 8) {
+		__m256 values = _mm256_loadu_ps(&scores[i]);
+		uint32_t mask = (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(values, thresholds, _CMP_GE_OQ));
+
+		while (mask != 0) {
+			out_idxs[num_found++] = i + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	for (; i < n; ++i) {
+		out_idxs[num_found] = i;
+		num_found += (scores[i] >= threshold);
+	}
+	return num_found;
+}
+
+static void topk_select_large(
+		const uint64_t* doc_ids,
+		const float* scores,
+		size_t n,
+		uint32_t k,
+		uint16_t partition_id,
+		float min_score,
+		std::vector<BM25Result>& out
+		) {
+	// Estimate the k-th best score from a strided sample. Aim ~10% above k
+	// so the filter rarely has to be rerun at min_score.
+	const size_t SAMPLE_SIZE = min(n, (size_t)4096);
+	const size_t stride      = n / SAMPLE_SIZE;
+
+	std::vector<float> sample(SAMPLE_SIZE);
+	for (size_t i = 0; i < SAMPLE_SIZE; ++i) {
+		sample[i] = scores[i * stride];
+	}
+
+	size_t rank = min(SAMPLE_SIZE - 1, (size_t)(1.1 * k * SAMPLE_SIZE / n));
+	std::nth_element(sample.begin(), sample.begin() + rank, sample.end(), std::greater<float>());
+	float threshold = max(min_score, sample[rank]);
+
+	std::vector<uint32_t> candidate_idxs(n);
+	size_t num_candidates = topk_filter_scores(scores, n, threshold, candidate_idxs.data());
+	if (num_candidates < k && threshold > min_score) {
+		num_candidates = topk_filter_scores(scores, n, min_score, candidate_idxs.data());
+	}
+	candidate_idxs.resize(num_candidates);
+
+	auto by_score = [scores](uint32_t a, uint32_t b) { return scores[a] > scores[b]; };
+	if (num_candidates > k) {
+		std::nth_element(candidate_idxs.begin(), candidate_idxs.begin() + k, candidate_idxs.end(), by_score);
+		candidate_idxs.resize(k);
+	}
+	std::sort(candidate_idxs.begin(), candidate_idxs.end(), by_score);
+
+	out.resize(candidate_idxs.size());
+	for (size_t i = 0; i < candidate_idxs.size(); ++i) {
+		out[i].doc_id       = doc_ids[candidate_idxs[i]];
+		out[i].score        = scores[candidate_idxs[i]];
+		out[i].partition_id = partition_id;
+	}
+}
+
+void topk_select(
+		const uint64_t* doc_ids,
+		const float* scores,
+		size_t n,
+		uint32_t k,
+		uint16_t partition_id,
+		float min_score,
+		std::vector<BM25Result>& out
+		) {
+	out.clear();
+	if (n == 0 || k == 0) return;
+
+	if (k >= TOPK_LARGE_K && n > k) {
+		topk_select_large(doc_ids, scores, n, k, partition_id, min_score, out);
+		return;
+	}
+
+	TopKHeap heap;
+	init_topk_heap(&heap, min(k, n));
+	for (size_t i = 0; i < n; ++i) {
+		if (scores[i] < min_score) continue;
+
+		BM25Result result;
+		result.doc_id       = doc_ids[i];
+		result.score        = scores[i];
+		result.partition_id = partition_id;
+		topk_heap_push(&heap, result);
+	}
+	topk_heap_extract_sorted(&heap, out);
+	free_topk_heap(&heap);
+}
+
+std::vector<BM25Result> topk_merge_sorted_runs(
+		const std::vector<BM25Result>* runs,
+		size_t num_runs,
+		uint32_t k
+		) {
+	size_t total = 0;
+	for (size_t i = 0; i < num_runs; ++i) {
+		total += runs[i].size();
+	}
+
+	std::vector<BM25Result> merged;
+	merged.reserve(min(total, (size_t)k));
+
+	// Max-heap of (score, run) over the head of each run.
+	std::vector<std::pair<float, uint32_t>> heads;
+	std::vector<size_t> cursors(num_runs, 0);
+	for (size_t i = 0; i < num_runs; ++i) {
+		if (!runs[i].empty()) heads.emplace_back(runs[i][0].score, (uint32_t)i);
+	}
+	std::make_heap(heads.begin(), heads.end());
+
+	while (!heads.empty() && merged.size() < k) {
+		std::pop_heap(heads.begin(), heads.end());
+		uint32_t run_idx = heads.back().second;
+		heads.pop_back();
+
+		merged.push_back(runs[run_idx][cursors[run_idx]++]);
+
+		if (cursors[run_idx] < runs[run_idx].size()) {
+			heads.emplace_back(runs[run_idx][cursors[run_idx]].score, run_idx);
+			std::push_heap(heads.begin(), heads.end());
+		}
+	}
+	return merged;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "engine.h"
+
+// At or above this k, partition top-k uses the sampled threshold + SIMD filter path.
+#define TOPK_LARGE_K 10'000
+
+
+// Fixed capacity min-heap of BM25Results. The root is the current k-th best.
+typedef struct {
+	BM25Result* data;
+	uint32_t    size;
+	uint32_t    capacity;
+} TopKHeap;
+
+void init_topk_heap(TopKHeap* heap, uint32_t capacity);
+void free_topk_heap(TopKHeap* heap);
+void topk_heap_push(TopKHeap* heap, const BM25Result& result);
+// Score of the root, -FLT_MAX while the heap is empty.
+float topk_heap_threshold(const TopKHeap* heap);
+
+// Empties the heap into out sorted by descending score.
+void topk_heap_extract_sorted(TopKHeap* heap, std::vector<BM25Result>& out);
+
+// Writes the indices of all scores >= threshold to out_idxs. Returns the count.
+size_t topk_filter_scores(
+		const float* scores,
+		size_t n,
+		float threshold,
+		uint32_t* out_idxs
+		);
+
+// Top-k of (doc_ids, scores) with score >= min_score, sorted by descending score.
+void topk_select(
+		const uint64_t* doc_ids,
+		const float* scores,
+		size_t n,
+		uint32_t k,
+		uint16_t partition_id,
+		float min_score,
+		std::vector<BM25Result>& out
+		);
+
+// k-way merge of runs already sorted by descending score. Keeps the first k.
+std::vector<BM25Result> topk_merge_sorted_runs(
+		const std::vector<BM25Result>* runs,
+		size_t num_runs,
+		uint32_t k
+		);
@@ -4,6 +4,7 @@ import json
 import csv
 
 from time import perf_counter
+import fcntl
 import os
 
 from bloom25 import BM25
@@ -59,16 +60,21 @@ class SearchApp:
                 ## b=0.4,
                 ## k1=1.5
                 )
-        self.save_dir = filename.split('/')[-1].replace('.csv', '_db')
-        try:
-            raise Exception("Not loading BM25 index")
-            self.bm25.load(db_dir=self.save_dir)
-        except Exception as e:
-            print(f"Error loading BM25 index: {e}")
-
-            self.bm25.index_file(filename, search_cols)
-            ## self.bm25.save(db_dir=self.save_dir)
-            print(f"Saved BM25 index to {self.save_dir}")
+        ## One index file per host. Every worker maps it read only, so the
+        ## postings are held in memory once however many workers there are.
+        self.save_dir = filename.replace('.csv', '_index.bin').replace('.json', '_index.bin')
+        ## Built by the first process only, e.g. the gunicorn master with --preload.
+        ## Without --preload every worker gets here at once, so the check and the
+        ## build happen under an exclusive lock and the rest wait for the file.
+        with open(self.save_dir + '.lock', 'w') as lock_file:
+            fcntl.flock(lock_file, fcntl.LOCK_EX)
+            if not os.path.exists(self.save_dir):
+                self.bm25.index_file(filename, search_cols)
+                self.bm25.save(db_dir=self.save_dir)
+                print(f"Saved BM25 index to {self.save_dir}")
+
+        ## Load even after building, dropping the private copy for the shared mapping.
+        self.bm25.load(db_dir=self.save_dir)
 
         self.search_cols = search_cols
 
@@ -107,22 +113,25 @@ class SearchApp:
         return vals
 
 
-if __name__ == '__main__':
-    CURRENT_DIR = os.path.dirname(os.path.realpath(__file__))
-    DATA_DIR = f"{CURRENT_DIR}/../../tests"
+CURRENT_DIR = os.path.dirname(os.path.realpath(__file__))
+DATA_DIR = f"{CURRENT_DIR}/../../tests"
 
-    ## FILEPATH = os.path.join(DATA_DIR, 'wiki_articles.csv')
-    ## SEARCH_COLS = ['title', 'body']
+## FILEPATH = os.path.join(DATA_DIR, 'wiki_articles.csv')
+## SEARCH_COLS = ['title', 'body']
 
-    FILEPATH = os.path.join(DATA_DIR, 'mb.csv')
-    ## SEARCH_COLS = ['title', 'artist']
-    SEARCH_COLS = ['TID']
+FILEPATH = os.path.join(DATA_DIR, 'mb.csv')
+## SEARCH_COLS = ['title', 'artist']
+SEARCH_COLS = ['TID']
 
-    search_app = SearchApp(
-            filename=FILEPATH,
-            search_cols=SEARCH_COLS
-            )
+## Module level so multi worker servers share one index file, e.g.
+## gunicorn -w 4 --preload demo.searchapp.main:app
+search_app = SearchApp(
+        filename=FILEPATH,
+        search_cols=SEARCH_COLS
+        )
 
+
+if __name__ == '__main__':
     os.system(f"open {CURRENT_DIR}/index.html")
 
     app.run()
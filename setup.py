@@ -45,6 +45,19 @@ LINK_ARGS = [
 ]
 
 
+## Compress the document store with zstd when it is installed. Blocks are stored raw otherwise.
+ZSTD_INCLUDE_DIRS = [
+    "/usr/include",
+    "/usr/local/include",
+    os.path.join(os.environ.get("CONDA_PREFIX", "/nonexistent"), "include"),
+]
+for include_dir in ZSTD_INCLUDE_DIRS:
+    if os.path.exists(os.path.join(include_dir, "zstd.h")):
+        COMPILER_FLAGS += ["-DBM25_USE_ZSTD", "-I" + include_dir]
+        LINK_ARGS += ["-lzstd", "-L" + os.path.join(os.path.dirname(include_dir), "lib")]
+        break
+
+
 extensions = [
     Extension(
         MODULE_NAME,
@@ -54,6 +67,18 @@ extensions = [
             "bm25/vbyte_encoding.cpp", 
             "bm25/serialize.cpp", 
             "bm25/bloom.cpp",
+            "bm25/query_cache.cpp",
+            "bm25/topk.cpp",
+            "bm25/query_stats.cpp",
+            "bm25/doc_store.cpp",
+            "bm25/index_file.cpp",
+            "bm25/merge_policy.cpp",
+            "bm25/index_handle.cpp",
+            "bm25/memory_usage.cpp",
+            "bm25/arena.cpp",
+            "bm25/numa.cpp",
+            "bm25/external_build.cpp",
+            "bm25/block_cache.cpp",
             ],
         extra_compile_args=COMPILER_FLAGS,
         language="c++",
@@ -3,6 +3,11 @@ from bloom25 import BM25
 import pandas as pd
 import numpy as np
 from tqdm import tqdm
+from collections import Counter
+import time
+import tempfile
+import csv
+import re
 import os
 
 pd.set_option('display.max_rows', None)
@@ -60,8 +65,431 @@ def test_csv_constructor(csv_filename: str, search_col: str = 'name'):
             break
 
 
+def read_csv_rows(csv_filename: str):
+    with open(csv_filename, 'r', newline='') as f:
+        reader = csv.reader(f)
+        header = next(reader)
+        rows = list(reader)
+    return header, rows
+
+
+def write_csv_rows(csv_filename: str, header, rows, mode: str = 'w'):
+    ## header None appends rows only.
+    with open(csv_filename, mode, newline='') as f:
+        writer = csv.writer(f, lineterminator='\n')
+        if header is not None:
+            writer.writerow(header)
+        writer.writerows(rows)
+
+
+def csv_row_key(header, row):
+    ## A row as get_topk_docs returns it, without the score. Csv headers come back lowercased.
+    return tuple(sorted(zip([col.lower() for col in header], row)))
+
+
+def get_queries(header, rows, search_col: str, num_queries: int = 100):
+    ## (row number, query) pairs. The query is the row's search_col value, so
+    ## only plain alphanumeric values are used, which tokenize the same as the query.
+    col_idx = [col.lower() for col in header].index(search_col.lower())
+    queries = []
+    for row_idx in np.random.permutation(len(rows)):
+        value = rows[row_idx][col_idx]
+        if re.fullmatch(r'[a-zA-Z0-9]+( [a-zA-Z0-9]+)*', value):
+            queries.append((int(row_idx), value))
+        if len(queries) == num_queries:
+            break
+    return queries
+
+
+def get_topk_rows(bm25_model, query: str, k: int):
+    ## (score, row) pairs, best first. Rows are compared by value since row numbers
+    ## are partition local, and partitions differ between the builds compared.
+    results = []
+    for row in bm25_model.get_topk_docs(query, k=k):
+        score = float(row.pop('score'))
+        results.append((score, tuple(sorted(row.items()))))
+    return sorted(results, key=lambda result: (-result[0], result[1]))
+
+
+def test_query_cache_invalidation(csv_filename: str, search_col: str = 'name', num_rows: int = 20000):
+    ## Cached results must not outlive a delete or an append.
+    header, rows = read_csv_rows(csv_filename)
+    rows = rows[:num_rows]
+    row_counts = Counter(csv_row_key(header, row) for row in rows)
+
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        filename = os.path.join(tmp_dir, 'cache.csv')
+        write_csv_rows(filename, header, rows)
+
+        bm25_model = BM25()
+        bm25_model.index_file(filename=filename, search_cols=[search_col])
+        bm25_model.enable_query_cache()
+
+        queries = get_queries(header, rows, search_col, 20)
+        for _, query in tqdm(queries, desc="Cached queries"):
+            results = get_topk_rows(bm25_model, query, k=1000000)
+            assert get_topk_rows(bm25_model, query, k=1000000) == results
+        assert bm25_model.get_query_cache_stats()['hits'] >= len(queries)
+
+        row_idx, query = next(
+            (row_idx, query) for row_idx, query in queries 
+            if row_counts[csv_row_key(header, rows[row_idx])] == 1
+        )
+        key = csv_row_key(header, rows[row_idx])
+        assert key in [row for _, row in get_topk_rows(bm25_model, query, k=1000000)]
+
+        bm25_model.delete([row_idx])
+        assert key not in [row for _, row in get_topk_rows(bm25_model, query, k=1000000)]
+
+        ## Written again, the row is back after the next append.
+        write_csv_rows(filename, None, [rows[row_idx]], mode='a')
+        bm25_model.append()
+        assert key in [row for _, row in get_topk_rows(bm25_model, query, k=1000000)]
+
+
+def test_topk_selection(csv_filename: str, search_col: str = 'name', num_rows: int = 20000):
+    ## The top k, for k of 0, small, and past the number of matches, must be
+    ## the best k of all matches by a plain sort.
+    header, rows = read_csv_rows(csv_filename)
+    rows = rows[:num_rows]
+    col_idx = [col.lower() for col in header].index(search_col.lower())
+
+    bm25_model = BM25()
+    bm25_model.index_documents(documents=[row[col_idx] for row in rows])
+
+    for _, query in tqdm(get_queries(header, rows, search_col), desc="Top-k"):
+        all_scores, all_indices = bm25_model.get_topk_indices(query, k=1000000)
+        expected = sorted(zip(all_scores, all_indices), key=lambda result: -result[0])
+
+        for k in [0, 1, 10, len(expected) + 10]:
+            scores, indices = bm25_model.get_topk_indices(query, k=k)
+            assert len(scores) == min(k, len(expected))
+            assert list(scores) == [score for score, _ in expected[:k]]
+            if len(scores) == 0:
+                continue
+
+            ## Which of the docs tied at the cut are returned is arbitrary.
+            cut = scores[-1]
+            assert {idx for score, idx in zip(scores, indices) if score > cut} == \
+                   {idx for score, idx in expected if score > cut}
+
+
+def test_topk_batch(csv_filename: str, search_col: str = 'name', num_rows: int = 20000):
+    ## Batched queries, with and without the shared scan, must rank as the
+    ## same queries run one at a time. Indices of documents are row numbers.
+    header, rows = read_csv_rows(csv_filename)
+    rows = rows[:num_rows]
+    col_idx = [col.lower() for col in header].index(search_col.lower())
+
+    bm25_model = BM25(num_partitions=4)
+    bm25_model.index_documents(documents=[row[col_idx] for row in rows])
+
+    ## The shared scan adds up term scores in another order, so scores only
+    ## match to float rounding. Rows tied at the cut may differ.
+    def same_ranking(scores, indices, expected_scores, expected_indices) -> bool:
+        if len(scores) != len(expected_scores):
+            return False
+        if not np.allclose(sorted(scores, reverse=True), sorted(expected_scores, reverse=True), rtol=1e-5):
+            return False
+        if len(scores) == 0:
+            return True
+        cut = min(expected_scores) * (1 + 1e-5)
+        return {idx for score, idx in zip(scores, indices) if score > cut} == \
+               {idx for score, idx in zip(expected_scores, expected_indices) if score > cut}
+
+    queries = [query for _, query in get_queries(header, rows, search_col)]
+    for k in [1, 10, 100]:
+        expected = [bm25_model.get_topk_indices(query, k=k) for query in queries]
+
+        for shared_scan in [False, True]:
+            scores, indices, offsets, _ = bm25_model.get_topk_indices_batch(queries, k=k, shared_scan=shared_scan)
+            assert len(offsets) == len(queries) + 1
+            for query_idx, (expected_scores, expected_indices) in enumerate(expected):
+                start, end = offsets[query_idx], offsets[query_idx + 1]
+                assert same_ranking(
+                        scores[start:end],
+                        indices[start:end],
+                        expected_scores,
+                        expected_indices
+                        ), queries[query_idx]
+
+
+def same_results(a, b) -> bool:
+    ## Same scores, and the same rows above the lowest one. Which of the rows
+    ## tied at the cut are returned depends on which partition finishes first.
+    if [score for score, _ in a] != [score for score, _ in b]:
+        return False
+    if len(a) == 0:
+        return True
+    cut = a[-1][0]
+    return [result for result in a if result[0] != cut] == [result for result in b if result[0] != cut]
+
+
+def test_save_load(csv_filename: str, search_col: str = 'name', num_rows: int = 20000):
+    ## A loaded index must answer as the index that was saved, for files and documents.
+    header, rows = read_csv_rows(csv_filename)
+    rows = rows[:num_rows]
+    col_idx = [col.lower() for col in header].index(search_col.lower())
+    queries = get_queries(header, rows, search_col)
+
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        filename = os.path.join(tmp_dir, 'save.csv')
+        write_csv_rows(filename, header, rows)
+
+        bm25_model = BM25()
+        bm25_model.index_file(filename=filename, search_cols=[search_col])
+        bm25_model.save(db_dir=os.path.join(tmp_dir, 'file_index.bin'))
+
+        loaded_model = BM25()
+        loaded_model.load(db_dir=os.path.join(tmp_dir, 'file_index.bin'))
+
+        for _, query in tqdm(queries, desc="Save/load file"):
+            assert same_results(
+                get_topk_rows(bm25_model, query, k=10), 
+                get_topk_rows(loaded_model, query, k=10)
+            )
+
+        bm25_model = BM25()
+        bm25_model.index_documents(documents=[row[col_idx] for row in rows])
+        bm25_model.save(db_dir=os.path.join(tmp_dir, 'documents_index.bin'))
+
+        loaded_model = BM25()
+        loaded_model.load(db_dir=os.path.join(tmp_dir, 'documents_index.bin'))
+
+        for _, query in tqdm(queries, desc="Save/load documents"):
+            scores, indices = bm25_model.get_topk_indices(query, k=1000000)
+            loaded_scores, loaded_indices = loaded_model.get_topk_indices(query, k=1000000)
+            assert sorted(zip(scores, indices)) == sorted(zip(loaded_scores, loaded_indices))
+
+
+def index_in_segments(filename: str, header, rows, search_col: str, num_appends: int):
+    ## Index the first half of rows, then append the rest in num_appends segments.
+    half = len(rows) // 2
+    write_csv_rows(filename, header, rows[:half])
+
+    bm25_model = BM25(num_partitions=4)
+    bm25_model.index_file(filename=filename, search_cols=[search_col])
+
+    chunk_size = -(-(len(rows) - half) // num_appends)
+    for start in range(half, len(rows), chunk_size):
+        write_csv_rows(filename, None, rows[start:start + chunk_size], mode='a')
+        bm25_model.append()
+    return bm25_model
+
+
+def test_append(csv_filename: str, search_col: str = 'name', num_rows: int = 20000):
+    ## An index grown by appends must answer as one built from the whole file.
+    header, rows = read_csv_rows(csv_filename)
+    rows = rows[:num_rows]
+
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        filename = os.path.join(tmp_dir, 'append.csv')
+        bm25_model = index_in_segments(filename, header, rows, search_col, num_appends=8)
+        assert bm25_model.get_num_segments() == 4 + 8
+
+        full_model = BM25(num_partitions=4)
+        full_model.index_file(filename=filename, search_cols=[search_col])
+
+        for _, query in tqdm(get_queries(header, rows, search_col), desc="Append"):
+            assert same_results(
+                get_topk_rows(bm25_model, query, k=10), 
+                get_topk_rows(full_model, query, k=10)
+            )
+
+
+def test_merge(csv_filename: str, search_col: str = 'name', num_rows: int = 20000):
+    ## Merging appended segments must not change any result.
+    header, rows = read_csv_rows(csv_filename)
+    rows = rows[:num_rows]
+
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        filename = os.path.join(tmp_dir, 'merge.csv')
+        bm25_model = index_in_segments(filename, header, rows, search_col, num_appends=8)
+
+        full_model = BM25(num_partitions=4)
+        full_model.index_file(filename=filename, search_cols=[search_col])
+
+        num_segments = bm25_model.get_num_segments()
+        bm25_model.start_merges(merge_factor=2, min_segment_docs=1000, cpu_budget=1.0)
+
+        deadline = time.time() + 60
+        while bm25_model.get_num_segments() == num_segments and time.time() < deadline:
+            time.sleep(0.05)
+        bm25_model.stop_merges()
+        assert bm25_model.get_num_segments() < num_segments
+
+        for _, query in tqdm(get_queries(header, rows, search_col), desc="Merge"):
+            assert same_results(
+                get_topk_rows(bm25_model, query, k=10), 
+                get_topk_rows(full_model, query, k=10)
+            )
+
+        ## Documents have no source file handles to merge.
+        documents_model = BM25()
+        col_idx = [col.lower() for col in header].index(search_col.lower())
+        documents_model.index_documents(documents=[row[col_idx] for row in rows])
+        try:
+            documents_model.start_merges()
+            assert False, "start_merges should refuse an index of documents"
+        except RuntimeError:
+            pass
+
+
+def test_delete(csv_filename: str, search_col: str = 'name', num_rows: int = 20000):
+    ## Deleted rows, in the first segments or appended ones, must drop out of
+    ## results and leave every other result as it was.
+    header, rows = read_csv_rows(csv_filename)
+    rows = rows[:num_rows]
+    row_counts = Counter(csv_row_key(header, row) for row in rows)
+
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        filename = os.path.join(tmp_dir, 'delete.csv')
+        bm25_model = index_in_segments(filename, header, rows, search_col, num_appends=8)
+
+        queries = get_queries(header, rows, search_col, 50)
+        before = {query: get_topk_rows(bm25_model, query, k=1000000) for _, query in queries}
+
+        ## Each query's own row, so every query loses a result.
+        deleted = [row_idx for row_idx, _ in queries if row_counts[csv_row_key(header, rows[row_idx])] == 1]
+        deleted_keys = {csv_row_key(header, rows[row_idx]) for row_idx in deleted}
+        bm25_model.delete(deleted)
+        assert bm25_model.get_num_deleted() == len(deleted)
+
+        for _, query in tqdm(queries, desc="Delete"):
+            expected = [result for result in before[query] if result[1] not in deleted_keys]
+            assert get_topk_rows(bm25_model, query, k=1000000) == expected
+
+
+def test_rebuild_keeps_deletes(csv_filename: str, search_col: str = 'name', num_rows: int = 20000):
+    ## A row replaced by update must stay replaced after a rebuild.
+    header, rows = read_csv_rows(csv_filename)
+    rows = rows[:num_rows]
+    row_counts = Counter(csv_row_key(header, row) for row in rows)
+    col_idx = [col.lower() for col in header].index(search_col.lower())
+
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        filename = os.path.join(tmp_dir, 'rebuild.csv')
+        write_csv_rows(filename, header, rows)
+
+        bm25_model = BM25()
+        bm25_model.index_file(filename=filename, search_cols=[search_col])
+
+        row_idx, query = next(
+            (row_idx, query) for row_idx, query in get_queries(header, rows, search_col) 
+            if row_counts[csv_row_key(header, rows[row_idx])] == 1
+        )
+        corrected = list(rows[row_idx])
+        corrected[col_idx] = query + ' CORRECTED'
+        write_csv_rows(filename, None, [corrected], mode='a')
+        bm25_model.update([row_idx])
+
+        before = get_topk_rows(bm25_model, query, k=1000000)
+        assert csv_row_key(header, rows[row_idx]) not in [row for _, row in before]
+        assert csv_row_key(header, corrected) in [row for _, row in before]
+
+        bm25_model.rebuild(wait=True)
+        assert bm25_model.get_num_deleted() == 1
+        assert get_topk_rows(bm25_model, query, k=1000000) == before
+
+
+def test_external_build(csv_filename: str, search_col: str = 'name', num_rows: int = 20000):
+    ## An index built out of core must answer as one built in memory.
+    header, rows = read_csv_rows(csv_filename)
+    rows = rows[:num_rows]
+
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        filename = os.path.join(tmp_dir, 'external.csv')
+        write_csv_rows(filename, header, rows)
+
+        bm25_model = BM25()
+        bm25_model.index_file(filename=filename, search_cols=[search_col])
+
+        external_model = BM25()
+        external_model.index_file(
+            filename=filename, 
+            search_cols=[search_col], 
+            memory_budget=64 << 20, 
+            index_path=os.path.join(tmp_dir, 'external_index.bin')
+        )
+
+        for _, query in tqdm(get_queries(header, rows, search_col), desc="External build"):
+            assert same_results(
+                get_topk_rows(bm25_model, query, k=10), 
+                get_topk_rows(external_model, query, k=10)
+            )
+
+
+def test_postings_cache(csv_filename: str, search_col: str = 'name', num_rows: int = 20000):
+    ## Postings read through the block cache must score as the mapped postings do,
+    ## even with a cache too small to hold them.
+    header, rows = read_csv_rows(csv_filename)
+    rows = rows[:num_rows]
+
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        filename = os.path.join(tmp_dir, 'cache.csv')
+        write_csv_rows(filename, header, rows)
+        index_path = os.path.join(tmp_dir, 'cache_index.bin')
+
+        bm25_model = BM25()
+        bm25_model.index_file(filename=filename, search_cols=[search_col])
+        bm25_model.save(db_dir=index_path)
+
+        mapped_model = BM25()
+        mapped_model.load(db_dir=index_path)
+
+        ## Rounded up to the smallest cache there is, a few blocks.
+        cached_model = BM25()
+        cached_model.load(db_dir=index_path, postings_cache=1)
+
+        for _, query in tqdm(get_queries(header, rows, search_col), desc="Postings cache"):
+            assert same_results(
+                get_topk_rows(mapped_model, query, k=10), 
+                get_topk_rows(cached_model, query, k=10)
+            )
+        assert cached_model.get_postings_cache_stats()['misses'] > 0
+        assert mapped_model.get_postings_cache_stats()['misses'] == 0
+
+
+def test_query_deadline(csv_filename: str, search_col: str = 'name', num_rows: int = 20000):
+    ## A query past its deadline returns some of its matches and is flagged
+    ## approximate. Its results must not be cached for later queries without one.
+    header, rows = read_csv_rows(csv_filename)
+    rows = rows[:num_rows]
+    col_idx = [col.lower() for col in header].index(search_col.lower())
+
+    bm25_model = BM25()
+    bm25_model.index_documents(documents=[row[col_idx] for row in rows])
+    bm25_model.enable_query_cache()
+
+    for _, query in tqdm(get_queries(header, rows, search_col), desc="Deadline"):
+        ## Scoring can't start within 1 us.
+        scores, indices = bm25_model.get_topk_indices(query, k=10, deadline_us=1)
+        assert bm25_model.get_last_query_stats()["approximate"]
+
+        all_scores, all_indices = bm25_model.get_topk_indices(query, k=1000000)
+        assert not bm25_model.get_last_query_stats()["approximate"]
+        assert set(indices) <= set(all_indices)
+
+        ## Same query and k as the approximate one, so served from the cache if it was cached.
+        scores, indices = bm25_model.get_topk_indices(query, k=10)
+        assert not bm25_model.get_last_query_stats()["approximate"]
+        expected = sorted(zip(all_scores, all_indices), key=lambda result: (-result[0], result[1]))[:10]
+        assert same_results(sorted(zip(scores, indices), key=lambda result: (-result[0], result[1])), expected)
+
+
 if __name__ == '__main__':
     CURRENT_DIR = os.path.dirname(os.path.abspath(__file__))
     FILENAME = os.path.join(CURRENT_DIR, '../../SearchApp/data', 'companies_sorted_100k.csv')
 
     test_csv_constructor(FILENAME)
+    test_query_cache_invalidation(FILENAME)
+    test_topk_selection(FILENAME)
+    test_topk_batch(FILENAME)
+    test_save_load(FILENAME)
+    test_append(FILENAME)
+    test_merge(FILENAME)
+    test_delete(FILENAME)
+    test_rebuild_keeps_deletes(FILENAME)
+    test_external_build(FILENAME)
+    test_postings_cache(FILENAME)
+    test_query_deadline(FILENAME)